@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <vector>
+
+#include <tbb/task_group.h>
+
+#include "rayTracer.cpp"
+#include "threads.cpp"
+
+// Renders a range of frames, with the stages of consecutive frames overlapped: while
+// frame N renders, frame N + 1 is set up (the update callback, then the top-level BVH)
+// on a second scene that shares the meshes of the first one, and the output of frame
+// N - 1 is still being encoded if the output callback hands it to an ImageWriter.
+//
+// The setup runs as a task in the TBB pool that renders the tiles, so it takes one
+// worker away from the render instead of adding threads. Its OpenMP regions (BVH
+// builds) run serially for the same reason.
+class Animation
+{
+public:
+    // Seconds spent in each stage of a frame. Stages of different frames overlap, so
+    // they add up to more than the wall-clock time.
+    struct FrameTimes
+    {
+        int frame = 0;
+        double update = 0;
+        double build = 0;
+        double render = 0;
+        double output = 0;
+        std::optional<ProgressiveStatistics> progressive;
+    };
+
+    struct Statistics
+    {
+        std::vector<FrameTimes> frames;
+        double seconds = 0;
+        // Time the render loop waited for the setup of the next frame.
+        double waitSeconds = 0;
+
+        FrameTimes total() const
+        {
+            FrameTimes sum;
+            for (const auto &frame : frames)
+            {
+                sum.update += frame.update;
+                sum.build += frame.build;
+                sum.render += frame.render;
+                sum.output += frame.output;
+            }
+            return sum;
+        }
+    };
+
+    // Sets up the instances of a frame. It runs concurrently with the render of the
+    // previous frame, on a different scene, so it must not touch the other one.
+    using Update = std::function<void(Scene &, int frame)>;
+    // Receives each frame after its render, on the calling thread, in order.
+    using Output = std::function<void(const Scene &, const Framebuffer &, const FrameTimes &)>;
+
+    // Renders progressively when set.
+    std::optional<ProgressiveSettings> progressive;
+    // Runs the stages one after the other, for comparison.
+    bool overlap = true;
+
+    Animation(Scene &_scene, RayTracer &_tracer) : scene(_scene), tracer(_tracer) {}
+
+    Statistics run(int first, int last, const Update &update, const Output &output)
+    {
+        const auto start = Clock::now();
+        Statistics statistics;
+        Scene spare = scene.share();
+        Scene *scenes[2] = {&scene, &spare};
+        Framebuffer framebuffer(tracer.getWidth(), tracer.getHeight());
+
+        FrameTimes next;
+        prepare(*scenes[0], first, update, next);
+        for (int frame = first; frame <= last; frame++)
+        {
+            FrameTimes times = next;
+            Scene &current = *scenes[(frame - first) % 2];
+            Scene &following = *scenes[(frame - first + 1) % 2];
+
+            tbb::task_group setup;
+            if (overlap && frame < last)
+                setup.run([&]
+                          {
+                              SerialOpenMp serial;
+                              prepare(following, frame + 1, update, next); });
+
+            auto stageStart = Clock::now();
+            framebuffer.clear();
+            tracer.frame = frame;
+            if (progressive)
+                times.progressive = tracer.renderProgressive(current, framebuffer, *progressive);
+            else
+                tracer.render(current, framebuffer);
+            times.render = seconds(stageStart);
+
+            stageStart = Clock::now();
+            setup.wait();
+            statistics.waitSeconds += seconds(stageStart);
+
+            stageStart = Clock::now();
+            output(current, framebuffer, times);
+            times.output = seconds(stageStart);
+            statistics.frames.push_back(times);
+
+            if (!overlap && frame < last)
+                prepare(following, frame + 1, update, next);
+        }
+
+        statistics.seconds = seconds(start);
+        return statistics;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static double seconds(Clock::time_point start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    void prepare(Scene &target, int frame, const Update &update, FrameTimes &times) const
+    {
+        times = FrameTimes{};
+        times.frame = frame;
+        auto start = Clock::now();
+        target.clearInstances();
+        update(target, frame);
+        times.update = seconds(start);
+
+        start = Clock::now();
+        target.update();
+        times.build = seconds(start);
+    }
+
+    Scene &scene;
+    RayTracer &tracer;
+};
@@ -0,0 +1,64 @@
+// Measures how BVH builds (OpenMP) and rendering (TBB) scale with the number
+// of threads on the spot scene. Build with `make scaling`.
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include <cmath>
+
+#include "../rayTracer.cpp"
+#include "../threads.cpp"
+#include "timing.hpp"
+
+int main(int argc, char const *argv[])
+{
+    constexpr int dim = 500;
+    constexpr size_t buildRepetitions = 50;
+
+    // Every scene below registers this material first.
+    constexpr MaterialId procedural = 0;
+    Obj cow("spot/spot_triangulated.obj", procedural);
+
+    std::vector<size_t> threadCounts = {1, 2, 4, 8};
+    if (std::find(threadCounts.begin(), threadCounts.end(), ThreadLimit::hardwareThreads()) == threadCounts.end())
+        threadCounts.push_back(ThreadLimit::hardwareThreads());
+
+#ifndef _OPENMP
+    std::cout << "warning: compiled without OpenMP, BVH builds are single-threaded" << std::endl;
+#endif
+    std::cout << "threads  build (ms)  speedup  render (ms)  speedup" << std::endl;
+
+    double baseBuild = 0;
+    double baseRender = 0;
+    for (auto threads : threadCounts)
+    {
+        ThreadLimit threadLimit(threads);
+
+        const double build = timeMs(buildRepetitions, [&]
+                                    { Mesh mesh(cow.getMesh(), procedural); });
+
+        Scene scene;
+        scene.addMaterial(ProceduralMaterial{});
+        const auto mesh = scene.addMesh(cow);
+        scene.addInstance(mesh, cow.setDisplacement(-0.9, 0, 1.5).setRotation(0.5, 0.5, 0).getTransform());
+        scene.addInstance(mesh, cow.setDisplacement(0.9, 0, 2.5).setRotation(0.5, 0.5, 0).getTransform());
+        scene.addInstance(mesh, cow.setDisplacement(0, 0, 2.5).setRotation(0.5, 0.5, 0).getTransform());
+        scene.update();
+
+        RayTracer tracer(Point{0, 0, 0}, Point{0, 0, 3}, dim, dim);
+        tracer.render(scene);
+        const double render = timeMs(3, [&]
+                                     { tracer.render(scene); });
+
+        if (threads == threadCounts.front())
+        {
+            baseBuild = build;
+            baseRender = render;
+        }
+
+        std::cout << std::setw(7) << threads << std::fixed << std::setprecision(2)
+                  << std::setw(12) << build << std::setw(9) << baseBuild / build
+                  << std::setw(13) << render << std::setw(9) << baseRender / render << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,167 @@
+// Measures the OBJ loader on a large file made of copies of the spot mesh, against the
+// line-by-line istringstream parser it replaced, and loads from the mesh cache.
+// Build with `make obj`.
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "../objLoader.cpp"
+#include "../threads.cpp"
+#include "timing.hpp"
+
+// Writes `copies` copies of the spot mesh side by side, as separate objects with their own
+// normals, comments and blank lines. Every other copy uses relative indices.
+void writeLargeObj(const std::string &path, int copies)
+{
+    std::ifstream spot("spot/spot_triangulated.obj");
+    std::vector<std::string> vertices, textures, faces;
+    for (std::string line; getline(spot, line);)
+    {
+        if (line.rfind("v ", 0) == 0)
+            vertices.push_back(line.substr(2));
+        else if (line.rfind("vt ", 0) == 0)
+            textures.push_back(line.substr(3));
+        else if (line.rfind("f ", 0) == 0)
+            faces.push_back(line.substr(2));
+    }
+
+    std::ofstream out(path);
+    out << "# " << copies << " copies of spot\nmtllib spot.mtl\n";
+    for (int copy = 0; copy < copies; copy++)
+    {
+        out << "\no spot" << copy << "\ng body\nusemtl spot\n";
+        for (const auto &v : vertices)
+        {
+            std::istringstream ss(v);
+            float x, y, z;
+            ss >> x >> y >> z;
+            out << "v " << x + 2 * (copy % 16) << ' ' << y + 2 * (copy / 16) << ' ' << z << '\n';
+        }
+        for (const auto &vt : textures)
+            out << "vt " << vt << '\n';
+        out << "vn 0 0 1\n";
+        for (const auto &f : faces)
+        {
+            std::istringstream ss(f);
+            out << 'f';
+            for (std::string corner; ss >> corner;)
+            {
+                int v = std::stoi(corner);
+                int vt = std::stoi(corner.substr(corner.find('/') + 1));
+                if (copy % 2)
+                    out << ' ' << v - 1 - int(vertices.size()) << '/' << vt - 1 - int(textures.size()) << "/-1";
+                else
+                    out << ' ' << v + copy * vertices.size() << '/' << vt + copy * textures.size() << '/' << copy + 1;
+            }
+            out << "  # face\n";
+        }
+    }
+}
+
+// The loader before the parallel parser, reduced to parsing: one istringstream per line.
+size_t legacyTriangleCount(const std::string &path)
+{
+    std::vector<Point> vertices;
+    std::vector<TriangleVertex::VertexTexture> vertexTextures;
+    size_t triangles = 0;
+    std::ifstream infile(path);
+    for (std::string line; getline(infile, line);)
+    {
+        std::istringstream ss(line);
+        std::string word;
+        ss >> word;
+        if (word == "v")
+        {
+            float x, y, z;
+            ss >> word, x = std::stof(word);
+            ss >> word, y = std::stof(word);
+            ss >> word, z = std::stof(word);
+            vertices.emplace_back(x, y, z);
+        }
+        else if (word == "vt")
+        {
+            float u, v;
+            ss >> word, u = std::stof(word);
+            ss >> word, v = std::stof(word);
+            vertexTextures.emplace_back(u, v);
+        }
+        else if (word == "f")
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                ss >> word;
+                std::stringstream corner(word);
+                std::string segment;
+                std::getline(corner, segment, '/');
+                std::stoi(segment);
+                std::getline(corner, segment, '/');
+                std::stoi(segment);
+            }
+            triangles++;
+        }
+    }
+    return triangles;
+}
+
+int main(int argc, char const *argv[])
+{
+    constexpr int copies = 64;
+    constexpr size_t repetitions = 3;
+
+    const auto path = (std::filesystem::temp_directory_path() / "spotCopies.obj").string();
+    writeLargeObj(path, copies);
+    const double megabytes = std::filesystem::file_size(path) / 1e6;
+    std::cout << path << ": " << std::fixed << std::setprecision(1) << megabytes << " MB" << std::endl;
+
+    size_t legacyTriangles = 0;
+    const double legacy = timeMs(1, [&]
+                                 { legacyTriangles = legacyTriangleCount(path); });
+    std::cout << "istringstream: " << std::setprecision(2) << legacy << " ms, "
+              << megabytes / legacy * 1000 << " MB/s, " << legacyTriangles << " triangles" << std::endl;
+
+    std::vector<size_t> threadCounts = {1, 2, 4, 8};
+    if (std::find(threadCounts.begin(), threadCounts.end(), ThreadLimit::hardwareThreads()) == threadCounts.end())
+        threadCounts.push_back(ThreadLimit::hardwareThreads());
+
+#ifndef _OPENMP
+    std::cout << "warning: compiled without OpenMP, parsing is single-threaded" << std::endl;
+#endif
+    std::cout << "threads   load (ms)     MB/s  speedup" << std::endl;
+    for (auto threads : threadCounts)
+    {
+        ThreadLimit threadLimit(threads);
+
+        size_t triangles = 0;
+        const double load = timeMs(repetitions, [&]
+                                   { triangles = Obj(path, 0, false).getMesh().triangleCount(); });
+        if (triangles != legacyTriangles)
+            std::cout << "mismatch: " << triangles << " triangles" << std::endl;
+
+        std::cout << std::setw(7) << threads << std::setw(12) << load << std::setw(9)
+                  << megabytes / load * 1000 << std::setw(9) << legacy / load << std::endl;
+    }
+
+    // The first load writes the cache file, the next ones map it
+    MeshCache::directory = (std::filesystem::temp_directory_path() / "spotCopiesCache").string();
+    std::filesystem::remove_all(MeshCache::directory);
+    const double write = timeMs(1, [&]
+                                { Obj(path, 0); });
+    size_t cachedTriangles = 0;
+    bool cached = false;
+    const double read = timeMs(repetitions, [&]
+                               {
+                                   Obj obj(path, 0);
+                                   cachedTriangles = obj.getMesh().triangleCount();
+                                   cached = obj.getLoadStatistics().cached; });
+    if (!cached || cachedTriangles != legacyTriangles)
+        std::cout << "cache miss or mismatch: " << cachedTriangles << " triangles" << std::endl;
+    std::cout << "parse and write cache: " << write << " ms" << std::endl;
+    std::cout << "load from cache: " << read << " ms, " << megabytes / read * 1000 << " MB/s (of source)" << std::endl;
+
+    std::filesystem::remove_all(MeshCache::directory);
+    std::filesystem::remove(path);
+    return 0;
+}
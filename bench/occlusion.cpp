@@ -0,0 +1,94 @@
+// Compares shadow rays traced as occlusion queries (any hit, no hit record, no ordering of
+// the children) with the same rays traced for the closest hit, on the spot scene. Build
+// with `make occlusion`.
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "../rayTracer.cpp"
+#include "../threads.cpp"
+#include "timing.hpp"
+
+struct ShadowRay
+{
+    Ray ray;
+    float distance;
+};
+
+int main(int argc, char const *argv[])
+{
+    constexpr int dim = 512;
+
+    constexpr MaterialId procedural = 0;
+    Obj cow("spot/spot_triangulated.obj", procedural);
+
+    Scene scene;
+    scene.addMaterial(ProceduralMaterial{});
+    const auto mesh = scene.addMesh(cow);
+    scene.addInstance(mesh, cow.setDisplacement(-0.9, 0, 1.5).setRotation(0.5, 0.5, 0).getTransform());
+    scene.addInstance(mesh, cow.setDisplacement(0.9, 0, 2.5).setRotation(0.5, 0.5, 0).getTransform());
+    scene.addInstance(mesh, cow.setDisplacement(0, 0, 2.5).setRotation(0.5, 0.5, 0).getTransform());
+    scene.update();
+    const RenderContext context(scene);
+
+    // Shadow rays from the primary hits towards a point light behind the camera, and
+    // towards a light at grazing angle, which crosses more of the scene
+    const Point lights[] = {{0.5f, 1, -1}, {-6, 0.2f, 2}};
+    for (const auto &light : lights)
+    {
+        std::vector<ShadowRay> rays;
+        for (int i = 0; i < dim; i++)
+            for (int j = 0; j < dim; j++)
+            {
+                const Ray primary{Point{0, 0, 0}, Point{-1 + 2.0f * j / dim, +1 - 2.0f * i / dim, +1}};
+                if (auto hit = context.traverser.traverse(primary, context.primitiveIntersector))
+                {
+                    const Point position = primary.origin + primary.unitDir * hit->intersection.t;
+                    const Point toLight = light - position;
+                    const float distance = std::sqrt(toLight * toLight);
+                    rays.push_back({Ray{position, toLight}, distance});
+                }
+            }
+
+        std::vector<char> closest(rays.size()), any(rays.size());
+        const double closestMs = timeMs(5, [&]
+                                        {
+                                            for (size_t i = 0; i < rays.size(); i++)
+                                            {
+                                                BvhRay ray = rays[i].ray;
+                                                ray.tmax = rays[i].distance - ray.tmin;
+                                                closest[i] = context.traverser.traverse(ray, context.primitiveIntersector).has_value();
+                                            } });
+        const double anyMs = timeMs(5, [&]
+                                    {
+                                        for (size_t i = 0; i < rays.size(); i++)
+                                            any[i] = context.occluded(rays[i].ray, rays[i].distance); });
+
+        size_t occluded = 0, mismatches = 0;
+        for (size_t i = 0; i < rays.size(); i++)
+        {
+            occluded += any[i];
+            mismatches += any[i] != closest[i];
+        }
+        std::cout << rays.size() << " shadow rays towards (" << light.x << ", " << light.y << ", " << light.z << "), "
+                  << 100.0 * occluded / rays.size() << "% occluded, " << mismatches << " mismatches" << std::endl;
+        std::cout << std::fixed << std::setprecision(2)
+                  << "  closest hit: " << std::setw(8) << closestMs << " ms " << std::setw(8) << rays.size() / (closestMs * 1e3) << " Mrays/s" << std::endl
+                  << "  any hit:     " << std::setw(8) << anyMs << " ms " << std::setw(8) << rays.size() / (anyMs * 1e3) << " Mrays/s"
+                  << std::setw(8) << closestMs / anyMs << "x" << std::endl;
+        std::cout.unsetf(std::ios::floatfield);
+    }
+
+    // Cost of the lights in a full render, with their shadow rays batched per tile
+    RayTracer tracer(Point{0, 0, 0}, Point{0, 0, 3}, dim, dim);
+    tracer.render(scene);
+    const double unlit = timeMs(3, [&]
+                                { tracer.render(scene); });
+    scene.addLight(PointLight{lights[0], Rgb{2, 2, 2}});
+    scene.addLight(DirectionalLight{Point{0.5f, -1, 0.5f}, Rgb{1, 1, 1}});
+    const double lit = timeMs(3, [&]
+                              { tracer.render(scene); });
+    std::cout << std::fixed << std::setprecision(2) << "render without lights: " << unlit << " ms, with 2 lights: " << lit << " ms" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,219 @@
+// Compares the traversal of primary rays one by one and by packets of 4, 8 and 16
+// rays, on the spot scene, then the packet traversal of one mesh BVH with and
+// without the interval test of the packet bounds. Build with `make packets`.
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "../rayTracer.cpp"
+#include "../threads.cpp"
+#include "timing.hpp"
+
+// Rays of a dim x dim image, grouped by blocks of N pixels in the same layout as
+// the renderer.
+template <size_t N, typename R>
+std::vector<PacketKernels::Packet<N>> makePackets(const std::vector<R> &rays, int dim)
+{
+    int blockWidth = 1;
+    while (blockWidth * blockWidth < static_cast<int>(N))
+        blockWidth *= 2;
+    const int blockHeight = N / blockWidth;
+
+    std::vector<PacketKernels::Packet<N>> packets;
+    for (int y = 0; y < dim; y += blockHeight)
+        for (int x = 0; x < dim; x += blockWidth)
+        {
+            PacketKernels::Packet<N> packet;
+            for (size_t lane = 0; lane < N; lane++)
+                packet.set(lane, rays[(y + lane / blockWidth) * dim + x + lane % blockWidth]);
+            packets.push_back(packet);
+        }
+    return packets;
+}
+
+// Primary rays of a dim x dim image, traced by packets. Returns the number of rays
+// whose hit differs from the one found by the single-ray traversal, and stores the
+// traversal time.
+template <size_t N>
+size_t tracePackets(const RenderContext &context, PacketKernels::Kernel<N> kernel, const std::vector<Ray> &rays, int dim,
+                    const std::vector<std::optional<RenderContext::PrimitiveIntersector::Result>> &reference, double &ms)
+{
+    int blockWidth = 1;
+    while (blockWidth * blockWidth < static_cast<int>(N))
+        blockWidth *= 2;
+    const int blockHeight = N / blockWidth;
+    const auto packets = makePackets<N>(rays, dim);
+
+    PacketKernels::Mask<N> active;
+    for (size_t lane = 0; lane < N; lane++)
+        active[lane] = -1;
+    std::vector<PacketKernels::Result<N>> results(packets.size());
+    ms = timeMs(5, [&]
+                {
+                    for (size_t i = 0; i < packets.size(); i++)
+                        kernel(context, packets[i], active, results[i]);
+                });
+
+    size_t mismatches = 0;
+    size_t i = 0;
+    for (int y = 0; y < dim; y += blockHeight)
+        for (int x = 0; x < dim; x += blockWidth, i++)
+            for (size_t lane = 0; lane < N; lane++)
+            {
+                const auto &expected = reference[(y + lane / blockWidth) * dim + x + lane % blockWidth];
+                const bool hit = results[i].hit[lane];
+                if (hit != expected.has_value() ||
+                    (hit && (static_cast<size_t>(results[i].primitive_index[lane]) != expected->primitive_index ||
+                             std::abs(results[i].intersection.t[lane] - expected->intersection.t) > 1e-3f)))
+                    mismatches++;
+            }
+    return mismatches;
+}
+
+template <size_t N>
+using MeshIntersector = bvh::ClosestPacketIntersector<Bvh, BvhTriangle, N>;
+
+// Packets traced through the BVH of a single mesh, with the interval test on or off.
+template <size_t N>
+inline void traceMesh(const Bvh &hierarchy, const std::vector<BvhTriangle> &triangles, const std::vector<PacketKernels::Packet<N>> &packets,
+                      bool culling, std::vector<typename MeshIntersector<N>::Result> &results, typename bvh::PacketTraverser<Bvh, N>::Statistics &statistics)
+{
+    MeshIntersector<N> intersector(hierarchy, triangles.data());
+    bvh::PacketTraverser<Bvh, N> traverser(hierarchy);
+    traverser.interval_culling = culling;
+    PacketKernels::Mask<N> active;
+    for (size_t lane = 0; lane < N; lane++)
+        active[lane] = -1;
+    for (size_t i = 0; i < packets.size(); i++)
+        results[i] = traverser.traverse(packets[i], active, intersector, statistics);
+}
+
+__attribute__((flatten)) void traceMesh4(const Bvh &hierarchy, const std::vector<BvhTriangle> &triangles, const std::vector<PacketKernels::Packet<4>> &packets,
+                                         bool culling, std::vector<MeshIntersector<4>::Result> &results, bvh::PacketTraverser<Bvh, 4>::Statistics &statistics)
+{
+    traceMesh<4>(hierarchy, triangles, packets, culling, results, statistics);
+}
+
+__attribute__((target("avx2,fma"), flatten)) void traceMesh8(const Bvh &hierarchy, const std::vector<BvhTriangle> &triangles, const std::vector<PacketKernels::Packet<8>> &packets,
+                                                             bool culling, std::vector<MeshIntersector<8>::Result> &results, bvh::PacketTraverser<Bvh, 8>::Statistics &statistics)
+{
+    traceMesh<8>(hierarchy, triangles, packets, culling, results, statistics);
+}
+
+__attribute__((target("avx512f"), flatten)) void traceMesh16(const Bvh &hierarchy, const std::vector<BvhTriangle> &triangles, const std::vector<PacketKernels::Packet<16>> &packets,
+                                                            bool culling, std::vector<MeshIntersector<16>::Result> &results, bvh::PacketTraverser<Bvh, 16>::Statistics &statistics)
+{
+    traceMesh<16>(hierarchy, triangles, packets, culling, results, statistics);
+}
+
+// Traversal steps, nodes rejected by the interval test and throughput, per packet
+// width, with and without the test. Mismatches are rays whose hit changes with it.
+template <size_t N, typename Kernel>
+void compareCulling(const Bvh &hierarchy, const std::vector<BvhTriangle> &triangles, const std::vector<BvhRay> &rays, int dim, Kernel kernel)
+{
+    const auto packets = makePackets<N>(rays, dim);
+    std::vector<typename MeshIntersector<N>::Result> reference(packets.size()), results(packets.size());
+    for (bool culling : {false, true})
+    {
+        typename bvh::PacketTraverser<Bvh, N>::Statistics statistics;
+        const double ms = timeMs(20, [&]
+                                 {
+                                     statistics = {};
+                                     kernel(hierarchy, triangles, packets, culling, culling ? results : reference, statistics); });
+
+        size_t mismatches = 0;
+        for (size_t i = 0; culling && i < packets.size(); i++)
+            for (size_t lane = 0; lane < N; lane++)
+                mismatches += results[i].hit[lane] != reference[i].hit[lane] ||
+                              (results[i].hit[lane] && results[i].primitive_index[lane] != reference[i].primitive_index[lane]);
+        std::cout << std::setw(5) << N << std::setw(9) << (culling ? "on" : "off") << std::fixed << std::setprecision(2)
+                  << std::setw(15) << static_cast<double>(statistics.traversal_steps) / packets.size()
+                  << std::setw(15) << static_cast<double>(statistics.culled_nodes) / packets.size()
+                  << std::setw(9) << rays.size() / (ms * 1e3) << std::setw(12) << mismatches << std::endl;
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    constexpr int dim = 512;
+
+    // The packet kernels are single-threaded; the render times use every core.
+    constexpr MaterialId procedural = 0;
+    Obj cow("spot/spot_triangulated.obj", procedural);
+
+    Scene scene;
+    scene.addMaterial(ProceduralMaterial{});
+    const auto mesh = scene.addMesh(cow);
+    scene.addInstance(mesh, cow.setDisplacement(-0.9, 0, 1.5).setRotation(0.5, 0.5, 0).getTransform());
+    scene.addInstance(mesh, cow.setDisplacement(0.9, 0, 2.5).setRotation(0.5, 0.5, 0).getTransform());
+    scene.addInstance(mesh, cow.setDisplacement(0, 0, 2.5).setRotation(0.5, 0.5, 0).getTransform());
+    scene.update();
+
+    const RenderContext context(scene);
+    std::vector<Ray> rays;
+    for (int i = 0; i < dim; i++)
+        for (int j = 0; j < dim; j++)
+            rays.push_back(Ray{Point{0, 0, 0}, Point{-1 + 2.0f * j / dim, +1 - 2.0f * i / dim, +1}});
+
+    std::vector<std::optional<RenderContext::PrimitiveIntersector::Result>> reference(rays.size());
+    const double single = timeMs(5, [&]
+                                 {
+                                     for (size_t i = 0; i < rays.size(); i++)
+                                         reference[i] = context.traverser.traverse(rays[i], context.primitiveIntersector);
+                                 });
+
+    const int native = PacketKernels::nativeWidth();
+    std::cout << "native packet width: " << native << std::endl;
+    std::cout << "width  traversal (ms)  Mrays/s  speedup  mismatches  render (ms)" << std::endl;
+
+    RayTracer tracer(Point{0, 0, 0}, Point{0, 0, 3}, dim, dim);
+    auto report = [&](int width, double ms, size_t mismatches)
+    {
+        tracer.packetWidth = width;
+        tracer.render(scene);
+        const double render = timeMs(3, [&]
+                                     { tracer.render(scene); });
+        std::cout << std::setw(5) << width << std::fixed << std::setprecision(2)
+                  << std::setw(16) << ms << std::setw(9) << rays.size() / (ms * 1e3)
+                  << std::setw(9) << single / ms << std::setw(12) << mismatches
+                  << std::setw(13) << render << std::endl;
+    };
+
+    report(1, single, 0);
+    double ms;
+    size_t mismatches = tracePackets<4>(context, PacketKernels::trace4, rays, dim, reference, ms);
+    report(4, ms, mismatches);
+    if (native >= 8)
+    {
+        mismatches = tracePackets<8>(context, PacketKernels::trace8, rays, dim, reference, ms);
+        report(8, ms, mismatches);
+    }
+    if (native >= 16)
+    {
+        mismatches = tracePackets<16>(context, PacketKernels::trace16, rays, dim, reference, ms);
+        report(16, ms, mismatches);
+    }
+
+    // One cow filling the image, in object space
+    std::vector<BvhTriangle> triangles;
+    for (size_t i = 0; i < cow.getMesh().triangleCount(); i++)
+        triangles.push_back(cow.getMesh().bvhTriangle(i));
+    auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(triangles.data(), triangles.size());
+    Bvh hierarchy;
+    bvh::SweepSahBuilder<Bvh>(hierarchy).build(bvh::compute_bounding_boxes_union(bboxes.get(), triangles.size()), bboxes.get(), centers.get(), triangles.size());
+    std::vector<BvhRay> meshRays;
+    for (int i = 0; i < dim; i++)
+        for (int j = 0; j < dim; j++)
+            meshRays.emplace_back(BvhVector3(0, 0, -2.5f), bvh::normalize(BvhVector3(-0.25f + 0.5f * j / dim, 0.3f - 0.5f * i / dim, 1)), 0.0f, 30000.0f);
+
+    std::cout << std::endl
+              << triangles.size() << " triangles, interval test of the packet bounds" << std::endl;
+    std::cout << "width  culling  steps/packet  culled/packet  Mrays/s  mismatches" << std::endl;
+    compareCulling<4>(hierarchy, triangles, meshRays, dim, traceMesh4);
+    if (native >= 8)
+        compareCulling<8>(hierarchy, triangles, meshRays, dim, traceMesh8);
+    if (native >= 16)
+        compareCulling<16>(hierarchy, triangles, meshRays, dim, traceMesh16);
+
+    return 0;
+}
@@ -0,0 +1,369 @@
+// Benchmark suite for regression tracking: OBJ loading, mesh transform, every BVH builder,
+// primary, secondary and shadow ray throughput, shading per material and image encoding,
+// on the spot scene and on a scene of many instanced cows. Scenes, rays and samples are
+// fixed, so that two runs on the same machine measure the same work. Results are printed
+// as JSON on stdout, progress on stderr. Run with `make bench`.
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../rayTracer.cpp"
+#include "../imageWriter.cpp"
+#include "../threads.cpp"
+#include "../bvh/binned_sah_builder.hpp"
+#include "../bvh/linear_bvh_builder.hpp"
+#include "../bvh/locally_ordered_clustering_builder.hpp"
+#include "timing.hpp"
+
+// One flat JSON object. Values are formatted when they are added.
+class Record
+{
+public:
+    Record &add(const std::string &key, double value)
+    {
+        std::ostringstream stream;
+        stream << std::setprecision(6) << value;
+        fields.emplace_back(key, stream.str());
+        return *this;
+    }
+
+    Record &add(const std::string &key, size_t value)
+    {
+        fields.emplace_back(key, std::to_string(value));
+        return *this;
+    }
+
+    Record &add(const std::string &key, bool value)
+    {
+        fields.emplace_back(key, value ? "true" : "false");
+        return *this;
+    }
+
+    Record &add(const std::string &key, const std::string &value)
+    {
+        fields.emplace_back(key, "\"" + value + "\"");
+        return *this;
+    }
+
+    Record &add(const std::string &key, const char *value)
+    {
+        return add(key, std::string(value));
+    }
+
+    void print(std::ostream &out) const
+    {
+        out << "{";
+        for (size_t i = 0; i < fields.size(); i++)
+            out << (i ? ", " : "") << "\"" << fields[i].first << "\": " << fields[i].second;
+        out << "}";
+    }
+
+private:
+    std::vector<std::pair<std::string, std::string>> fields;
+};
+
+// Named lists of records, printed in the order they were created.
+class Report
+{
+public:
+    Record &add(const std::string &section)
+    {
+        for (auto &[name, records] : sections)
+        {
+            if (name == section)
+                return records.emplace_back();
+        }
+        std::cerr << section << "..." << std::endl;
+        return sections.emplace_back(section, std::vector<Record>{}).second.emplace_back();
+    }
+
+    void print(std::ostream &out) const
+    {
+        out << "{\n";
+        for (size_t i = 0; i < sections.size(); i++)
+        {
+            out << "  \"" << sections[i].first << "\": [\n";
+            const auto &records = sections[i].second;
+            for (size_t j = 0; j < records.size(); j++)
+            {
+                out << "    ";
+                records[j].print(out);
+                out << (j + 1 < records.size() ? ",\n" : "\n");
+            }
+            out << "  ]" << (i + 1 < sections.size() ? ",\n" : "\n");
+        }
+        out << "}" << std::endl;
+    }
+
+private:
+    std::vector<std::pair<std::string, std::vector<Record>>> sections;
+};
+
+// The three cows of the spot scene.
+void addSpotInstances(Scene &scene, size_t mesh, Obj &cow)
+{
+    scene.addInstance(mesh, cow.setDisplacement(-0.9, 0, 1.5).setRotation(0.5, 0.5, 0).setScale(1, 1, 1).getTransform());
+    scene.addInstance(mesh, cow.setDisplacement(0.9, 0, 2.5).setRotation(0.5, 0.5, 0).setScale(1, 1, 1).getTransform());
+    scene.addInstance(mesh, cow.setDisplacement(0, 0, 2.5).setRotation(0.5, 0.5, 0).setScale(1, 1, 1).getTransform());
+}
+
+// A wall of size x size smaller cows in front of the camera, each turned differently.
+void addCowGrid(Scene &scene, size_t mesh, Obj &cow, int size)
+{
+    const float spacing = 4.0f / size;
+    for (int i = 0; i < size; i++)
+    {
+        for (int j = 0; j < size; j++)
+        {
+            const float angle = 0.37f * (i * size + j);
+            cow.setDisplacement(-2 + spacing * (j + 0.5f), -2 + spacing * (i + 0.5f), 3 + 0.1f * ((i + j) % 3))
+                .setRotation(0.3f, angle, 0)
+                .setScale(spacing * 0.7f, spacing * 0.7f, spacing * 0.7f);
+            scene.addInstance(mesh, cow.getTransform());
+        }
+    }
+}
+
+// World-space triangles of the instances of a scene, for the builders.
+std::vector<BvhTriangle> worldTriangles(const IndexedMesh &mesh, const std::vector<Transform> &transforms)
+{
+    std::vector<BvhTriangle> triangles;
+    triangles.reserve(mesh.triangleCount() * transforms.size());
+    for (const auto &transform : transforms)
+    {
+        for (size_t i = 0; i < mesh.triangleCount(); i++)
+        {
+            triangles.emplace_back(transform.applyToPoint(mesh.positions[mesh.indices[3 * i]]),
+                                   transform.applyToPoint(mesh.positions[mesh.indices[3 * i + 1]]),
+                                   transform.applyToPoint(mesh.positions[mesh.indices[3 * i + 2]]));
+        }
+    }
+    return triangles;
+}
+
+void benchBuilders(Report &report, const std::string &sceneName, const std::vector<BvhTriangle> &triangles)
+{
+    auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(triangles.data(), triangles.size());
+    const auto globalBbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangles.size());
+    const size_t repetitions = std::max<size_t>(1, 200000 / triangles.size());
+    SahCost sahCost;
+
+    auto run = [&](const char *name, auto build)
+    {
+        Bvh bvh;
+        const double ms = timeMs(repetitions, [&]
+                                 { build(bvh); });
+        report.add("builders")
+            .add("scene", sceneName)
+            .add("builder", name)
+            .add("triangles", triangles.size())
+            .add("nodes", bvh.node_count)
+            .add("ms", ms)
+            .add("sah_cost", sahCost(bvh));
+    };
+
+    run("sweep_sah", [&](Bvh &bvh)
+        { bvh::SweepSahBuilder<Bvh>(bvh).build(globalBbox, bboxes.get(), centers.get(), triangles.size()); });
+    run("binned_sah", [&](Bvh &bvh)
+        { bvh::BinnedSahBuilder<Bvh, 16>(bvh).build(globalBbox, bboxes.get(), centers.get(), triangles.size()); });
+    run("spatial_split", [&](Bvh &bvh)
+        { bvh::SpatialSplitBvhBuilder<Bvh, BvhTriangle, 64>(bvh).build(globalBbox, triangles.data(), bboxes.get(), centers.get(), triangles.size()); });
+    run("linear", [&](Bvh &bvh)
+        { bvh::LinearBvhBuilder<Bvh, uint32_t>(bvh).build(globalBbox, bboxes.get(), centers.get(), triangles.size()); });
+    run("locally_ordered_clustering", [&](Bvh &bvh)
+        { bvh::LocallyOrderedClusteringBuilder<Bvh, uint32_t>(bvh).build(globalBbox, bboxes.get(), centers.get(), triangles.size()); });
+}
+
+// Primary rays through every pixel, mirror reflections at their hits, and shadow rays
+// from the hits towards a point light, all traced one by one by the SingleRayTraverser.
+void benchRays(Report &report, const std::string &sceneName, const Scene &scene, int dim)
+{
+    const RenderContext context(scene);
+    std::vector<Ray> primary;
+    primary.reserve(static_cast<size_t>(dim) * dim);
+    for (int i = 0; i < dim; i++)
+    {
+        for (int j = 0; j < dim; j++)
+            primary.push_back(Ray{Point{0, 0, 0}, Point{-1 + 2.0f * (j + 0.5f) / dim, 1 - 2.0f * (i + 0.5f) / dim, 1}});
+    }
+
+    std::vector<Ray> secondary;
+    std::vector<std::pair<Ray, float>> shadow;
+    const Point light{0.5f, 1, -1};
+    for (const auto &ray : primary)
+    {
+        if (auto hit = context.traverser.traverse(ray, context.primitiveIntersector))
+        {
+            const SurfaceHit surface = context.instances[hit->primitive_index].getSurface(hit->intersection, ray);
+            secondary.push_back(reflect(ray, surface));
+            const Point toLight = light - surface.position;
+            shadow.emplace_back(Ray{surface.position, toLight}, std::sqrt(toLight * toLight));
+        }
+    }
+
+    auto record = [&](const char *kind, size_t rays, size_t hits, double ms)
+    {
+        report.add("rays")
+            .add("scene", sceneName)
+            .add("kind", kind)
+            .add("rays", rays)
+            .add("hit_fraction", static_cast<double>(hits) / rays)
+            .add("ms", ms)
+            .add("mrays_per_second", rays / (ms * 1e3));
+    };
+
+    size_t hits = 0;
+    const double primaryMs = timeMs(3, [&]
+                                    {
+                                        hits = 0;
+                                        for (const auto &ray : primary)
+                                            hits += context.traverser.traverse(ray, context.primitiveIntersector).has_value(); });
+    record("primary", primary.size(), hits, primaryMs);
+
+    const double secondaryMs = timeMs(3, [&]
+                                      {
+                                          hits = 0;
+                                          for (const auto &ray : secondary)
+                                              hits += context.traverser.traverse(ray, context.primitiveIntersector).has_value(); });
+    record("secondary", secondary.size(), hits, secondaryMs);
+
+    const double shadowMs = timeMs(3, [&]
+                                   {
+                                       hits = 0;
+                                       for (const auto &[ray, distance] : shadow)
+                                           hits += context.occluded(ray, distance); });
+    record("shadow", shadow.size(), hits, shadowMs);
+}
+
+int main(int argc, char const *argv[])
+{
+    constexpr int rayDim = 512;
+    constexpr int renderDim = 256;
+    constexpr int gridSize = 16;
+    const std::string spotPath = "spot/spot_triangulated.obj";
+
+    Report report;
+    report.add("machine")
+        .add("threads", ThreadLimit::hardwareThreads())
+        .add("avx2", __builtin_cpu_supports("avx2") != 0)
+        .add("avx512f", __builtin_cpu_supports("avx512f") != 0);
+
+    // OBJ loading, parsed from the text and from the mesh cache (filled by the first load)
+    for (bool cached : {false, true})
+    {
+        Obj(spotPath, 0, cached);
+        Obj::LoadStatistics statistics;
+        const double ms = timeMs(5, [&]
+                                 { statistics = Obj(spotPath, 0, cached).getLoadStatistics(); });
+        report.add("obj")
+            .add("file", spotPath)
+            .add("source", cached ? "cache" : "text")
+            .add("bytes", statistics.bytes)
+            .add("ms", ms)
+            .add("mb_per_second", statistics.bytes / (ms * 1e3));
+    }
+
+    constexpr MaterialId procedural = 0;
+    Obj cow(spotPath, procedural);
+    const auto &mesh = cow.getMesh();
+
+    // The first call also copies the vertices to the layout of the kernels
+    cow.setDisplacement(-0.9, 0, 1.5).setRotation(0.5, 0.5, 0);
+    cow.getWorldVertices();
+    const double transformMs = timeMs(200, [&]
+                                      { cow.getWorldVertices(); });
+    report.add("transform")
+        .add("vertices", mesh.vertexCount())
+        .add("ms", transformMs)
+        .add("mvertices_per_second", mesh.vertexCount() / (transformMs * 1e3));
+
+    // Builders on the triangles of one cow in object space, and of 16 cows in world space
+    std::vector<Transform> single = {Transform::identity()}, copies;
+    for (int i = 0; i < 16; i++)
+        copies.push_back(cow.setDisplacement(-2 + (i % 4), -2 + (i / 4), 3).setRotation(0.3f, 0.37f * i, 0).setScale(1, 1, 1).getTransform());
+    benchBuilders(report, "spot", worldTriangles(mesh, single));
+    benchBuilders(report, "spot_x16", worldTriangles(mesh, copies));
+
+    // Ray throughput on the spot scene and on the grid of instanced cows
+    Scene spot;
+    spot.addMaterial(ProceduralMaterial{});
+    const auto spotMesh = spot.addMesh(cow);
+    addSpotInstances(spot, spotMesh, cow);
+    spot.update();
+    benchRays(report, "spot", spot, rayDim);
+
+    Scene grid = spot.share();
+    addCowGrid(grid, spotMesh, cow, gridSize);
+    grid.update();
+    const std::string gridName = "cows_" + std::to_string(gridSize * gridSize);
+    benchRays(report, gridName, grid, rayDim);
+
+    // Shading: the spot scene rendered with every material in turn, one sample per pixel.
+    // Mirror and metal include the cost of their reflected rays.
+    Scene materials;
+    const Texture *texture = materials.addTexture(Texture::load("spot/spot_texture.png"));
+    const std::pair<const char *, Material> materialList[] = {
+        {"textured", TexturedMaterial{texture}},
+        {"procedural", ProceduralMaterial{}},
+        {"mirror", MirrorMaterial{}},
+        {"metal", MetalMaterial{}}};
+    std::vector<size_t> materialMeshes;
+    std::vector<std::unique_ptr<Obj>> materialCows;
+    for (const auto &[name, material] : materialList)
+    {
+        materialCows.push_back(std::make_unique<Obj>(spotPath, materials.addMaterial(material)));
+        materialMeshes.push_back(materials.addMesh(*materialCows.back()));
+    }
+    RayTracer tracer(Point{0, 0, 0}, Point{0, 0, 3}, renderDim, renderDim);
+    Framebuffer framebuffer(renderDim, renderDim);
+    for (size_t m = 0; m < materialMeshes.size(); m++)
+    {
+        materials.clearInstances();
+        addSpotInstances(materials, materialMeshes[m], *materialCows[m]);
+        materials.update();
+        tracer.render(materials, framebuffer);
+        const double ms = timeMs(3, [&]
+                                 { tracer.render(materials, framebuffer); });
+        report.add("materials")
+            .add("material", materialList[m].first)
+            .add("pixels", framebuffer.size())
+            .add("ms", ms)
+            .add("mpaths_per_second", framebuffer.size() / (ms * 1e3));
+    }
+
+    // Encoding of a rendered 1000x1000 frame
+    constexpr int imageDim = 1000;
+    RayTracer imageTracer(Point{0, 0, 0}, Point{0, 0, 3}, imageDim, imageDim);
+    const Framebuffer image = imageTracer.render(spot);
+    const std::vector<uint8_t> rgb = image.resolve();
+    const std::string path = (std::filesystem::temp_directory_path() / "bench_suite_image").string();
+    auto recordImage = [&](const std::string &format, const std::string &file, double ms)
+    {
+        report.add("encode")
+            .add("format", format)
+            .add("pixels", image.size())
+            .add("bytes", static_cast<size_t>(std::filesystem::file_size(file)))
+            .add("ms", ms)
+            .add("mpixels_per_second", image.size() / (ms * 1e3));
+        std::filesystem::remove(file);
+    };
+    const std::pair<const char *, ImageEncoder::PngSettings> pngSettings[] = {
+        {"png_level1", {1, Z_DEFAULT_STRATEGY, ImageEncoder::PngFilter::Adaptive}},
+        {"png_level6", {6, Z_DEFAULT_STRATEGY, ImageEncoder::PngFilter::Adaptive}},
+        {"png_level9", {9, Z_DEFAULT_STRATEGY, ImageEncoder::PngFilter::Adaptive}},
+        {"png_level6_unfiltered", {6, Z_DEFAULT_STRATEGY, ImageEncoder::PngFilter::None}}};
+    for (const auto &[name, settings] : pngSettings)
+        recordImage(name, path + ".png", timeMs(3, [&]
+                                                { ImageEncoder::writePng(path + ".png", imageDim, imageDim, rgb, "bench", settings); }));
+    recordImage("ppm", path + ".ppm", timeMs(3, [&]
+                                             { ImageEncoder::writePpm(path + ".ppm", imageDim, imageDim, rgb); }));
+    const std::vector<float> radiance = image.radiance();
+    recordImage("pfm", path + ".pfm", timeMs(3, [&]
+                                             { ImageEncoder::writePfm(path + ".pfm", imageDim, imageDim, radiance); }));
+
+    report.print(std::cout);
+    return 0;
+}
@@ -0,0 +1,89 @@
+// Texture lookups of a minified surface: a 4096x4096 texture seen by a small grid of
+// pixels, visited in random order like the hits of scattered rays, so that successive
+// lookups are far apart in the texture. Compares the former nearest lookup into rows of
+// the full image with the tiled texture and its mip chain.
+// Build with `make texture`.
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "../texture.cpp"
+#include "timing.hpp"
+
+int main(int argc, char const *argv[])
+{
+    // The spot texture, repeated to a larger image
+    Texture spot = Texture::load("spot/spot_texture.png");
+    spot.wrap = Texture::Wrap::Repeat;
+    constexpr int size = 4096;
+    std::vector<uint8_t> rgba(4 * static_cast<size_t>(size) * size);
+    std::vector<uint8_t *> rows(size);
+    for (int y = 0; y < size; y++)
+    {
+        rows[y] = &rgba[4 * static_cast<size_t>(y) * size];
+        for (int x = 0; x < size; x++)
+        {
+            const Rgb c = spot.sample((x + 0.5f) / spot.getWidth(), 1 - (y + 0.5f) / spot.getHeight(), 0);
+            rows[y][4 * x] = Srgb::fromLinear(c.r);
+            rows[y][4 * x + 1] = Srgb::fromLinear(c.g);
+            rows[y][4 * x + 2] = Srgb::fromLinear(c.b);
+            rows[y][4 * x + 3] = 255;
+        }
+    }
+    Texture texture(size, size, rgba.data());
+    std::cout << size << "x" << size << " texture, " << texture.levelCount() << " levels" << std::endl;
+
+    // Bilinear at level 0 is what filtering costs without the mip chain
+    std::cout << "pixels   footprint   row nearest (ns)   tiled nearest   bilinear, level 0   bilinear   trilinear" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    for (int pixels : {2048, 512, 128, 32})
+    {
+        // A pixels x pixels grid covers the whole texture
+        const size_t lookups = 1 << 22;
+        const float footprint = 1.0f / pixels;
+        std::vector<uint32_t> order(static_cast<size_t>(pixels) * pixels);
+        std::iota(order.begin(), order.end(), 0);
+        std::shuffle(order.begin(), order.end(), std::mt19937(pixels));
+        auto coordinates = [&](size_t i)
+        {
+            const uint32_t p = order[i % order.size()];
+            return std::pair{(p % pixels + 0.5f) * footprint, (p / pixels + 0.5f) * footprint};
+        };
+
+        float sum = 0;
+        const double legacy = timeNs(1, [&]
+                                     {
+                                         for (size_t i = 0; i < lookups; i++)
+                                         {
+                                             const auto [u, v] = coordinates(i);
+                                             const int row = size - 1 - size * std::clamp(v, 0.0f, 0.99f);
+                                             const int col = size * std::clamp(u, 0.0f, 0.99f);
+                                             sum += Srgb::toLinear(rows[row][col * 4]);
+                                         } });
+        std::cout << std::setw(6) << pixels << std::setw(12) << footprint * size << std::setw(19) << legacy / lookups;
+
+        const std::tuple<Texture::Filter, float, int> variants[] = {
+            {Texture::Filter::Nearest, 0.0f, 16},
+            {Texture::Filter::Bilinear, 0.0f, 20},
+            {Texture::Filter::Bilinear, footprint, 11},
+            {Texture::Filter::Trilinear, footprint, 12}};
+        for (const auto &[filter, width, column] : variants)
+        {
+            texture.filter = filter;
+            const double time = timeNs(1, [&]
+                                       {
+                                           for (size_t i = 0; i < lookups; i++)
+                                           {
+                                               const auto [u, v] = coordinates(i);
+                                               sum += texture.sample(u, v, width).r;
+                                           } });
+            std::cout << std::setw(column) << time / lookups;
+        }
+        std::cout << (sum < 0 ? " " : "") << std::endl;
+    }
+
+    return 0;
+}
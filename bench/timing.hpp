@@ -0,0 +1,35 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <ratio>
+
+// Average wall-clock time of `repetitions` calls of f, in units of Period (std::milli
+// for milliseconds). Shared by all the benchmarks.
+template <typename Period, typename F>
+double averageTime(size_t repetitions, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repetitions; i++)
+        f();
+    std::chrono::duration<double, Period> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / repetitions;
+}
+
+template <typename F>
+double timeMs(size_t repetitions, F f)
+{
+    return averageTime<std::milli>(repetitions, f);
+}
+
+template <typename F>
+double timeUs(size_t repetitions, F f)
+{
+    return averageTime<std::micro>(repetitions, f);
+}
+
+template <typename F>
+double timeNs(size_t repetitions, F f)
+{
+    return averageTime<std::nano>(repetitions, f);
+}
@@ -0,0 +1,125 @@
+// Compares ways of moving the spot mesh to world space: the per-triangle rotation that
+// the loader used to do, one matrix per shared vertex, and the SIMD kernels on SoA
+// vertices. Build with `make transform`.
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+#include "../objLoader.cpp"
+#include "../threads.cpp"
+#include "timing.hpp"
+
+// The former path: three vertices per triangle, each position and normal rotated
+// about each axis separately, appended without reserving.
+struct LegacyTriangle
+{
+    Point v[3];
+    Point n[3];
+};
+
+std::vector<LegacyTriangle> legacyTransform(const std::vector<LegacyTriangle> &triangles, float a, float b, float c, const Point &displacement)
+{
+    std::vector<LegacyTriangle> output;
+    std::transform(triangles.begin(), triangles.end(), std::back_inserter(output), [&](const LegacyTriangle &triangle)
+                   {
+                       LegacyTriangle result;
+                       for (int i = 0; i < 3; i++)
+                       {
+                           result.v[i] = triangle.v[i].rotateByX(a).rotateByY(b).rotateByZ(c) + displacement;
+                           result.n[i] = triangle.n[i].rotateByX(a).rotateByY(b).rotateByZ(c);
+                       }
+                       return result; });
+    return output;
+}
+
+int main(int argc, char const *argv[])
+{
+    constexpr size_t repetitions = 200;
+
+    Obj cow("spot/spot_triangulated.obj", 0);
+    cow.setDisplacement(-0.9, 0, 1.5).setRotation(0.5, 0.5, 0);
+    const auto &mesh = cow.getMesh();
+    const auto transform = cow.getTransform();
+    const auto normalTransform = transform.normalTransform();
+
+    std::vector<LegacyTriangle> triangles(mesh.triangleCount());
+    for (size_t i = 0; i < triangles.size(); i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            triangles[i].v[j] = mesh.positions[mesh.indices[3 * i + j]];
+            triangles[i].n[j] = mesh.normals[mesh.indices[3 * i + j]];
+        }
+    }
+    std::cout << mesh.triangleCount() << " triangles, " << mesh.vertexCount() << " shared vertices" << std::endl;
+
+    // Check the kernels against the scalar transform
+    const auto world = cow.getWorldVertices();
+    float maxError = 0;
+    for (size_t i = 0; i < mesh.vertexCount(); i++)
+    {
+        const auto p = transform.applyToPoint(mesh.positions[i]) - world.positions[i];
+        const auto n = normalTransform.applyToVector(mesh.normals[i]) - world.normals[i];
+        maxError = std::max({maxError, std::sqrt(p * p), std::sqrt(n * n)});
+    }
+    std::cout << "max difference with the scalar transform: " << maxError << std::endl;
+
+    std::cout << std::fixed << std::setprecision(1);
+    const double legacy = timeUs(repetitions, [&]
+                                 { legacyTransform(triangles, 0.5, 0.5, 0, {-0.9, 0, 1.5}); });
+    std::cout << "per-triangle rotate:        " << std::setw(8) << legacy << " us" << std::endl;
+
+    const double scalar = timeUs(repetitions, [&]
+                                 {
+                                     std::vector<Point> positions(mesh.vertexCount()), normals(mesh.vertexCount());
+                                     for (size_t i = 0; i < mesh.vertexCount(); i++)
+                                     {
+                                         positions[i] = transform.applyToPoint(mesh.positions[i]);
+                                         normals[i] = normalTransform.applyToVector(mesh.normals[i]);
+                                     } });
+    std::cout << "per-vertex matrix (scalar): " << std::setw(8) << scalar << " us" << std::setw(8) << legacy / scalar << "x" << std::endl;
+
+    const SoaVertices positions(mesh.positions), normals(mesh.normals);
+    SoaVertices outPositions, outNormals;
+    std::pair<const char *, TransformKernels::Kernel> kernels[] = {
+        {"SoA kernel, 4 wide:        ", TransformKernels::transform4},
+        {"SoA kernel, 8 wide:        ", TransformKernels::transform8},
+        {"SoA kernel, 16 wide:       ", TransformKernels::transform16}};
+    for (const auto &[name, kernel] : kernels)
+    {
+        if ((kernel == TransformKernels::transform8 && !__builtin_cpu_supports("avx2")) ||
+            (kernel == TransformKernels::transform16 && !__builtin_cpu_supports("avx512f")))
+            continue;
+        const double simd = timeUs(repetitions, [&]
+                                   {
+                                       TransformKernels::apply(kernel, transform, positions, outPositions, true);
+                                       TransformKernels::apply(kernel, normalTransform, normals, outNormals, false); });
+        std::cout << name << std::setw(8) << simd << " us" << std::setw(8) << legacy / simd << "x" << std::endl;
+    }
+
+    // A larger buffer, split between threads
+    constexpr size_t copies = 256;
+    SoaVertices many(mesh.vertexCount() * copies), manyOut;
+    for (size_t i = 0; i < many.size(); i++)
+    {
+        const auto &p = mesh.positions[i % mesh.vertexCount()];
+        many.x[i] = p.x, many.y[i] = p.y, many.z[i] = p.z;
+    }
+    TransformKernels::apply(transform, many, manyOut, true);
+    std::cout << many.size() << " vertices:" << std::endl;
+    std::cout << "threads   time (us)  Mvertices/s" << std::endl;
+    std::vector<size_t> threadCounts = {1, 2, 4, 8};
+    if (std::find(threadCounts.begin(), threadCounts.end(), ThreadLimit::hardwareThreads()) == threadCounts.end())
+        threadCounts.push_back(ThreadLimit::hardwareThreads());
+    for (auto threads : threadCounts)
+    {
+        ThreadLimit threadLimit(threads);
+        const double time = timeUs(20, [&]
+                                   { TransformKernels::apply(transform, many, manyOut, true); });
+        std::cout << std::setw(7) << threads << std::setw(12) << time << std::setw(13) << many.size() / time << std::endl;
+    }
+
+    return 0;
+}
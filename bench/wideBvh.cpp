@@ -0,0 +1,202 @@
+// Compares the traversal of the binary BVH with 4- and 8-wide BVHs collapsed from
+// it, for several builders, on one spot mesh, and the wide BVHs with their
+// compressed versions on a scene too large for the L2 cache. "bvh4p" packs the
+// triangles in leaf order (see Mesh). Build with `make wide`.
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../scene.cpp"
+
+#include "../bvh/binned_sah_builder.hpp"
+#include "../bvh/locally_ordered_clustering_builder.hpp"
+#include "../bvh/wide_bvh_compressor.hpp"
+#include "timing.hpp"
+
+using Bvh4 = bvh::WideBvh<BvhScalar, 4>;
+using Bvh8 = bvh::WideBvh<BvhScalar, 8>;
+using CompressedBvh4 = bvh::CompressedWideBvh<BvhScalar, 4>;
+using CompressedBvh8 = bvh::CompressedWideBvh<BvhScalar, 8>;
+
+struct Run
+{
+    double ms = 0;
+    size_t steps = 0;
+    size_t intersections = 0;
+};
+
+// Traces every ray, and stores the distance of the closest hit (or infinity).
+template <typename Hierarchy, typename Traverser>
+inline void traceAll(const Hierarchy &hierarchy, const std::vector<BvhTriangle> &triangles, const std::vector<BvhRay> &rays, std::vector<float> &distances, Run &run)
+{
+    bvh::ClosestPrimitiveIntersector<Hierarchy, BvhTriangle> intersector(hierarchy, triangles.data());
+    Traverser traverser(hierarchy);
+    typename Traverser::Statistics statistics;
+    for (size_t i = 0; i < rays.size(); i++)
+    {
+        auto hit = traverser.traverse(rays[i], intersector, statistics);
+        distances[i] = hit ? hit->distance() : std::numeric_limits<float>::infinity();
+    }
+    run.steps = statistics.traversal_steps;
+    run.intersections = statistics.intersections;
+}
+
+__attribute__((flatten)) void traceBinary(const Bvh &hierarchy, const std::vector<BvhTriangle> &triangles, const std::vector<BvhRay> &rays, std::vector<float> &distances, Run &run)
+{
+    traceAll<Bvh, bvh::SingleRayTraverser<Bvh>>(hierarchy, triangles, rays, distances, run);
+}
+
+__attribute__((flatten)) void trace4(const Bvh4 &hierarchy, const std::vector<BvhTriangle> &triangles, const std::vector<BvhRay> &rays, std::vector<float> &distances, Run &run)
+{
+    traceAll<Bvh4, bvh::WideBvhTraverser<Bvh4>>(hierarchy, triangles, rays, distances, run);
+}
+
+__attribute__((target("avx2,fma"), flatten)) void trace8(const Bvh8 &hierarchy, const std::vector<BvhTriangle> &triangles, const std::vector<BvhRay> &rays, std::vector<float> &distances, Run &run)
+{
+    traceAll<Bvh8, bvh::WideBvhTraverser<Bvh8>>(hierarchy, triangles, rays, distances, run);
+}
+
+__attribute__((flatten)) void trace4(const CompressedBvh4 &hierarchy, const std::vector<BvhTriangle> &triangles, const std::vector<BvhRay> &rays, std::vector<float> &distances, Run &run)
+{
+    traceAll<CompressedBvh4, bvh::WideBvhTraverser<CompressedBvh4>>(hierarchy, triangles, rays, distances, run);
+}
+
+__attribute__((target("avx2,fma"), flatten)) void trace8(const CompressedBvh8 &hierarchy, const std::vector<BvhTriangle> &triangles, const std::vector<BvhRay> &rays, std::vector<float> &distances, Run &run)
+{
+    traceAll<CompressedBvh8, bvh::WideBvhTraverser<CompressedBvh8>>(hierarchy, triangles, rays, distances, run);
+}
+
+// Same as trace4, with the triangles packed in leaf order and tested four at a time.
+__attribute__((flatten)) void trace4(const Bvh4 &hierarchy, const bvh::PackedTriangles<BvhScalar, 4> &triangles, const std::vector<BvhRay> &rays, std::vector<float> &distances, Run &run)
+{
+    bvh::ClosestPackedTriangleIntersector<BvhScalar, 4> intersector(triangles);
+    bvh::WideBvhTraverser<Bvh4> traverser(hierarchy);
+    bvh::WideBvhTraverser<Bvh4>::Statistics statistics;
+    for (size_t i = 0; i < rays.size(); i++)
+    {
+        auto hit = traverser.traverse(rays[i], intersector, statistics);
+        distances[i] = hit ? hit->distance() : std::numeric_limits<float>::infinity();
+    }
+    run.steps = statistics.traversal_steps;
+    run.intersections = statistics.intersections;
+}
+
+template <typename F>
+Run timed(F f)
+{
+    Run run;
+    f(run);
+    run.ms = timeMs(3, [&]
+                    { f(run); });
+    return run;
+}
+
+template <typename Builder>
+void compare(const std::string &name, const std::vector<BvhTriangle> &triangles, const std::vector<BvhRay> &rays, bool compressed)
+{
+    auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(triangles.data(), triangles.size());
+    auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangles.size());
+
+    Bvh binary;
+    Builder builder(binary);
+    builder.build(global_bbox, bboxes.get(), centers.get(), triangles.size());
+
+    Bvh4 wide4;
+    bvh::WideBvhConverter<Bvh, 4>(binary, wide4).convert();
+    Bvh8 wide8;
+    bvh::WideBvhConverter<Bvh, 8>(binary, wide8).convert();
+
+    std::vector<float> reference(rays.size()), distances(rays.size());
+    auto report = [&](const char *layout, size_t nodes, size_t nodeSize, const Run &run, const std::vector<float> &result)
+    {
+        size_t mismatches = 0;
+        for (size_t i = 0; i < rays.size(); i++)
+            mismatches += std::abs(result[i] - reference[i]) > 1e-4f && result[i] != reference[i];
+        std::cout << std::setw(10) << name << std::setw(8) << layout << std::fixed << std::setprecision(1)
+                  << std::setw(8) << nodes << std::setw(11) << nodes * nodeSize / 1024.0
+                  << std::setw(12) << static_cast<double>(run.steps) / rays.size()
+                  << std::setw(12) << static_cast<double>(run.intersections) / rays.size()
+                  << std::setprecision(2) << std::setw(10) << rays.size() / (run.ms * 1e3)
+                  << std::setw(12) << mismatches << std::endl;
+    };
+
+    report("binary", binary.node_count, sizeof(Bvh::Node), timed([&](Run &run)
+                                                               { traceBinary(binary, triangles, rays, reference, run); }),
+           reference);
+    report("bvh4", wide4.node_count, sizeof(Bvh4::Node), timed([&](Run &run)
+                                                             { trace4(wide4, triangles, rays, distances, run); }),
+           distances);
+    const bvh::PackedTriangles<BvhScalar, 4> packed(triangles.data(), wide4.primitive_indices.get(), triangles.size());
+    report("bvh4p", wide4.node_count, sizeof(Bvh4::Node), timed([&](Run &run)
+                                                              { trace4(wide4, packed, rays, distances, run); }),
+           distances);
+    const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (avx2)
+        report("bvh8", wide8.node_count, sizeof(Bvh8::Node), timed([&](Run &run)
+                                                                 { trace8(wide8, triangles, rays, distances, run); }),
+               distances);
+    if (!compressed)
+        return;
+
+    CompressedBvh4 compressed4;
+    bvh::WideBvhCompressor<BvhScalar, 4>(wide4, compressed4).compress();
+    CompressedBvh8 compressed8;
+    bvh::WideBvhCompressor<BvhScalar, 8>(wide8, compressed8).compress();
+    report("bvh4q", compressed4.node_count, sizeof(CompressedBvh4::Node), timed([&](Run &run)
+                                                                              { trace4(compressed4, triangles, rays, distances, run); }),
+           distances);
+    if (avx2)
+        report("bvh8q", compressed8.node_count, sizeof(CompressedBvh8::Node), timed([&](Run &run)
+                                                                                  { trace8(compressed8, triangles, rays, distances, run); }),
+               distances);
+}
+
+int main(int argc, char const *argv[])
+{
+    Obj cow("spot/spot_triangulated.obj", 0);
+    std::vector<BvhTriangle> triangles;
+    for (size_t i = 0; i < cow.getMesh().triangleCount(); i++)
+        triangles.push_back(cow.getMesh().bvhTriangle(i));
+
+    // Half of the rays are coherent primary rays, the other half go from random
+    // points around the mesh towards random points inside of it, like bounces.
+    constexpr int dim = 256;
+    std::vector<BvhRay> rays;
+    for (int i = 0; i < dim; i++)
+        for (int j = 0; j < dim; j++)
+            rays.emplace_back(BvhVector3(0, 0, -2.5f), bvh::normalize(BvhVector3(-0.6f + 1.2f * j / dim, 0.6f - 1.2f * i / dim, 1)), 0.01f, 30000.0f);
+    std::mt19937 random(42);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+    for (int i = 0; i < dim * dim; i++)
+    {
+        BvhVector3 origin(uniform(random), uniform(random), uniform(random));
+        BvhVector3 target(uniform(random) * 0.5f, uniform(random) * 0.5f, uniform(random) * 0.5f);
+        rays.emplace_back(bvh::normalize(origin) * 2.0f, bvh::normalize(target - bvh::normalize(origin) * 2.0f), 0.01f, 30000.0f);
+    }
+
+    std::cout << triangles.size() << " triangles, " << rays.size() << " rays (single-threaded)" << std::endl;
+    std::cout << "   builder  layout   nodes  size (KB)  steps/ray  prims/ray   Mrays/s  mismatches" << std::endl;
+    compare<bvh::SweepSahBuilder<Bvh>>("sweep", triangles, rays, true);
+    compare<bvh::BinnedSahBuilder<Bvh, 16>>("binned", triangles, rays, false);
+    compare<bvh::LocallyOrderedClusteringBuilder<Bvh, uint32_t>>("ploc", triangles, rays, false);
+
+    // 6x6x6 copies of the mesh, filling the same volume
+    std::vector<BvhTriangle> grid;
+    constexpr int copies = 6;
+    for (int x = 0; x < copies; x++)
+        for (int y = 0; y < copies; y++)
+            for (int z = 0; z < copies; z++)
+            {
+                const BvhVector3 offset(-1 + (x + 0.5f) * 2 / copies, -1 + (y + 0.5f) * 2 / copies, -1 + (z + 0.5f) * 2 / copies);
+                for (const auto &triangle : triangles)
+                    grid.emplace_back(triangle.p0 * (1.0f / copies) + offset, triangle.p1() * (1.0f / copies) + offset, triangle.p2() * (1.0f / copies) + offset);
+            }
+    std::cout << std::endl
+              << grid.size() << " triangles, " << rays.size() << " rays (single-threaded)" << std::endl;
+    std::cout << "   builder  layout   nodes  size (KB)  steps/ray  prims/ray   Mrays/s  mismatches" << std::endl;
+    compare<bvh::SweepSahBuilder<Bvh>>("sweep", grid, rays, true);
+
+    return 0;
+}
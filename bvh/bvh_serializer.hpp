@@ -0,0 +1,173 @@
+#ifndef BVH_BVH_SERIALIZER_HPP
+#define BVH_BVH_SERIALIZER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <ostream>
+
+#include "bvh.hpp"
+
+namespace bvh {
+
+/// Saves a BVH to a binary stream, and loads it back from memory (typically, a mapped file).
+/// The file starts with a versioned header that records the layout of the nodes and
+/// how the BVH was obtained, followed by the nodes and the primitive indices. Both arrays
+/// start on a 64-byte boundary, so that they can be read in place from a mapping.
+/// Loading validates the header and the topology, and fails on any mismatch.
+template <typename Bvh>
+class BvhSerializer {
+    using Scalar    = typename Bvh::ScalarType;
+    using IndexType = typename Bvh::IndexType;
+
+    static constexpr uint32_t version   = 1;
+    static constexpr size_t   alignment = 64;
+    static constexpr char     magic[8]  = { 'B', 'V', 'H', 'F', 'I', 'L', 'E', 0 };
+
+    struct Header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t scalar_size;
+        uint32_t index_size;
+        uint32_t node_size;
+        uint64_t node_count;
+        uint64_t primitive_index_count;
+        uint64_t nodes_offset;
+        uint64_t primitive_indices_offset;
+        uint32_t builder;
+        uint32_t reserved;
+        double   sah_cost;
+        uint64_t key;
+    };
+
+    Bvh& bvh;
+
+    static uint64_t align_up(uint64_t offset) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    /// Number of primitive indices referenced by the leaves, which is larger than the number of
+    /// primitives when the builder duplicates references (e.g. with spatial splits).
+    size_t primitive_index_count() const {
+        size_t count = 0;
+        for (size_t i = 0; i < bvh.node_count; ++i) {
+            const auto& node = bvh.nodes[i];
+            if (node.is_leaf())
+                count = std::max<size_t>(count, node.first_child_or_primitive + node.primitive_count);
+        }
+        return count;
+    }
+
+    /// Checks that the nodes form a tree: children come after their parent, as with every builder,
+    /// and every node but the root is the child of exactly one node. A corrupt file could otherwise
+    /// make a child point back to one of its ancestors, or share a subtree between two parents.
+    static bool is_valid(const typename Bvh::Node* nodes, size_t node_count, const uint64_t* primitive_indices, size_t primitive_index_count, size_t primitive_count) {
+        if (node_count == 0 || (nodes[0].is_leaf() && node_count != 1))
+            return false;
+        auto parent_count = std::make_unique<uint8_t[]>(node_count);
+        for (size_t i = 0; i < node_count; ++i) {
+            const auto& node = nodes[i];
+            size_t first = node.first_child_or_primitive;
+            if (node.is_leaf()) {
+                if (first + node.primitive_count > primitive_index_count)
+                    return false;
+            } else {
+                if (first <= i || first + 1 >= node_count || parent_count[first] || parent_count[first + 1])
+                    return false;
+                parent_count[first] = parent_count[first + 1] = 1;
+            }
+        }
+        if (!std::all_of(parent_count.get() + 1, parent_count.get() + node_count, [] (uint8_t count) { return count == 1; }))
+            return false;
+        return std::all_of(primitive_indices, primitive_indices + primitive_index_count,
+            [&] (uint64_t index) { return index < primitive_count; });
+    }
+
+public:
+    /// Information stored alongside the BVH. The meaning of `builder` and `key` is up to
+    /// the caller: typically, they identify the build algorithm and the input primitives,
+    /// so that a file built from other primitives or with other settings can be detected.
+    struct Metadata {
+        uint32_t builder  = 0;
+        double   sah_cost = 0;
+        uint64_t key      = 0;
+    };
+
+    BvhSerializer(Bvh& bvh)
+        : bvh(bvh)
+    {}
+
+    /// Writes the BVH to the given stream. Returns false if the stream fails.
+    bool save(std::ostream& stream, const Metadata& metadata) const {
+        Header header {};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version                  = version;
+        header.scalar_size              = sizeof(Scalar);
+        header.index_size               = sizeof(IndexType);
+        header.node_size                = sizeof(typename Bvh::Node);
+        header.node_count               = bvh.node_count;
+        header.primitive_index_count    = primitive_index_count();
+        header.nodes_offset             = align_up(sizeof(Header));
+        header.primitive_indices_offset = align_up(header.nodes_offset + header.node_count * sizeof(typename Bvh::Node));
+        header.builder                  = metadata.builder;
+        header.sah_cost                 = metadata.sah_cost;
+        header.key                      = metadata.key;
+
+        char padding[alignment] = {};
+        stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        stream.write(padding, header.nodes_offset - sizeof(header));
+        stream.write(reinterpret_cast<const char*>(bvh.nodes.get()), header.node_count * sizeof(typename Bvh::Node));
+        stream.write(padding, header.primitive_indices_offset - header.nodes_offset - header.node_count * sizeof(typename Bvh::Node));
+        if constexpr (sizeof(size_t) == sizeof(uint64_t)) {
+            stream.write(reinterpret_cast<const char*>(bvh.primitive_indices.get()), header.primitive_index_count * sizeof(uint64_t));
+        } else {
+            for (size_t i = 0; i < header.primitive_index_count; ++i) {
+                uint64_t index = bvh.primitive_indices[i];
+                stream.write(reinterpret_cast<const char*>(&index), sizeof(index));
+            }
+        }
+        return static_cast<bool>(stream);
+    }
+
+    /// Replaces the BVH by the one stored in the given memory block, if it is valid and
+    /// if its primitive indices are all lower than `primitive_count`. Returns the metadata
+    /// that was saved with it, or nothing if the block is invalid, in which case the BVH
+    /// is left unchanged.
+    std::optional<Metadata> load(const char* data, size_t size, size_t primitive_count) {
+        Header header;
+        if (size < sizeof(Header))
+            return std::nullopt;
+        std::memcpy(&header, data, sizeof(Header));
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 ||
+            header.version     != version ||
+            header.scalar_size != sizeof(Scalar) ||
+            header.index_size  != sizeof(IndexType) ||
+            header.node_size   != sizeof(typename Bvh::Node))
+            return std::nullopt;
+        if (header.nodes_offset % alignment != 0 ||
+            header.primitive_indices_offset % alignment != 0 ||
+            header.nodes_offset > size ||
+            header.node_count > (size - header.nodes_offset) / sizeof(typename Bvh::Node) ||
+            header.primitive_indices_offset > size ||
+            header.primitive_index_count > (size - header.primitive_indices_offset) / sizeof(uint64_t))
+            return std::nullopt;
+
+        auto nodes = reinterpret_cast<const typename Bvh::Node*>(data + header.nodes_offset);
+        auto primitive_indices = reinterpret_cast<const uint64_t*>(data + header.primitive_indices_offset);
+        if (!is_valid(nodes, header.node_count, primitive_indices, header.primitive_index_count, primitive_count))
+            return std::nullopt;
+
+        bvh.nodes = std::make_unique<typename Bvh::Node[]>(header.node_count);
+        bvh.primitive_indices = std::make_unique<size_t[]>(header.primitive_index_count);
+        bvh.node_count = header.node_count;
+        std::copy(nodes, nodes + header.node_count, bvh.nodes.get());
+        std::copy(primitive_indices, primitive_indices + header.primitive_index_count, bvh.primitive_indices.get());
+        return std::make_optional(Metadata { header.builder, header.sah_cost, header.key });
+    }
+};
+
+} // namespace bvh
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef BVH_COMPRESSED_WIDE_BVH_HPP
+#define BVH_COMPRESSED_WIDE_BVH_HPP
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <limits>
+#include <cstring>
+#include <memory>
+
+#include "utilities.hpp"
+#include "platform.hpp"
+
+namespace bvh {
+
+/// A wide BVH in which the bounding boxes of the children are quantized to 8 bits
+/// per plane, relative to the box of their parent (see "Efficient Incoherent Ray
+/// Traversal on GPUs Through Compressed Wide BVHs", by H. Ylitie et al.). A plane
+/// is decoded as `origin + q * 2^exponent`, which is exact up to the final addition,
+/// and the quantized planes are rounded outwards during compression, so the decoded
+/// boxes always contain the original ones. Nodes are half the size of the nodes of
+/// an uncompressed `WideBvh` with the same width, and are obtained with `WideBvhCompressor`.
+/// The topology is the same as the one of the uncompressed BVH.
+template <typename Scalar, size_t Width>
+struct CompressedWideBvh {
+    using IndexType  = typename SizedIntegerType<sizeof(Scalar) * CHAR_BIT>::Unsigned;
+    using ScalarType = Scalar;
+
+    static constexpr size_t width = Width;
+
+    // The size of this structure is 72 bytes for a 4-wide BVH
+    // and 128 bytes for an 8-wide BVH, in single precision.
+    struct Node {
+        /// Minimum corner of the box of the node.
+        Scalar origin[3];
+        /// Power of two by which the quantized planes are scaled, per axis.
+        int8_t exponent[3];
+        /// Quantized bounds of the children, as rows of min x, max x, min y, max y, min z, max z.
+        uint8_t quantized_bounds[6][Width];
+        /// Index of the first primitive for leaves, or of the child node otherwise.
+        IndexType first_child_or_primitive[Width];
+        /// Number of primitives for leaves, or zero for inner nodes and empty slots.
+        IndexType primitive_count[Width];
+
+        bool is_leaf (size_t i) const { return primitive_count[i] != 0; }
+        bool is_empty(size_t i) const { return primitive_count[i] == 0 && first_child_or_primitive[i] == 0; }
+
+        bvh_always_inline
+        Scalar scale(int axis) const { return exponent_to_scale(exponent[axis]); }
+
+        /// Computes the distances along a ray to one row of planes, as in `WideBvh`. The planes
+        /// are decoded first, exactly as by `bound()`, so that the test sees boxes that contain
+        /// the original ones. Folding the decoding into the distance would save one operation
+        /// per row, but would round differently and could miss a child that the ray grazes.
+        template <typename Vector>
+        bvh_always_inline
+        Vector plane_distances(size_t row, Scalar inverse_direction, Scalar scaled_origin) const {
+            typedef uint8_t Bytes __attribute__((vector_size(Width)));
+            Bytes bytes;
+            std::memcpy(&bytes, quantized_bounds[row], sizeof(Bytes));
+            auto axis = row / 2;
+            // The product is exact: the scale is a power of two and the planes have 8 bits
+            auto planes = __builtin_convertvector(bytes, Vector) * scale(axis) + origin[axis];
+            return planes * inverse_direction + scaled_origin;
+        }
+
+        Scalar bound(size_t row, size_t i) const {
+            return origin[row / 2] + Scalar(quantized_bounds[row][i]) * scale(row / 2);
+        }
+    };
+
+    /// Returns 2^exponent, by building the floating point number directly.
+    static Scalar exponent_to_scale(int exponent) {
+        using Bits = typename SizedIntegerType<sizeof(Scalar) * CHAR_BIT>::Unsigned;
+        constexpr int mantissa_bits = std::numeric_limits<Scalar>::digits - 1;
+        constexpr int bias = std::numeric_limits<Scalar>::max_exponent - 1;
+        Bits bits = static_cast<Bits>(exponent + bias) << mantissa_bits;
+        Scalar scale;
+        std::memcpy(&scale, &bits, sizeof(Scalar));
+        return scale;
+    }
+
+    static constexpr int min_exponent = std::max(std::numeric_limits<Scalar>::min_exponent - 1, INT8_MIN);
+    static constexpr int max_exponent = std::min(std::numeric_limits<Scalar>::max_exponent - 1, INT8_MAX);
+
+    std::unique_ptr<Node[]>   nodes;
+    std::unique_ptr<size_t[]> primitive_indices;
+
+    size_t node_count = 0;
+    /// Number of nodes on the longest path from the root to a leaf (leaves excluded).
+    size_t depth = 0;
+};
+
+} // namespace bvh
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef BVH_PACKED_TRIANGLES_HPP
+#define BVH_PACKED_TRIANGLES_HPP
+
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <utility>
+
+#include "triangle.hpp"
+#include "ray.hpp"
+#include "ray_packet.hpp"
+#include "platform.hpp"
+
+namespace bvh {
+
+/// Precomputed triangle data (the same as in `Triangle`), stored as a structure of arrays.
+/// The triangles are meant to be stored in the order of the leaves of a BVH, so that the
+/// triangles of a leaf are contiguous: they can then be intersected `Width` at a time with
+/// SIMD instructions, and no indirection through the primitive indices is needed.
+template <typename Scalar, size_t Width, bool LeftHandedNormal = true>
+class PackedTriangles {
+public:
+    using Vector       = typename SimdTypes<Scalar, Width>::Vector;
+    using Mask         = typename SimdTypes<Scalar, Width>::Mask;
+    using Primitive    = Triangle<Scalar, LeftHandedNormal>;
+    using Intersection = typename Primitive::Intersection;
+
+    static constexpr size_t width = Width;
+
+    PackedTriangles() = default;
+
+    /// Packs the given triangles, such that triangle `i` is `triangles[indices[i]]`.
+    /// Typically, the indices are the primitive indices of a BVH.
+    PackedTriangles(const Primitive* triangles, const size_t* indices, size_t count)
+        : count(count), stride(count + Width - 1)
+    {
+        // The arrays are padded so that vectors can be loaded past the last triangle
+        data = std::make_unique<Scalar[]>(component_count * stride);
+        for (size_t i = 0; i < count; ++i) {
+            const auto& triangle = triangles[indices[i]];
+            for (int axis = 0; axis < 3; ++axis) {
+                component(0 + axis)[i] = triangle.p0[axis];
+                component(3 + axis)[i] = triangle.e1[axis];
+                component(6 + axis)[i] = triangle.e2[axis];
+                component(9 + axis)[i] = triangle.n[axis];
+            }
+        }
+    }
+
+    size_t size() const { return count; }
+
+    Primitive operator [] (size_t i) const {
+        Primitive triangle;
+        for (int axis = 0; axis < 3; ++axis) {
+            triangle.p0[axis] = component(0 + axis)[i];
+            triangle.e1[axis] = component(3 + axis)[i];
+            triangle.e2[axis] = component(6 + axis)[i];
+            triangle.n [axis] = component(9 + axis)[i];
+        }
+        return triangle;
+    }
+
+    /// Intersects the ray with the triangles in [begin, end), `Width` at a time,
+    /// and returns the index and intersection of the closest hit, if any.
+    bvh_always_inline
+    std::optional<std::pair<size_t, Intersection>> intersect(size_t begin, size_t end, const Ray<Scalar>& ray) const {
+        std::optional<std::pair<size_t, Intersection>> best_hit;
+        Scalar tmax = ray.tmax;
+        for (size_t first = begin; first < end; first += Width) {
+            Vector t, u, v;
+            auto hit = intersect(first, end, ray, tmax, t, u, v);
+            if (none(hit))
+                continue;
+            for (size_t i = 0; i < Width; ++i) {
+                if (hit[i] && t[i] <= tmax) {
+                    tmax = t[i];
+                    best_hit = std::make_pair(first + i, Intersection { t[i], u[i], v[i] });
+                }
+            }
+        }
+        return best_hit;
+    }
+
+    /// Same as above, but stops at the first hit, which is not necessarily the closest,
+    /// and only returns its distance. This is enough for occlusion (e.g. shadow) rays.
+    bvh_always_inline
+    std::optional<Scalar> intersect_any(size_t begin, size_t end, const Ray<Scalar>& ray) const {
+        for (size_t first = begin; first < end; first += Width) {
+            Vector t, u, v;
+            auto hit = intersect(first, end, ray, ray.tmax, t, u, v);
+            if (none(hit))
+                continue;
+            for (size_t i = 0; i < Width; ++i) {
+                if (hit[i])
+                    return std::make_optional(t[i]);
+            }
+        }
+        return std::nullopt;
+    }
+
+private:
+    /// Tests the ray against the `Width` triangles starting at `first`, and returns the
+    /// mask of the triangles before `end` that are hit within [ray.tmin, tmax].
+    bvh_always_inline
+    Mask intersect(size_t first, size_t end, const Ray<Scalar>& ray, Scalar tmax, Vector& t, Vector& u, Vector& v) const {
+        auto negate_when_right_handed = [] (Scalar x) { return LeftHandedNormal ? x : -x; };
+
+        using Integer = typename SimdTypes<Scalar, Width>::Integer;
+        Mask lanes;
+        for (size_t i = 0; i < Width; ++i)
+            lanes[i] = i;
+
+        Vector p0[3], e1[3], e2[3], n[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            p0[axis] = load(0 + axis, first);
+            e1[axis] = load(3 + axis, first);
+            e2[axis] = load(6 + axis, first);
+            n [axis] = load(9 + axis, first);
+        }
+
+        const Scalar d[3] = { ray.direction[0], ray.direction[1], ray.direction[2] };
+        Vector c[3] = { p0[0] - ray.origin[0], p0[1] - ray.origin[1], p0[2] - ray.origin[2] };
+        Vector r[3] = {
+            d[1] * c[2] - d[2] * c[1],
+            d[2] * c[0] - d[0] * c[2],
+            d[0] * c[1] - d[1] * c[0]
+        };
+        Vector inv_det = negate_when_right_handed(Scalar(1.0)) / (n[0] * d[0] + n[1] * d[1] + n[2] * d[2]);
+
+        u = (r[0] * e2[0] + r[1] * e2[1] + r[2] * e2[2]) * inv_det;
+        v = (r[0] * e1[0] + r[1] * e1[1] + r[2] * e1[2]) * inv_det;
+        Vector w = Scalar(1.0) - u - v;
+        t = negate_when_right_handed(Scalar(1.0)) * (n[0] * c[0] + n[1] * c[1] + n[2] * c[2]) * inv_det;
+
+        // As in the single-ray test, NaNs make these comparisons fail
+        return (lanes < static_cast<Integer>(end - first)) &
+            (u >= Scalar(0)) & (v >= Scalar(0)) & (w >= Scalar(0)) &
+            (t >= ray.tmin) & (t <= tmax);
+    }
+
+    static constexpr size_t component_count = 12;
+
+    Scalar* component(size_t k) { return data.get() + k * stride; }
+    const Scalar* component(size_t k) const { return data.get() + k * stride; }
+
+    bvh_always_inline
+    Vector load(size_t k, size_t first) const {
+        Vector vector;
+        std::memcpy(&vector, component(k) + first, sizeof(Vector));
+        return vector;
+    }
+
+    std::unique_ptr<Scalar[]> data;
+    size_t count  = 0;
+    size_t stride = 0;
+};
+
+/// An intersector that looks for the closest intersection in a `PackedTriangles` array.
+/// The triangles must be in leaf order, as with `Permuted` in the other intersectors.
+/// Traversers that support it call `intersect_leaf()`, which tests the triangles of a
+/// leaf `Width` at a time.
+template <typename Scalar, size_t Width, bool LeftHandedNormal = true>
+struct ClosestPackedTriangleIntersector {
+    using Triangles    = PackedTriangles<Scalar, Width, LeftHandedNormal>;
+    using Intersection = typename Triangles::Intersection;
+
+    struct Result {
+        size_t       primitive_index;
+        Intersection intersection;
+
+        Scalar distance() const { return intersection.distance(); }
+    };
+
+    static constexpr bool any_hit = false;
+
+    ClosestPackedTriangleIntersector(const Triangles& triangles)
+        : triangles(triangles)
+    {}
+
+    std::optional<Result> intersect(size_t index, const Ray<Scalar>& ray) const {
+        if (auto hit = triangles[index].intersect(ray))
+            return std::make_optional(Result { index, *hit });
+        return std::nullopt;
+    }
+
+    bvh_always_inline
+    std::optional<Result> intersect_leaf(size_t begin, size_t end, const Ray<Scalar>& ray) const {
+        if (auto hit = triangles.intersect(begin, end, ray))
+            return std::make_optional(Result { hit->first, hit->second });
+        return std::nullopt;
+    }
+
+    const Triangles& triangles;
+};
+
+/// An intersector for `PackedTriangles` that exits on the first hit, like `AnyPrimitiveIntersector`.
+template <typename Scalar, size_t Width, bool LeftHandedNormal = true>
+struct AnyPackedTriangleIntersector {
+    using Triangles = PackedTriangles<Scalar, Width, LeftHandedNormal>;
+
+    struct Result {
+        Scalar t;
+        Scalar distance() const { return t; }
+    };
+
+    static constexpr bool any_hit = true;
+
+    AnyPackedTriangleIntersector(const Triangles& triangles)
+        : triangles(triangles)
+    {}
+
+    std::optional<Result> intersect(size_t index, const Ray<Scalar>& ray) const {
+        if (auto hit = triangles[index].intersect(ray))
+            return std::make_optional(Result { hit->distance() });
+        return std::nullopt;
+    }
+
+    bvh_always_inline
+    std::optional<Result> intersect_leaf(size_t begin, size_t end, const Ray<Scalar>& ray) const {
+        if (auto t = triangles.intersect_any(begin, end, ray))
+            return std::make_optional(Result { *t });
+        return std::nullopt;
+    }
+
+    const Triangles& triangles;
+};
+
+/// An intersector that looks for the closest intersection of each ray of a packet in a
+/// `PackedTriangles` array, which must be in leaf order. See `ClosestPacketIntersector`.
+template <typename Scalar, size_t Width, size_t N, bool LeftHandedNormal = true>
+struct ClosestPackedTrianglePacketIntersector {
+    using Triangles    = PackedTriangles<Scalar, Width, LeftHandedNormal>;
+    using Packet       = RayPacket<Scalar, N>;
+    using Mask         = typename Packet::Mask;
+    using Intersection = typename Triangles::Primitive::template PacketIntersection<N>;
+
+    struct Result {
+        Mask         hit {};
+        Mask         primitive_index {};
+        Intersection intersection {};
+    };
+
+    ClosestPackedTrianglePacketIntersector(const Triangles& triangles)
+        : triangles(triangles)
+    {}
+
+    bvh_always_inline
+    Mask intersect(size_t index, Packet& packet, Mask active, Result& result) const {
+        using Integer = typename SimdTypes<Scalar, N>::Integer;
+        auto hit = triangles[index].intersect(packet, active, result.intersection);
+        packet.tmax = hit ? result.intersection.t : packet.tmax;
+        result.primitive_index = hit ? Mask {} + static_cast<Integer>(index) : result.primitive_index;
+        result.hit |= hit;
+        return hit;
+    }
+
+    const Triangles& triangles;
+};
+
+} // namespace bvh
+
+#endif
@@ -0,0 +1,297 @@
+#ifndef BVH_PACKET_TRAVERSER_HPP
+#define BVH_PACKET_TRAVERSER_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+#include "bvh.hpp"
+#include "ray_packet.hpp"
+#include "utilities.hpp"
+#include "platform.hpp"
+
+namespace bvh {
+
+/// Traversal algorithm for packets of N rays. The whole packet descends the hierarchy together,
+/// and a node is visited as long as at least one of the active rays hits it. Each ray-node and
+/// ray-primitive test is done for all the rays of the packet at once with SIMD instructions,
+/// which pays off when the rays are coherent, as is the case for primary rays.
+/// Before the per-ray test, a node is tested against the intervals that bound the origins,
+/// inverse directions and distances of the whole packet, which rejects it in one scalar
+/// test when none of the rays can hit it (see "Ray Tracing Deformable Scenes Using Dynamic
+/// Bounding Volume Hierarchies", by I. Wald et al.). This needs the directions of the
+/// active rays to have the same sign on every axis; otherwise only the per-ray test is used.
+/// The interval test is off by default: with packets of at most 16 rays, the per-ray test is
+/// a single SIMD instruction per slab, and the scalar interval test costs more than it saves.
+/// The primitive intersector must provide a packet version of `intersect()`,
+/// such as the one of `ClosestPacketIntersector`.
+template <typename Bvh, size_t N, size_t StackSize = 64>
+class PacketTraverser {
+public:
+    static constexpr size_t stack_size = StackSize;
+
+    using Scalar = typename Bvh::ScalarType;
+    using Packet = RayPacket<Scalar, N>;
+    using Vector = typename Packet::Vector;
+    using Mask   = typename Packet::Mask;
+
+private:
+    struct Stack {
+        using Element = typename Bvh::IndexType;
+
+        Element elements[stack_size];
+        size_t size = 0;
+
+        void push(const Element& t) {
+            assert(size < stack_size);
+            elements[size++] = t;
+        }
+
+        Element pop() {
+            assert(!empty());
+            return elements[--size];
+        }
+
+        bool empty() const { return size == 0; }
+    };
+
+    /// Per-packet data for the ray-node tests, equivalent to the one of `FastNodeIntersector`,
+    /// and the bounds of the packet for the interval test.
+    struct NodeIntersector {
+        Vector inverse_direction[3];
+        Vector scaled_origin[3];
+
+        bool coherent;
+        Scalar tmin, tmax;
+        /// Index of the near and far planes of the nodes, by axis.
+        int near[3], far[3];
+        /// Bounds of the origins to subtract from the near and far planes, and bounds of the
+        /// inverse directions, by axis.
+        Scalar near_origin[3], far_origin[3];
+        Scalar inverse_min[3], inverse_max[3];
+
+        NodeIntersector(const Packet& packet, Mask active, bool interval_culling) {
+            static constexpr auto threshold = std::numeric_limits<Scalar>::epsilon();
+            static constexpr auto max = std::numeric_limits<Scalar>::max();
+            for (int axis = 0; axis < 3; ++axis) {
+                auto d = packet.direction[axis];
+                auto small = (d < threshold) & (d > -threshold);
+                auto safe_d = small ? (d < Scalar(0) ? Vector {} - threshold : Vector {} + threshold) : d;
+                inverse_direction[axis] = Scalar(1) / safe_d;
+                scaled_origin[axis] = -packet.origin[axis] * inverse_direction[axis];
+            }
+
+            coherent = interval_culling;
+            for (int axis = 0; coherent && axis < 3; ++axis) {
+                inverse_min[axis] = reduce_min(active ? inverse_direction[axis] : Vector {} + max);
+                inverse_max[axis] = reduce_max(active ? inverse_direction[axis] : Vector {} - max);
+                coherent = inverse_min[axis] > 0 || inverse_max[axis] < 0;
+                bool positive = inverse_min[axis] > 0;
+                Scalar origin_min = reduce_min(active ? packet.origin[axis] : Vector {} + max);
+                Scalar origin_max = reduce_max(active ? packet.origin[axis] : Vector {} - max);
+                near[axis] = axis * 2 + (positive ? 0 : 1);
+                far [axis] = axis * 2 + (positive ? 1 : 0);
+                near_origin[axis] = positive ? origin_max : origin_min;
+                far_origin [axis] = positive ? origin_min : origin_max;
+            }
+            tmin = reduce_min(active ? packet.tmin : Vector {} + max);
+            shrink(packet, active);
+        }
+
+        /// Updates the largest distance of the packet, after the rays have hit primitives.
+        bvh_always_inline
+        void shrink(const Packet& packet, Mask active) {
+            tmax = reduce_max(active ? packet.tmax : Vector {} - std::numeric_limits<Scalar>::max());
+        }
+
+        /// Returns true when no ray of the packet can hit the node. The distances to the slabs
+        /// are bounded by interval arithmetic, and the bounds are widened by a few ulps so that
+        /// a node hit by one of the rays is never rejected because of rounding.
+        bvh_always_inline
+        bool cull(const typename Bvh::Node& node) const {
+            static constexpr auto tolerance = 4 * std::numeric_limits<Scalar>::epsilon();
+            Scalar entry = tmin;
+            Scalar exit  = tmax;
+            for (int axis = 0; axis < 3; ++axis) {
+                // Smallest distance to the near plane and largest distance to the far plane
+                // over all the origins and directions: the sign of the distance along the
+                // axis picks the bound of the inverse direction.
+                Scalar near_distance = node.bounds[near[axis]] - near_origin[axis];
+                Scalar far_distance  = node.bounds[far [axis]] - far_origin [axis];
+                Scalar t0 = near_distance * (near_distance >= 0 ? inverse_min[axis] : inverse_max[axis]);
+                Scalar t1 = far_distance  * (far_distance  >= 0 ? inverse_max[axis] : inverse_min[axis]);
+                entry = std::max(entry, t0 - std::abs(t0) * tolerance);
+                exit  = std::min(exit,  t1 + std::abs(t1) * tolerance);
+            }
+            return entry > exit;
+        }
+
+        /// Returns the mask of the active rays that hit the node.
+        template <typename Statistics>
+        bvh_always_inline
+        Mask intersect(const typename Bvh::Node& node, const Packet& packet, Mask active, Statistics& statistics) const {
+            if (coherent && cull(node)) {
+                statistics.culled_nodes++;
+                return Mask {};
+            }
+            Vector entry = packet.tmin;
+            Vector exit  = packet.tmax;
+            for (int axis = 0; axis < 3; ++axis) {
+                auto t0 = node.bounds[axis * 2 + 0] * inverse_direction[axis] + scaled_origin[axis];
+                auto t1 = node.bounds[axis * 2 + 1] * inverse_direction[axis] + scaled_origin[axis];
+                entry = simd_max(simd_min(t0, t1), entry);
+                exit  = simd_min(simd_max(t0, t1), exit);
+            }
+            return active & (entry <= exit);
+        }
+    };
+
+    template <typename PrimitiveIntersector, typename Statistics>
+    bvh_always_inline
+    void intersect_leaf(
+        const typename Bvh::Node& node,
+        Packet& packet,
+        Mask active,
+        typename PrimitiveIntersector::Result& result,
+        PrimitiveIntersector& primitive_intersector,
+        Statistics& statistics) const
+    {
+        assert(node.is_leaf());
+        size_t begin = node.first_child_or_primitive;
+        size_t end   = begin + node.primitive_count;
+        statistics.intersections += end - begin;
+        for (size_t i = begin; i < end; ++i)
+            primitive_intersector.intersect(i, packet, active, result);
+    }
+
+    template <typename PrimitiveIntersector, typename Statistics>
+    bvh_always_inline
+    typename PrimitiveIntersector::Result
+    intersect(Packet packet, Mask active, PrimitiveIntersector& primitive_intersector, Statistics& statistics) const {
+        typename PrimitiveIntersector::Result result {};
+
+        NodeIntersector node_intersector(packet, active, interval_culling);
+        if (none(node_intersector.intersect(bvh.nodes[0], packet, active, statistics)))
+            return result;
+        if (bvh_unlikely(bvh.nodes[0].is_leaf())) {
+            intersect_leaf(bvh.nodes[0], packet, active, result, primitive_intersector, statistics);
+            return result;
+        }
+
+        // The traversal order is the same for the whole packet, and is given by the average direction.
+        Scalar direction[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            direction[axis] = 0;
+            for (size_t i = 0; i < N; ++i)
+                direction[axis] += active[i] ? packet.direction[axis][i] : Scalar(0);
+        }
+
+        // Nodes are tested again when they are popped, with the distances found so far.
+        Stack stack;
+        auto* left_child = &bvh.nodes[bvh.nodes[0].first_child_or_primitive];
+        while (true) {
+            statistics.traversal_steps++;
+
+            auto* right_child = left_child + 1;
+            auto hit_left  = node_intersector.intersect(*left_child,  packet, active, statistics);
+            auto hit_right = node_intersector.intersect(*right_child, packet, active, statistics);
+
+            if (any(hit_left)) {
+                if (bvh_unlikely(left_child->is_leaf())) {
+                    intersect_leaf(*left_child, packet, hit_left, result, primitive_intersector, statistics);
+                    node_intersector.shrink(packet, active);
+                    left_child = nullptr;
+                }
+            } else
+                left_child = nullptr;
+
+            if (any(hit_right)) {
+                if (bvh_unlikely(right_child->is_leaf())) {
+                    intersect_leaf(*right_child, packet, hit_right, result, primitive_intersector, statistics);
+                    node_intersector.shrink(packet, active);
+                    right_child = nullptr;
+                }
+            } else
+                right_child = nullptr;
+
+            if (left_child) {
+                if (right_child) {
+                    // Visit first the child that comes first along the average direction
+                    Scalar order = 0;
+                    for (int axis = 0; axis < 3; ++axis) {
+                        order += direction[axis] * (
+                            (right_child->bounds[axis * 2] + right_child->bounds[axis * 2 + 1]) -
+                            (left_child ->bounds[axis * 2] + left_child ->bounds[axis * 2 + 1]));
+                    }
+                    if (order < 0)
+                        std::swap(left_child, right_child);
+                    stack.push(right_child - bvh.nodes.get());
+                }
+                left_child = &bvh.nodes[left_child->first_child_or_primitive];
+            } else if (right_child) {
+                left_child = &bvh.nodes[right_child->first_child_or_primitive];
+            } else {
+                // Pop nodes until one of them is still hit by the packet
+                left_child = nullptr;
+                while (!stack.empty()) {
+                    auto* node = &bvh.nodes[stack.pop()];
+                    if (any(node_intersector.intersect(*node, packet, active, statistics))) {
+                        left_child = &bvh.nodes[node->first_child_or_primitive];
+                        break;
+                    }
+                }
+                if (!left_child)
+                    break;
+            }
+        }
+
+        return result;
+    }
+
+    const Bvh& bvh;
+
+public:
+    /// Statistics collected during traversal.
+    struct Statistics {
+        size_t traversal_steps = 0;
+        size_t intersections   = 0;
+        /// Nodes rejected by the interval test, without testing the rays one by one.
+        size_t culled_nodes    = 0;
+    };
+
+    /// Whether nodes are first tested against the bounds of the whole packet.
+    bool interval_culling = false;
+
+    PacketTraverser(const Bvh& bvh)
+        : bvh(bvh)
+    {}
+
+    /// Intersects the BVH with the active rays of the packet.
+    template <typename PrimitiveIntersector>
+    bvh_always_inline
+    typename PrimitiveIntersector::Result
+    traverse(const Packet& packet, Mask active, PrimitiveIntersector& intersector) const {
+        struct {
+            struct Empty {
+                Empty& operator ++ (int)    { return *this; }
+                Empty& operator ++ ()       { return *this; }
+                Empty& operator += (size_t) { return *this; }
+            } traversal_steps, intersections, culled_nodes;
+        } statistics;
+        return intersect(packet, active, intersector, statistics);
+    }
+
+    /// Intersects the BVH with the active rays of the packet.
+    /// Record statistics on the number of traversal and intersection steps.
+    template <typename PrimitiveIntersector>
+    bvh_always_inline
+    typename PrimitiveIntersector::Result
+    traverse(const Packet& packet, Mask active, PrimitiveIntersector& primitive_intersector, Statistics& statistics) const {
+        return intersect(packet, active, primitive_intersector, statistics);
+    }
+};
+
+} // namespace bvh
+
+#endif
@@ -2,6 +2,8 @@
 #define BVH_PARALLEL_REINSERTION_OPTIMIZER_HPP
 
 #include <cassert>
+#include <memory>
+#include <vector>
 
 #include "bvh.hpp"
 #include "sah_based_algorithm.hpp"
@@ -208,6 +210,36 @@ public:
             }
             old_cost = new_cost;
         }
+
+        reorder();
+    }
+
+private:
+    /// Renumbers the nodes in depth-first order. Reinsertions move pairs of children into the
+    /// slots freed by other nodes, which can be before their new parent; after this, children
+    /// come after their parent again, as with the builders.
+    void reorder() {
+        auto nodes = std::make_unique<typename Bvh::Node[]>(bvh.node_count);
+        nodes[0] = bvh.nodes[0];
+        parents[0] = 0;
+        size_t count = 1;
+        std::vector<size_t> stack { 0 };
+        while (!stack.empty()) {
+            size_t i = stack.back();
+            stack.pop_back();
+            if (nodes[i].is_leaf())
+                continue;
+            size_t first = nodes[i].first_child_or_primitive;
+            nodes[count + 0] = bvh.nodes[first + 0];
+            nodes[count + 1] = bvh.nodes[first + 1];
+            nodes[i].first_child_or_primitive = count;
+            parents[count + 0] = parents[count + 1] = i;
+            stack.push_back(count + 1);
+            stack.push_back(count + 0);
+            count += 2;
+        }
+        assert(count == bvh.node_count);
+        std::swap(bvh.nodes, nodes);
     }
 };
 
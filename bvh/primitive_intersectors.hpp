@@ -4,6 +4,7 @@
 #include <optional>
 
 #include "ray.hpp"
+#include "ray_packet.hpp"
 
 namespace bvh {
 
@@ -54,6 +55,9 @@ struct ClosestPrimitiveIntersector : public PrimitiveIntersector<Bvh, Primitive,
 };
 
 /// An intersector that exits after the first hit and only stores the distance to the primitive.
+/// Primitives that can themselves stop at their first hit (e.g. instances of a mesh with its own
+/// BVH) may provide `intersect_any()`, which returns the distance to any hit and is used instead
+/// of `intersect()`.
 template <typename Bvh, typename Primitive, bool Permuted = false>
 struct AnyPrimitiveIntersector : public PrimitiveIntersector<Bvh, Primitive, Permuted, true> {
     using Scalar = typename Primitive::ScalarType;
@@ -69,12 +73,49 @@ struct AnyPrimitiveIntersector : public PrimitiveIntersector<Bvh, Primitive, Per
 
     std::optional<Result> intersect(size_t index, const Ray<Scalar>& ray) const {
         auto [p, i] = this->primitive_at(index);
-        if (auto hit = p.intersect(ray))
+        if constexpr (requires { p.intersect_any(ray); }) {
+            if (auto t = p.intersect_any(ray))
+                return std::make_optional(Result { *t });
+        } else if (auto hit = p.intersect(ray)) {
             return std::make_optional(Result { hit->distance() });
+        }
         return std::nullopt;
     }
 };
 
+/// An intersector that looks for the closest intersection of each ray of a packet.
+/// The primitive must provide a packet version of `intersect()`, as `bvh::Triangle` does.
+template <typename Bvh, typename Primitive, size_t N, bool Permuted = false>
+struct ClosestPacketIntersector : public PrimitiveIntersector<Bvh, Primitive, Permuted, false> {
+    using Scalar       = typename Primitive::ScalarType;
+    using Packet       = RayPacket<Scalar, N>;
+    using Mask         = typename Packet::Mask;
+    using Intersection = typename Primitive::template PacketIntersection<N>;
+
+    struct Result {
+        Mask         hit {};
+        Mask         primitive_index {};
+        Intersection intersection {};
+    };
+
+    ClosestPacketIntersector(const Bvh& bvh, const Primitive* primitives)
+        : PrimitiveIntersector<Bvh, Primitive, Permuted, false>(bvh, primitives)
+    {}
+
+    /// Intersects the active rays of the packet with a primitive. The maximum distance
+    /// of the rays that hit is shortened, and the mask of those rays is returned.
+    bvh_always_inline
+    Mask intersect(size_t index, Packet& packet, Mask active, Result& result) const {
+        using Integer = typename SimdTypes<Scalar, N>::Integer;
+        auto [p, i] = this->primitive_at(index);
+        auto hit = p.intersect(packet, active, result.intersection);
+        packet.tmax = hit ? result.intersection.t : packet.tmax;
+        result.primitive_index = hit ? Mask {} + static_cast<Integer>(i) : result.primitive_index;
+        result.hit |= hit;
+        return hit;
+    }
+};
+
 } // namespace bvh
 
 #endif
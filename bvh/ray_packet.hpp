@@ -0,0 +1,112 @@
+#ifndef BVH_RAY_PACKET_HPP
+#define BVH_RAY_PACKET_HPP
+
+#include <cstddef>
+#include <climits>
+
+#include "ray.hpp"
+#include "utilities.hpp"
+#include "platform.hpp"
+
+namespace bvh {
+
+/// SIMD types for packets of N scalars, based on the GCC/Clang vector extensions.
+/// Arithmetic operators work lane-wise, and comparisons return a mask in which each
+/// lane is either all ones (true) or all zeros (false). The instruction set used for
+/// these operations is the one of the function they are inlined into, which makes it
+/// possible to compile the same code for several targets. The alignment is explicit,
+/// because the default one depends on the target (it is capped to 16 bytes without AVX),
+/// and all the targets must agree on the layout of the structures that hold these types.
+template <typename Scalar, size_t N>
+struct SimdTypes {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "The packet size must be a power of two");
+    using Integer = typename SizedIntegerType<sizeof(Scalar) * CHAR_BIT>::Signed;
+    typedef Scalar  Vector __attribute__((vector_size(sizeof(Scalar) * N), aligned(sizeof(Scalar) * N)));
+    typedef Integer Mask   __attribute__((vector_size(sizeof(Scalar) * N), aligned(sizeof(Scalar) * N)));
+};
+
+template <typename Mask>
+bvh_always_inline
+inline bool any(const Mask& mask) {
+    constexpr size_t n = sizeof(Mask) / sizeof(mask[0]);
+    auto bits = mask[0];
+    for (size_t i = 1; i < n; ++i)
+        bits |= mask[i];
+    return bits != 0;
+}
+
+template <typename Mask>
+bvh_always_inline
+inline bool none(const Mask& mask) {
+    return !any(mask);
+}
+
+/// Smallest lane of a vector.
+template <typename Vector>
+bvh_always_inline
+inline auto reduce_min(const Vector& x) {
+    constexpr size_t n = sizeof(Vector) / sizeof(x[0]);
+    auto result = x[0];
+    for (size_t i = 1; i < n; ++i)
+        result = x[i] < result ? x[i] : result;
+    return result;
+}
+
+/// Largest lane of a vector.
+template <typename Vector>
+bvh_always_inline
+inline auto reduce_max(const Vector& x) {
+    constexpr size_t n = sizeof(Vector) / sizeof(x[0]);
+    auto result = x[0];
+    for (size_t i = 1; i < n; ++i)
+        result = x[i] > result ? x[i] : result;
+    return result;
+}
+
+/// Lane-wise minimum. Like `robust_min()`, never returns a NaN if the right hand side is not a NaN.
+template <typename Vector>
+bvh_always_inline
+inline Vector simd_min(const Vector& x, const Vector& y) {
+    return x < y ? x : y;
+}
+
+/// Lane-wise maximum. Like `robust_max()`, never returns a NaN if the right hand side is not a NaN.
+template <typename Vector>
+bvh_always_inline
+inline Vector simd_max(const Vector& x, const Vector& y) {
+    return x > y ? x : y;
+}
+
+/// A packet of N rays, stored as a structure of arrays.
+template <typename Scalar, size_t N>
+struct RayPacket {
+    using Vector = typename SimdTypes<Scalar, N>::Vector;
+    using Mask   = typename SimdTypes<Scalar, N>::Mask;
+
+    static constexpr size_t size = N;
+
+    Vector origin[3];
+    Vector direction[3];
+    Vector tmin;
+    Vector tmax;
+
+    void set(size_t i, const Ray<Scalar>& ray) {
+        for (int axis = 0; axis < 3; ++axis) {
+            origin[axis][i]    = ray.origin[axis];
+            direction[axis][i] = ray.direction[axis];
+        }
+        tmin[i] = ray.tmin;
+        tmax[i] = ray.tmax;
+    }
+
+    Ray<Scalar> ray(size_t i) const {
+        return Ray<Scalar>(
+            Vector3<Scalar>(origin[0][i], origin[1][i], origin[2][i]),
+            Vector3<Scalar>(direction[0][i], direction[1][i], direction[2][i]),
+            tmin[i], tmax[i]);
+    }
+};
+
+} // namespace bvh
+
+#endif
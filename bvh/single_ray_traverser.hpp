@@ -51,6 +51,14 @@ private:
         size_t begin = node.first_child_or_primitive;
         size_t end   = begin + node.primitive_count;
         statistics.intersections += end - begin;
+        if constexpr (requires { primitive_intersector.intersect_leaf(begin, end, ray); }) {
+            // The intersector tests the whole leaf at once
+            if (auto hit = primitive_intersector.intersect_leaf(begin, end, ray)) {
+                best_hit = hit;
+                ray.tmax = hit->distance();
+            }
+            return best_hit;
+        }
         for (size_t i = begin; i < end; ++i) {
             if (auto hit = primitive_intersector.intersect(i, ray)) {
                 best_hit = hit;
@@ -108,7 +116,8 @@ private:
 
             if (left_child) {
                 if (right_child) {
-                    if (distance_left.first > distance_right.first)
+                    // Any hit ends the traversal, so there is no point in visiting the closest child first
+                    if (!PrimitiveIntersector::any_hit && distance_left.first > distance_right.first)
                         std::swap(left_child, right_child);
                     stack.push(right_child->first_child_or_primitive);
                 }
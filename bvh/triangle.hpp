@@ -8,6 +8,7 @@
 #include "vector.hpp"
 #include "bounding_box.hpp"
 #include "ray.hpp"
+#include "ray_packet.hpp"
 
 namespace bvh {
 
@@ -113,6 +114,47 @@ struct Triangle {
 
         return std::nullopt;
     }
+
+    template <size_t N>
+    struct PacketIntersection {
+        typename SimdTypes<Scalar, N>::Vector t, u, v;
+    };
+
+    /// Intersects the active rays of a packet with the triangle, using the same test as `intersect()`.
+    /// Only the lanes of the rays that hit are written to the intersection, and the mask of those rays is returned.
+    template <size_t N>
+    bvh_always_inline
+    typename SimdTypes<Scalar, N>::Mask intersect(
+        const RayPacket<Scalar, N>& packet,
+        typename SimdTypes<Scalar, N>::Mask active,
+        PacketIntersection<N>& intersection) const
+    {
+        using Vector = typename SimdTypes<Scalar, N>::Vector;
+        auto negate_when_right_handed = [] (Scalar x) { return LeftHandedNormal ? x : -x; };
+
+        const Vector* d = packet.direction;
+        Vector c[3] = { p0[0] - packet.origin[0], p0[1] - packet.origin[1], p0[2] - packet.origin[2] };
+        Vector r[3] = {
+            d[1] * c[2] - d[2] * c[1],
+            d[2] * c[0] - d[0] * c[2],
+            d[0] * c[1] - d[1] * c[0]
+        };
+        Vector inv_det = negate_when_right_handed(1.0) / (n[0] * d[0] + n[1] * d[1] + n[2] * d[2]);
+
+        Vector u = (r[0] * e2[0] + r[1] * e2[1] + r[2] * e2[2]) * inv_det;
+        Vector v = (r[0] * e1[0] + r[1] * e1[1] + r[2] * e1[2]) * inv_det;
+        Vector w = Scalar(1.0) - u - v;
+        Vector t = negate_when_right_handed(Scalar(1.0)) * (n[0] * c[0] + n[1] * c[1] + n[2] * c[2]) * inv_det;
+
+        // As in the single-ray test, NaNs make these comparisons fail
+        auto hit = active &
+            (u >= Scalar(0)) & (v >= Scalar(0)) & (w >= Scalar(0)) &
+            (t >= packet.tmin) & (t <= packet.tmax);
+        intersection.t = hit ? t : intersection.t;
+        intersection.u = hit ? u : intersection.u;
+        intersection.v = hit ? v : intersection.v;
+        return hit;
+    }
 };
 
 } // namespace bvh
@@ -0,0 +1,79 @@
+#ifndef BVH_WIDE_BVH_HPP
+#define BVH_WIDE_BVH_HPP
+
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <limits>
+
+#include "bounding_box.hpp"
+#include "utilities.hpp"
+#include "platform.hpp"
+
+namespace bvh {
+
+/// A BVH in which every node has up to `Width` children (typically 4 or 8), obtained by
+/// collapsing a binary `Bvh` with `WideBvhConverter`. The bounding boxes of the children
+/// are stored in the parent as a structure of arrays, so that a ray can be tested against
+/// all of them at once with SIMD instructions. Leaves are not stored as nodes: a child slot
+/// refers directly to a range of primitives. The root of the hierarchy is node 0.
+template <typename Scalar, size_t Width>
+struct WideBvh {
+    using IndexType  = typename SizedIntegerType<sizeof(Scalar) * CHAR_BIT>::Unsigned;
+    using ScalarType = Scalar;
+
+    static constexpr size_t width = Width;
+
+    // The size of this structure is 128 bytes for a 4-wide BVH
+    // and 256 bytes for an 8-wide BVH, in single precision.
+    struct alignas(sizeof(Scalar) * Width) Node {
+        /// Bounds of the children, as rows of min x, max x, min y, max y, min z, max z.
+        Scalar bounds[6][Width];
+        /// Index of the first primitive for leaves, or of the child node otherwise.
+        IndexType first_child_or_primitive[Width];
+        /// Number of primitives for leaves, or zero for inner nodes and empty slots.
+        IndexType primitive_count[Width];
+
+        bool is_leaf (size_t i) const { return primitive_count[i] != 0; }
+        /// The root is never the child of a node, so that index marks empty slots.
+        bool is_empty(size_t i) const { return primitive_count[i] == 0 && first_child_or_primitive[i] == 0; }
+
+        /// Computes the distances along a ray to one row of `bounds`, as a SIMD vector of `Width`
+        /// scalars, given the inverse direction of the ray and its origin scaled by that inverse.
+        template <typename Vector>
+        bvh_always_inline
+        Vector plane_distances(size_t row, Scalar inverse_direction, Scalar scaled_origin) const {
+            static_assert(sizeof(Vector) == sizeof(bounds[0]));
+            Vector vector;
+            std::memcpy(&vector, bounds[row], sizeof(Vector));
+            return vector * inverse_direction + scaled_origin;
+        }
+
+        BoundingBox<Scalar> bounding_box(size_t i) const {
+            return BoundingBox<Scalar>(
+                Vector3<Scalar>(bounds[0][i], bounds[2][i], bounds[4][i]),
+                Vector3<Scalar>(bounds[1][i], bounds[3][i], bounds[5][i]));
+        }
+
+        /// Empty slots also have an inverted box, so that rays miss them.
+        void set_empty(size_t i) {
+            for (int axis = 0; axis < 3; ++axis) {
+                bounds[axis * 2 + 0][i] = +std::numeric_limits<Scalar>::infinity();
+                bounds[axis * 2 + 1][i] = -std::numeric_limits<Scalar>::infinity();
+            }
+            first_child_or_primitive[i] = 0;
+            primitive_count[i] = 0;
+        }
+    };
+
+    std::unique_ptr<Node[]>   nodes;
+    std::unique_ptr<size_t[]> primitive_indices;
+
+    size_t node_count = 0;
+    /// Number of nodes on the longest path from the root to a leaf (leaves excluded).
+    size_t depth = 0;
+};
+
+} // namespace bvh
+
+#endif
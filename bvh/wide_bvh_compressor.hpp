@@ -0,0 +1,108 @@
+#ifndef BVH_WIDE_BVH_COMPRESSOR_HPP
+#define BVH_WIDE_BVH_COMPRESSOR_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+#include "wide_bvh.hpp"
+#include "compressed_wide_bvh.hpp"
+#include "bounding_box.hpp"
+
+namespace bvh {
+
+/// Quantizes the bounding boxes of a wide BVH. The topology and the primitive
+/// indices are copied as is. Every decoded box contains its original box.
+template <typename Scalar, size_t Width>
+class WideBvhCompressor {
+    using Wide       = WideBvh<Scalar, Width>;
+    using Compressed = CompressedWideBvh<Scalar, Width>;
+
+    const Wide& wide_bvh;
+    Compressed& compressed_bvh;
+
+    /// Chooses the smallest power of two such that `origin + 255 * scale` covers `max`.
+    static int choose_exponent(Scalar origin, Scalar max) {
+        auto extent = max - origin;
+        int exponent = Compressed::min_exponent;
+        if (extent > 0) {
+            std::frexp(extent / Scalar(255), &exponent);
+            exponent = std::clamp(exponent - 1, Compressed::min_exponent, Compressed::max_exponent);
+        }
+        while (exponent < Compressed::max_exponent &&
+               origin + Scalar(255) * Compressed::exponent_to_scale(exponent) < max)
+            exponent++;
+        return exponent;
+    }
+
+    void compress(const typename Wide::Node& node, typename Compressed::Node& compressed_node) {
+        auto bbox = BoundingBox<Scalar>::empty();
+        for (size_t i = 0; i < Width; ++i) {
+            if (!node.is_empty(i))
+                bbox.extend(node.bounding_box(i));
+        }
+
+        for (int axis = 0; axis < 3; ++axis) {
+            compressed_node.origin[axis] = bbox.min[axis];
+            compressed_node.exponent[axis] = choose_exponent(bbox.min[axis], bbox.max[axis]);
+        }
+
+        for (size_t i = 0; i < Width; ++i) {
+            compressed_node.first_child_or_primitive[i] = node.first_child_or_primitive[i];
+            compressed_node.primitive_count[i] = node.primitive_count[i];
+
+            for (int axis = 0; axis < 3; ++axis) {
+                auto& min = compressed_node.quantized_bounds[axis * 2 + 0][i];
+                auto& max = compressed_node.quantized_bounds[axis * 2 + 1][i];
+                if (node.is_empty(i)) {
+                    // Inverted box, so that rays miss the slot
+                    min = 255;
+                    max = 0;
+                    continue;
+                }
+
+                // Round outwards, then fix the rounding errors of the decoding
+                auto origin = compressed_node.origin[axis];
+                auto scale  = compressed_node.scale(axis);
+                auto lo = std::clamp<Scalar>(std::floor((node.bounds[axis * 2 + 0][i] - origin) / scale), 0, 255);
+                auto hi = std::clamp<Scalar>(std::ceil ((node.bounds[axis * 2 + 1][i] - origin) / scale), 0, 255);
+                min = static_cast<uint8_t>(lo);
+                max = static_cast<uint8_t>(hi);
+                while (min > 0 && compressed_node.bound(axis * 2 + 0, i) > node.bounds[axis * 2 + 0][i])
+                    min--;
+                while (max < 255 && compressed_node.bound(axis * 2 + 1, i) < node.bounds[axis * 2 + 1][i])
+                    max++;
+            }
+        }
+    }
+
+public:
+    WideBvhCompressor(const Wide& wide_bvh, Compressed& compressed_bvh)
+        : wide_bvh(wide_bvh), compressed_bvh(compressed_bvh)
+    {}
+
+    void compress() {
+        compressed_bvh.nodes = std::make_unique<typename Compressed::Node[]>(wide_bvh.node_count);
+        compressed_bvh.node_count = wide_bvh.node_count;
+        compressed_bvh.depth      = wide_bvh.depth;
+
+        size_t primitive_count = 0;
+        for (size_t i = 0; i < wide_bvh.node_count; ++i) {
+            const auto& node = wide_bvh.nodes[i];
+            for (size_t j = 0; j < Width; ++j) {
+                if (node.is_leaf(j))
+                    primitive_count = std::max<size_t>(primitive_count, node.first_child_or_primitive[j] + node.primitive_count[j]);
+            }
+        }
+        compressed_bvh.primitive_indices = std::make_unique<size_t[]>(primitive_count);
+        std::copy(wide_bvh.primitive_indices.get(), wide_bvh.primitive_indices.get() + primitive_count, compressed_bvh.primitive_indices.get());
+
+        #pragma omp parallel for
+        for (size_t i = 0; i < wide_bvh.node_count; ++i)
+            compress(wide_bvh.nodes[i], compressed_bvh.nodes[i]);
+    }
+};
+
+} // namespace bvh
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef BVH_WIDE_BVH_CONVERTER_HPP
+#define BVH_WIDE_BVH_CONVERTER_HPP
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <tuple>
+#include <limits>
+
+#include "bvh.hpp"
+#include "wide_bvh.hpp"
+
+namespace bvh {
+
+/// Collapses a binary BVH into a wide BVH. The binary BVH can come from any builder.
+/// Starting from the two children of a binary node, the inner child with the largest
+/// surface area is repeatedly replaced by its own children, until the node is full or
+/// only has leaves. The leaves of the binary BVH are kept as is, and the primitive
+/// indices are the same in both hierarchies.
+template <typename Bvh, size_t Width>
+class WideBvhConverter {
+    static_assert(Width >= 2, "A wide BVH must have at least two children per node");
+
+    using Scalar = typename Bvh::ScalarType;
+    using Wide   = WideBvh<Scalar, Width>;
+
+    const Bvh& bvh;
+    Wide& wide_bvh;
+
+public:
+    WideBvhConverter(const Bvh& bvh, Wide& wide_bvh)
+        : bvh(bvh), wide_bvh(wide_bvh)
+    {}
+
+    void convert() {
+        // Every wide node replaces at least one inner node of the binary BVH
+        wide_bvh.nodes = std::make_unique<typename Wide::Node[]>(std::max<size_t>(bvh.node_count / 2, 1));
+        wide_bvh.node_count = 1;
+        wide_bvh.depth = 0;
+
+        size_t primitive_count = 0;
+        for (size_t i = 0; i < bvh.node_count; ++i) {
+            const auto& node = bvh.nodes[i];
+            if (node.is_leaf())
+                primitive_count = std::max<size_t>(primitive_count, node.first_child_or_primitive + node.primitive_count);
+        }
+        wide_bvh.primitive_indices = std::make_unique<size_t[]>(primitive_count);
+        std::copy(bvh.primitive_indices.get(), bvh.primitive_indices.get() + primitive_count, wide_bvh.primitive_indices.get());
+
+        // Binary node, wide node and depth of the wide nodes that remain to be filled
+        std::vector<std::tuple<size_t, size_t, size_t>> stack;
+        stack.emplace_back(0, 0, 1);
+        while (!stack.empty()) {
+            auto [binary_index, wide_index, depth] = stack.back();
+            stack.pop_back();
+            wide_bvh.depth = std::max(wide_bvh.depth, depth);
+
+            size_t children[Width];
+            size_t child_count = 0;
+            if (bvh.nodes[binary_index].is_leaf())
+                children[child_count++] = binary_index;
+            else {
+                auto first_child = bvh.nodes[binary_index].first_child_or_primitive;
+                children[child_count++] = first_child + 0;
+                children[child_count++] = first_child + 1;
+            }
+
+            while (child_count < Width) {
+                size_t largest = child_count;
+                Scalar largest_area = -std::numeric_limits<Scalar>::infinity();
+                for (size_t i = 0; i < child_count; ++i) {
+                    const auto& child = bvh.nodes[children[i]];
+                    if (child.is_leaf())
+                        continue;
+                    auto area = child.bounding_box_proxy().half_area();
+                    if (area > largest_area) {
+                        largest = i;
+                        largest_area = area;
+                    }
+                }
+                if (largest == child_count)
+                    break;
+                auto first_child = bvh.nodes[children[largest]].first_child_or_primitive;
+                children[largest] = first_child;
+                children[child_count++] = first_child + 1;
+            }
+
+            auto& wide_node = wide_bvh.nodes[wide_index];
+            for (size_t i = 0; i < Width; ++i) {
+                if (i >= child_count) {
+                    wide_node.set_empty(i);
+                    continue;
+                }
+                const auto& child = bvh.nodes[children[i]];
+                for (int j = 0; j < 6; ++j)
+                    wide_node.bounds[j][i] = child.bounds[j];
+                wide_node.primitive_count[i] = child.primitive_count;
+                if (child.is_leaf())
+                    wide_node.first_child_or_primitive[i] = child.first_child_or_primitive;
+                else {
+                    wide_node.first_child_or_primitive[i] = wide_bvh.node_count;
+                    stack.emplace_back(children[i], wide_bvh.node_count++, depth + 1);
+                }
+            }
+        }
+    }
+};
+
+} // namespace bvh
+
+#endif
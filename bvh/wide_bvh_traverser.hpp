@@ -0,0 +1,220 @@
+#ifndef BVH_WIDE_BVH_TRAVERSER_HPP
+#define BVH_WIDE_BVH_TRAVERSER_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <memory>
+#include <optional>
+
+#include "wide_bvh.hpp"
+#include "ray.hpp"
+#include "ray_packet.hpp"
+#include "utilities.hpp"
+#include "platform.hpp"
+
+namespace bvh {
+
+/// Single ray traversal algorithm for wide BVHs (`WideBvh` or `CompressedWideBvh`). The ray is
+/// tested against all the children of a node at once with one SIMD slab test, in the same way
+/// as `FastNodeIntersector`.
+/// Leaves are intersected as soon as they are found, from the closest to the farthest,
+/// and the inner nodes that are hit are pushed on the stack so that the closest one is
+/// processed first. The instruction set used for the node test is the one of the
+/// function into which this traverser is inlined: 4-wide BVHs only need SSE, but
+/// 8-wide BVHs should be traversed from a function compiled for AVX.
+/// Each inner node pushes at most `Width - 1` more nodes than it pops, so the stack
+/// needs `depth * (Width - 1) + 1` entries. BVHs that are too deep for `StackSize`
+/// are traversed with a stack allocated on the heap instead.
+template <typename WideBvh, size_t StackSize = 64>
+class WideBvhTraverser {
+public:
+    static constexpr size_t stack_size = StackSize;
+    static constexpr size_t width      = WideBvh::width;
+
+private:
+    using Scalar = typename WideBvh::ScalarType;
+    using Vector = typename SimdTypes<Scalar, width>::Vector;
+    using Mask   = typename SimdTypes<Scalar, width>::Mask;
+
+    /// Nodes are stored with their entry distance, so that they can be
+    /// skipped if a closer intersection is found after they are pushed.
+    struct StackElement {
+        typename WideBvh::IndexType index;
+        Scalar distance;
+    };
+
+    struct Stack {
+        StackElement* elements;
+        size_t size = 0;
+
+        void push(const StackElement& t) { elements[size++] = t; }
+
+        StackElement pop() {
+            assert(!empty());
+            return elements[--size];
+        }
+
+        bool empty() const { return size == 0; }
+    };
+
+    struct NodeIntersector {
+        int octant[3];
+        Scalar inverse_direction[3];
+        Scalar scaled_origin[3];
+
+        NodeIntersector(const Ray<Scalar>& ray) {
+            auto inverse = ray.direction.safe_inverse();
+            for (int axis = 0; axis < 3; ++axis) {
+                octant[axis]            = std::signbit(ray.direction[axis]);
+                inverse_direction[axis] = inverse[axis];
+                scaled_origin[axis]     = -ray.origin[axis] * inverse[axis];
+            }
+        }
+
+        /// Returns the mask of the children that are hit, and their entry distances.
+        bvh_always_inline
+        Mask intersect(const typename WideBvh::Node& node, const Ray<Scalar>& ray, Vector& entry) const {
+            Vector exit;
+            entry = Vector {} + ray.tmin;
+            exit  = Vector {} + ray.tmax;
+            // Note: This order for the min/max operations is guaranteed not to produce NaNs
+            for (int axis = 0; axis < 3; ++axis) {
+                entry = simd_max(node.template plane_distances<Vector>(axis * 2 +     octant[axis], inverse_direction[axis], scaled_origin[axis]), entry);
+                exit  = simd_min(node.template plane_distances<Vector>(axis * 2 + 1 - octant[axis], inverse_direction[axis], scaled_origin[axis]), exit);
+            }
+            return entry <= exit;
+        }
+    };
+
+    template <typename PrimitiveIntersector, typename Statistics>
+    bvh_always_inline
+    bool intersect_leaf(
+        const typename WideBvh::Node& node, size_t slot,
+        Ray<Scalar>& ray,
+        std::optional<typename PrimitiveIntersector::Result>& best_hit,
+        PrimitiveIntersector& primitive_intersector,
+        Statistics& statistics) const
+    {
+        assert(node.is_leaf(slot));
+        size_t begin = node.first_child_or_primitive[slot];
+        size_t end   = begin + node.primitive_count[slot];
+        statistics.intersections += end - begin;
+        if constexpr (requires { primitive_intersector.intersect_leaf(begin, end, ray); }) {
+            // The intersector tests the whole leaf at once
+            if (auto hit = primitive_intersector.intersect_leaf(begin, end, ray)) {
+                best_hit = hit;
+                ray.tmax = hit->distance();
+                return true;
+            }
+            return false;
+        }
+        bool found = false;
+        for (size_t i = begin; i < end; ++i) {
+            if (auto hit = primitive_intersector.intersect(i, ray)) {
+                best_hit = hit;
+                found = true;
+                if (primitive_intersector.any_hit)
+                    return true;
+                ray.tmax = hit->distance();
+            }
+        }
+        return found;
+    }
+
+    template <typename PrimitiveIntersector, typename Statistics>
+    bvh_always_inline
+    std::optional<typename PrimitiveIntersector::Result>
+    intersect(Ray<Scalar> ray, PrimitiveIntersector& primitive_intersector, Statistics& statistics) const {
+        auto best_hit = std::optional<typename PrimitiveIntersector::Result>(std::nullopt);
+
+        NodeIntersector node_intersector(ray);
+
+        StackElement fixed_elements[stack_size];
+        std::unique_ptr<StackElement[]> heap_elements;
+        if (bvh_unlikely(required_stack_size > stack_size))
+            heap_elements = std::make_unique<StackElement[]>(required_stack_size);
+        Stack stack { heap_elements ? heap_elements.get() : fixed_elements };
+        stack.push({ 0, ray.tmin });
+        while (!stack.empty()) {
+            auto [index, distance] = stack.pop();
+            if (distance > ray.tmax)
+                continue;
+            statistics.traversal_steps++;
+
+            const auto& node = bvh.nodes[index];
+            Vector entry;
+            auto hit = node_intersector.intersect(node, ray, entry);
+
+            // Sort the children that are hit by increasing entry distance (unless any hit will do)
+            size_t order[width];
+            size_t hit_count = 0;
+            for (size_t i = 0; i < width; ++i) {
+                if (!hit[i])
+                    continue;
+                size_t j = hit_count++;
+                for (; !PrimitiveIntersector::any_hit && j > 0 && entry[order[j - 1]] > entry[i]; --j)
+                    order[j] = order[j - 1];
+                order[j] = i;
+            }
+
+            for (size_t j = 0; j < hit_count; ++j) {
+                auto i = order[j];
+                if (node.is_leaf(i) && entry[i] <= ray.tmax &&
+                    intersect_leaf(node, i, ray, best_hit, primitive_intersector, statistics) &&
+                    primitive_intersector.any_hit)
+                    return best_hit;
+            }
+
+            for (size_t j = hit_count; j-- > 0;) {
+                auto i = order[j];
+                if (!node.is_leaf(i) && !node.is_empty(i) && entry[i] <= ray.tmax)
+                    stack.push({ node.first_child_or_primitive[i], entry[i] });
+            }
+        }
+
+        return best_hit;
+    }
+
+    const WideBvh& bvh;
+    size_t required_stack_size;
+
+public:
+    /// Statistics collected during traversal.
+    struct Statistics {
+        size_t traversal_steps = 0;
+        size_t intersections   = 0;
+    };
+
+    WideBvhTraverser(const WideBvh& bvh)
+        : bvh(bvh), required_stack_size(std::max<size_t>(bvh.depth, 1) * (width - 1) + 1)
+    {}
+
+    /// Intersects the BVH with the given ray and intersector.
+    template <typename PrimitiveIntersector>
+    bvh_always_inline
+    std::optional<typename PrimitiveIntersector::Result>
+    traverse(const Ray<Scalar>& ray, PrimitiveIntersector& intersector) const {
+        struct {
+            struct Empty {
+                Empty& operator ++ (int)    { return *this; }
+                Empty& operator ++ ()       { return *this; }
+                Empty& operator += (size_t) { return *this; }
+            } traversal_steps, intersections;
+        } statistics;
+        return intersect(ray, intersector, statistics);
+    }
+
+    /// Intersects the BVH with the given ray and intersector.
+    /// Record statistics on the number of traversal and intersection steps.
+    template <typename PrimitiveIntersector>
+    bvh_always_inline
+    std::optional<typename PrimitiveIntersector::Result>
+    traverse(const Ray<Scalar>& ray, PrimitiveIntersector& primitive_intersector, Statistics& statistics) const {
+        return intersect(ray, primitive_intersector, statistics);
+    }
+};
+
+} // namespace bvh
+
+#endif
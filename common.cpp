@@ -68,6 +68,101 @@ Point::operator BvhVector3() const
     return {x, y, z};
 }
 
+Transform Transform::identity()
+{
+    return {{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}};
+}
+
+Transform Transform::translation(const Point &offset)
+{
+    return {{{1, 0, 0, offset.x}, {0, 1, 0, offset.y}, {0, 0, 1, offset.z}}};
+}
+
+Transform Transform::rotation(float x, float y, float z)
+{
+    const Transform rx{{{1, 0, 0, 0}, {0, std::cos(x), -std::sin(x), 0}, {0, std::sin(x), std::cos(x), 0}}};
+    const Transform ry{{{std::cos(y), 0, std::sin(y), 0}, {0, 1, 0, 0}, {-std::sin(y), 0, std::cos(y), 0}}};
+    const Transform rz{{{std::cos(z), -std::sin(z), 0, 0}, {std::sin(z), std::cos(z), 0, 0}, {0, 0, 1, 0}}};
+    return rz * ry * rx;
+}
+
+Transform Transform::scale(const Point &factors)
+{
+    return {{{factors.x, 0, 0, 0}, {0, factors.y, 0, 0}, {0, 0, factors.z, 0}}};
+}
+
+Transform Transform::operator*(const Transform &other) const
+{
+    Transform res;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            res.m[i][j] = m[i][0] * other.m[0][j] + m[i][1] * other.m[1][j] + m[i][2] * other.m[2][j];
+        }
+        res.m[i][3] += m[i][3];
+    }
+    return res;
+}
+
+Transform Transform::inverse() const
+{
+    // Invert the linear part with the adjugate, then the translation
+    const float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    const float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    const float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    const float invDet = 1 / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+
+    Transform res;
+    res.m[0][0] = c00 * invDet;
+    res.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+    res.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+    res.m[1][0] = c01 * invDet;
+    res.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+    res.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+    res.m[2][0] = c02 * invDet;
+    res.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+    res.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+
+    const Point t = res.applyToVector({m[0][3], m[1][3], m[2][3]});
+    res.m[0][3] = -t.x;
+    res.m[1][3] = -t.y;
+    res.m[2][3] = -t.z;
+    return res;
+}
+
+Transform Transform::normalTransform() const
+{
+    const Transform inv = inverse();
+    Transform res;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+            res.m[i][j] = inv.m[j][i];
+        res.m[i][3] = 0;
+    }
+    return res;
+}
+
+Point Transform::applyToPoint(const Point &p) const
+{
+    return applyToVector(p) + Point{m[0][3], m[1][3], m[2][3]};
+}
+
+Point Transform::applyToVector(const Point &v) const
+{
+    return {m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+            m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+            m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z};
+}
+
+Point Transform::applyTransposedToVector(const Point &v) const
+{
+    return {m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+            m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+            m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z};
+}
+
 Color::Color(int _r, int _g, int _b) : r(_r), g(_g), b(_b) {}
 Color::Color() : r(0), g(0), b(0) {}
 
@@ -88,6 +183,7 @@ Color operator*(const int s, const Color &lhs)
     return lhs * s;
 }
 
+Ray::Ray() : origin(0, 0, 0), unitDir(0, 0, 1) {}
 Ray::Ray(const Point &_orig, const Point &_dir) : origin(_orig), unitDir(_dir / std::sqrt(_dir * _dir)) {}
 
 Ray::operator BvhRay() const
@@ -4,8 +4,7 @@
 #include <memory>
 #include <optional>
 #include <iostream>
-
-#include "readPng.cpp"
+#include <cstdint>
 
 #include "bvh/triangle.hpp"
 #include "bvh/ray.hpp"
@@ -21,8 +20,6 @@ using BvhRay = bvh::Ray<BvhScalar>;
 using BvhTriangle = bvh::Triangle<BvhScalar>;
 using Bvh = bvh::Bvh<BvhScalar>;
 
-class Triangle;
-
 struct Point
 {
     Point();
@@ -48,6 +45,30 @@ struct Point
     float z;
 };
 
+// Affine transformation, stored as the upper 3x4 part of a row-major 4x4 matrix.
+struct Transform
+{
+    static Transform identity();
+    static Transform translation(const Point &offset);
+    // Same convention as Point::rotateByX(x).rotateByY(y).rotateByZ(z).
+    static Transform rotation(float x, float y, float z);
+    static Transform scale(const Point &factors);
+
+    Transform operator*(const Transform &other) const;
+    Transform inverse() const;
+    // Inverse transpose of the linear part, without translation: maps normals
+    // to the transformed space with applyToVector.
+    Transform normalTransform() const;
+
+    Point applyToPoint(const Point &p) const;
+    Point applyToVector(const Point &v) const;
+    // Multiplies by the transposed linear part. Called on the inverse
+    // transformation, this maps normals to the transformed space.
+    Point applyTransposedToVector(const Point &v) const;
+
+    float m[3][4];
+};
+
 struct Color
 {
 
@@ -66,10 +87,9 @@ Color operator*(const int s, const Color &lhs);
 
 struct Ray
 {
+    Ray();
     Ray(const Point &origin, const Point &direction);
 
-    Color findColor(const std::vector<Triangle> &triangles, size_t depth = 0, bool hitProvided = false, std::optional<bvh::ClosestPrimitiveIntersector<Bvh, BvhTriangle>::Result> &&hit = std::nullopt);
-
     Point origin;
     Point unitDir;
 
@@ -127,47 +147,6 @@ struct TriangleVertex
     VertexTexture vt;
 };
 
-class Triangle;
-
-using ColorFunction = std::function<Color(const Triangle &, const TriangleVertex::VertexTexture &vt, png_bytep *, std::function<Color(Ray, int)> rec, const Ray &ray, float t, float u, float v, int depth)>;
-
-class Triangle
-{
-public:
-    Triangle(TriangleVertex _v1,
-             TriangleVertex _v2,
-             TriangleVertex _v3, ColorFunction _colorFunction) : v1(_v1), v2(_v2), v3(_v3), colorFunction(_colorFunction)
-    {
-    }
-
-    Triangle operator+(const Point &other) const
-    {
-        return {v1 + other, v2 + other, v3 + other, colorFunction};
-    }
-
-    Triangle rotate(float a, float b, float c) const
-    {
-        return {{v1.v.rotateByX(a).rotateByY(b).rotateByZ(c), v1.vt, v1.normal.rotateByX(a).rotateByY(b).rotateByZ(c)}, {v2.v.rotateByX(a).rotateByY(b).rotateByZ(c), v2.vt, v2.normal.rotateByX(a).rotateByY(b).rotateByZ(c)}, {v3.v.rotateByX(a).rotateByY(b).rotateByZ(c), v3.vt, v3.normal.rotateByX(a).rotateByY(b).rotateByZ(c)}, colorFunction};
-    }
-
-    Color intersect(const Ray &ray, const std::vector<Triangle> &triangles, size_t depth, float t, float u, float v, std::function<Color(Ray, int)> rec) const
-    {
-        auto hitPoint = (v2 * u + v3 * v + v1 * (1 - u - v));
-        return colorFunction(*this, hitPoint.vt, row_pointers, rec, ray, t, u, v, depth);
-    }
-
-    TriangleVertex v1;
-    TriangleVertex v2;
-    TriangleVertex v3;
-
-private:
-    Color getColor(const TriangleVertex::VertexTexture &vt) const
-    {
-        uint row = read_height - 1 - read_height * std::clamp(vt.v, 0.0f, 0.99f);
-        uint col = read_width * std::clamp(vt.u, 0.0f, 0.99f);
-        png_bytep rowVals = row_pointers[row];
-        return Color{rowVals[col * 4 + 0], rowVals[col * 4 + 1], rowVals[col * 4 + 2]};
-    }
+// Index into the material table of the scene.
+using MaterialId = uint32_t;
 
-    ColorFunction colorFunction;
-};
\ No newline at end of file
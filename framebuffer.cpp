@@ -0,0 +1,331 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "common.hpp"
+#include "bvh/ray_packet.hpp"
+
+// Linear RGB color or radiance.
+struct Rgb
+{
+    float r = 0;
+    float g = 0;
+    float b = 0;
+
+    Rgb operator*(float s) const
+    {
+        return {r * s, g * s, b * s};
+    }
+
+    Rgb operator*(const Rgb &other) const
+    {
+        return {r * other.r, g * other.g, b * other.b};
+    }
+};
+
+// Conversions between 8-bit sRGB, which materials and textures produce, and linear RGB,
+// in which samples are averaged.
+struct Srgb
+{
+    // Entries of the encoding table, evenly spaced in linear space. The table is fine
+    // enough that every 8-bit value decodes and encodes back to itself.
+    static constexpr size_t encodeSize = 16384;
+
+    static float toLinear(int value)
+    {
+        return decodeTable()[std::clamp(value, 0, 255)];
+    }
+
+    static Rgb toLinear(const Color &color)
+    {
+        return {toLinear(color.r), toLinear(color.g), toLinear(color.b)};
+    }
+
+    // Value in [0, 1] to 8 bits, through the table.
+    static uint8_t fromLinear(float value)
+    {
+        return encodeTable()[static_cast<size_t>(std::clamp(value, 0.0f, 1.0f) * (encodeSize - 1) + 0.5f)];
+    }
+
+    static const std::array<float, 256> &decodeTable()
+    {
+        static const auto table = []
+        {
+            std::array<float, 256> table;
+            for (int i = 0; i < 256; i++)
+            {
+                const float c = i / 255.0f;
+                table[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+            }
+            return table;
+        }();
+        return table;
+    }
+
+    static const std::vector<uint8_t> &encodeTable()
+    {
+        static const auto table = []
+        {
+            std::vector<uint8_t> table(encodeSize);
+            for (size_t i = 0; i < encodeSize; i++)
+            {
+                const float c = static_cast<float>(i) / (encodeSize - 1);
+                const float s = c <= 0.0031308f ? 12.92f * c : 1.055f * std::pow(c, 1 / 2.4f) - 0.055f;
+                table[i] = static_cast<uint8_t>(std::clamp(s * 255 + 0.5f, 0.0f, 255.0f));
+            }
+            return table;
+        }();
+        return table;
+    }
+};
+
+// Linear radiance of one path through a pixel. The weight is 1 for a path with at least
+// one valid ray, and 0 for a path whose rays were all dropped.
+struct Sample
+{
+    float r = 0;
+    float g = 0;
+    float b = 0;
+    float weight = 0;
+
+    float luminance() const
+    {
+        return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+    }
+};
+
+// How linear radiance is mapped to [0, 1] before the sRGB encoding.
+struct ToneMapping
+{
+    enum class Operator
+    {
+        // Clips values above 1.
+        Clamp,
+        // c / (1 + c): compresses highlights instead of clipping them.
+        Reinhard
+    };
+
+    float exposure = 1;
+    Operator op = Operator::Clamp;
+};
+
+// Accumulates samples in linear float RGB, with one array per channel. Every pixel
+// keeps the sum of the weights of its samples, which tells valid pixels apart and
+// normalizes the average, the number of samples it received, valid or not, and the sum
+// of their squared luminances, from which the noise of the pixel is estimated. Samples
+// of several passes or frames add up until the buffer is cleared. The 8-bit image is
+// produced by one pass over the whole buffer (see resolve()).
+class Framebuffer
+{
+public:
+    static constexpr size_t padding = 16;
+
+    Framebuffer() = default;
+
+    Framebuffer(int _width, int _height)
+        : width(_width), height(_height),
+          r(paddedSize()), g(paddedSize()), b(paddedSize()), weight(paddedSize()), squares(paddedSize()), samples(paddedSize()) {}
+
+    int getWidth() const
+    {
+        return width;
+    }
+
+    int getHeight() const
+    {
+        return height;
+    }
+
+    size_t size() const
+    {
+        return static_cast<size_t>(width) * height;
+    }
+
+    void clear()
+    {
+        std::fill(r.begin(), r.end(), 0.0f);
+        std::fill(g.begin(), g.end(), 0.0f);
+        std::fill(b.begin(), b.end(), 0.0f);
+        std::fill(weight.begin(), weight.end(), 0.0f);
+        std::fill(squares.begin(), squares.end(), 0.0f);
+        std::fill(samples.begin(), samples.end(), 0u);
+        passes = 0;
+    }
+
+    // Pixels are only ever written by one thread at a time, so this does not need to
+    // be atomic as long as tiles do not overlap.
+    void add(int x, int y, const Sample &sample)
+    {
+        const size_t i = static_cast<size_t>(y) * width + x;
+        r[i] += sample.r * sample.weight;
+        g[i] += sample.g * sample.weight;
+        b[i] += sample.b * sample.weight;
+        weight[i] += sample.weight;
+        squares[i] += sample.luminance() * sample.luminance() * sample.weight;
+        samples[i]++;
+    }
+
+    // Average of the valid samples of a pixel, with a weight of 0 if there is none.
+    Sample pixel(int x, int y) const
+    {
+        const size_t i = static_cast<size_t>(y) * width + x;
+        if (weight[i] <= 0)
+            return {};
+        return {r[i] / weight[i], g[i] / weight[i], b[i] / weight[i], weight[i]};
+    }
+
+    uint32_t sampleCount(int x, int y) const
+    {
+        return samples[static_cast<size_t>(y) * width + x];
+    }
+
+    // Standard error of the mean luminance of a pixel, relative to that luminance (with
+    // a floor, so that dark pixels do not need endless samples). Infinite with fewer
+    // than two samples, and 0 when nearly all of them are invalid, since more samples
+    // would not help.
+    float relativeError(int x, int y) const
+    {
+        const size_t i = static_cast<size_t>(y) * width + x;
+        if (samples[i] < 2)
+            return std::numeric_limits<float>::infinity();
+        if (weight[i] < 2)
+            return 0;
+        const float mean = (0.2126f * r[i] + 0.7152f * g[i] + 0.0722f * b[i]) / weight[i];
+        const float variance = std::max(squares[i] / weight[i] - mean * mean, 0.0f) / (weight[i] - 1);
+        return std::sqrt(variance) / std::max(mean, 0.01f);
+    }
+
+    // Average linear RGB of every pixel, interleaved, for float image formats. Pixels
+    // without any valid sample are black.
+    std::vector<float> radiance() const
+    {
+        std::vector<float> image(size() * 3);
+        for (size_t i = 0; i < size(); i++)
+        {
+            if (weight[i] > 0)
+            {
+                image[3 * i] = r[i] / weight[i];
+                image[3 * i + 1] = g[i] / weight[i];
+                image[3 * i + 2] = b[i] / weight[i];
+            }
+        }
+        return image;
+    }
+
+    // Number of progressive passes accumulated since the last clear, which keeps the
+    // sample positions of successive passes and frames apart.
+    uint32_t passes = 0;
+
+    // Tone maps and encodes the buffer to interleaved 8-bit sRGB. Pixels without any
+    // valid sample take the color of the previous pixel.
+    std::vector<uint8_t> resolve(const ToneMapping &toneMapping = {}) const
+    {
+        static const auto kernel = pickKernel();
+        return resolve(kernel, toneMapping);
+    }
+
+    using Kernel = void (*)(const Framebuffer &, const ToneMapping &, int32_t *, size_t, size_t);
+
+    // Same as above with a given kernel, for comparisons.
+    std::vector<uint8_t> resolve(Kernel kernel, const ToneMapping &toneMapping) const
+    {
+        // Computes the indices into the encoding table with SIMD, then looks them up
+        std::vector<int32_t> indices(paddedSize() * 3);
+        constexpr size_t block = 4096;
+        const size_t blocks = (paddedSize() + block - 1) / block;
+#pragma omp parallel for if (blocks > 1)
+        for (size_t i = 0; i < blocks; i++)
+            kernel(*this, toneMapping, indices.data(), i * block, std::min((i + 1) * block, paddedSize()));
+
+        const auto &table = Srgb::encodeTable();
+        std::vector<uint8_t> image(size() * 3);
+        for (size_t i = 0; i < size(); i++)
+        {
+            if (weight[i] > 0 || i == 0)
+            {
+                for (size_t c = 0; c < 3; c++)
+                    image[3 * i + c] = table[indices[3 * i + c]];
+            }
+            else
+                std::copy_n(&image[3 * (i - 1)], 3, &image[3 * i]);
+        }
+        return image;
+    }
+
+    __attribute__((flatten)) static void resolve4(const Framebuffer &buffer, const ToneMapping &toneMapping, int32_t *indices, size_t begin, size_t end)
+    {
+        buffer.resolveRange<4>(toneMapping, indices, begin, end);
+    }
+
+    __attribute__((target("avx2,fma"), flatten)) static void resolve8(const Framebuffer &buffer, const ToneMapping &toneMapping, int32_t *indices, size_t begin, size_t end)
+    {
+        buffer.resolveRange<8>(toneMapping, indices, begin, end);
+    }
+
+    __attribute__((target("avx512f"), flatten)) static void resolve16(const Framebuffer &buffer, const ToneMapping &toneMapping, int32_t *indices, size_t begin, size_t end)
+    {
+        buffer.resolveRange<16>(toneMapping, indices, begin, end);
+    }
+
+    static Kernel pickKernel()
+    {
+        if (__builtin_cpu_supports("avx512f"))
+            return resolve16;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return resolve8;
+        return resolve4;
+    }
+
+private:
+    size_t paddedSize() const
+    {
+        return (size() + padding - 1) / padding * padding;
+    }
+
+    // Average, exposure, tone mapping and scaling to table indices, fused in one pass.
+    // The indices of a pixel are stored next to each other, in RGB order.
+    template <size_t N>
+    void resolveRange(const ToneMapping &toneMapping, int32_t *indices, size_t begin, size_t end) const
+    {
+        using Vector = typename bvh::SimdTypes<float, N>::Vector;
+        using Integer = typename bvh::SimdTypes<float, N>::Mask;
+        const float scale = Srgb::encodeSize - 1;
+        const bool reinhard = toneMapping.op == ToneMapping::Operator::Reinhard;
+        for (size_t i = begin; i < end; i += N)
+        {
+            Vector w;
+            std::memcpy(&w, &weight[i], sizeof(Vector));
+            const Vector factor = toneMapping.exposure / (w > 0 ? w : 1);
+            Integer channels[3];
+            const std::vector<float> *inputs[3] = {&r, &g, &b};
+            for (size_t c = 0; c < 3; c++)
+            {
+                Vector v;
+                std::memcpy(&v, &(*inputs[c])[i], sizeof(Vector));
+                v *= factor;
+                if (reinhard)
+                    v = v / (1 + v);
+                v = bvh::simd_min(bvh::simd_max(v, Vector{} + 0.0f), Vector{} + 1.0f);
+                channels[c] = __builtin_convertvector(v * scale + 0.5f, Integer);
+            }
+            for (size_t lane = 0; lane < N; lane++)
+            {
+                for (size_t c = 0; c < 3; c++)
+                    indices[3 * (i + lane) + c] = channels[c][lane];
+            }
+        }
+    }
+
+    int width = 0;
+    int height = 0;
+    std::vector<float> r, g, b;
+    std::vector<float> weight;
+    std::vector<float> squares;
+    std::vector<uint32_t> samples;
+};
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <zlib.h>
+
+// Image files. PNG is encoded here rather than through libpng, so that the rows are
+// filtered in parallel before the single deflate stream; PPM and PFM are written raw,
+// for pipelines that read the frames back, PFM keeping the linear float radiance.
+struct ImageEncoder
+{
+    // PNG row filters (see https://www.w3.org/TR/png/#9Filters). Adaptive picks for
+    // every row the filter with the smallest sum of absolute differences, like libpng.
+    enum class PngFilter
+    {
+        None,
+        Sub,
+        Up,
+        Average,
+        Paeth,
+        Adaptive
+    };
+
+    struct PngSettings
+    {
+        // zlib level, from 0 (stored) to 9, or -1 for the zlib default (6).
+        int level = Z_DEFAULT_COMPRESSION;
+        int strategy = Z_DEFAULT_STRATEGY;
+        PngFilter filter = PngFilter::Adaptive;
+    };
+
+    // Interleaved 8-bit RGB, rows from the top.
+    static void writePng(const std::string &path, int width, int height, const std::vector<uint8_t> &rgb, const std::string &title, const PngSettings &settings)
+    {
+        const std::vector<uint8_t> filtered = filterRows(width, height, rgb, settings.filter);
+
+        z_stream stream{};
+        if (deflateInit2(&stream, settings.level, Z_DEFLATED, 15, 8, settings.strategy) != Z_OK)
+            throw "Could not initialize zlib";
+        std::vector<uint8_t> compressed(deflateBound(&stream, filtered.size()));
+        stream.next_in = const_cast<Bytef *>(filtered.data());
+        stream.avail_in = filtered.size();
+        stream.next_out = compressed.data();
+        stream.avail_out = compressed.size();
+        const int status = deflate(&stream, Z_FINISH);
+        compressed.resize(stream.total_out);
+        deflateEnd(&stream);
+        if (status != Z_STREAM_END)
+            throw "Could not compress image";
+
+        std::vector<uint8_t> header;
+        putBigEndian(header, width);
+        putBigEndian(header, height);
+        // 8 bits per channel, RGB, deflate, adaptive filtering, not interlaced
+        header.insert(header.end(), {8, 2, 0, 0, 0});
+        std::vector<uint8_t> text(title.begin(), title.end());
+        const char key[] = "Title";
+        text.insert(text.begin(), key, key + sizeof(key));
+
+        File file(path);
+        const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        file.write(signature, sizeof(signature));
+        writeChunk(file, "IHDR", header);
+        if (!title.empty())
+            writeChunk(file, "tEXt", text);
+        writeChunk(file, "IDAT", compressed);
+        writeChunk(file, "IEND", {});
+    }
+
+    // Binary PPM (P6), interleaved 8-bit RGB.
+    static void writePpm(const std::string &path, int width, int height, const std::vector<uint8_t> &rgb)
+    {
+        File file(path);
+        const std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+        file.write(header.data(), header.size());
+        file.write(rgb.data(), rgb.size());
+    }
+
+    // Portable float map, interleaved linear RGB with rows from the top. The format
+    // stores rows from the bottom; a negative scale means little-endian floats.
+    static void writePfm(const std::string &path, int width, int height, const std::vector<float> &rgb)
+    {
+        static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+        File file(path);
+        const std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+        file.write(header.data(), header.size());
+        for (int y = height - 1; y >= 0; y--)
+            file.write(&rgb[3 * static_cast<size_t>(y) * width], 3 * sizeof(float) * width);
+    }
+
+    // One filter type byte, then the filtered bytes, for every row. Each row only
+    // depends on itself and the row above in the input, so rows are filtered in parallel.
+    static std::vector<uint8_t> filterRows(int width, int height, const std::vector<uint8_t> &rgb, PngFilter filter)
+    {
+        const size_t stride = 3 * static_cast<size_t>(width);
+        std::vector<uint8_t> output((stride + 1) * height);
+        tbb::parallel_for(tbb::blocked_range<int>(0, height, 16), [&](const tbb::blocked_range<int> &rows)
+                          {
+                              std::vector<uint8_t> candidate(stride);
+                              for (int y = rows.begin(); y < rows.end(); y++)
+                              {
+                                  const uint8_t *row = &rgb[y * stride];
+                                  const uint8_t *above = y > 0 ? &rgb[(y - 1) * stride] : nullptr;
+                                  uint8_t *out = &output[y * (stride + 1)];
+                                  if (filter != PngFilter::Adaptive)
+                                  {
+                                      out[0] = static_cast<uint8_t>(filter);
+                                      filterRow(filter, row, above, stride, out + 1);
+                                      continue;
+                                  }
+
+                                  uint64_t best = UINT64_MAX;
+                                  for (auto type : {PngFilter::None, PngFilter::Sub, PngFilter::Up, PngFilter::Average, PngFilter::Paeth})
+                                  {
+                                      filterRow(type, row, above, stride, candidate.data());
+                                      uint64_t sum = 0;
+                                      for (size_t i = 0; i < stride; i++)
+                                          sum += std::abs(static_cast<int8_t>(candidate[i]));
+                                      if (sum < best)
+                                      {
+                                          best = sum;
+                                          out[0] = static_cast<uint8_t>(type);
+                                          std::copy(candidate.begin(), candidate.end(), out + 1);
+                                      }
+                                  }
+                              } });
+        return output;
+    }
+
+private:
+    // Closes the file when the write is done or has failed.
+    struct File
+    {
+        File(const std::string &path) : fp(std::fopen(path.c_str(), "wb"))
+        {
+            if (!fp)
+                throw "Could not open file for writing";
+        }
+
+        ~File()
+        {
+            std::fclose(fp);
+        }
+
+        void write(const void *data, size_t size)
+        {
+            if (std::fwrite(data, 1, size, fp) != size)
+                throw "Could not write file";
+        }
+
+        FILE *fp;
+    };
+
+    static void putBigEndian(std::vector<uint8_t> &bytes, uint32_t value)
+    {
+        bytes.insert(bytes.end(), {static_cast<uint8_t>(value >> 24), static_cast<uint8_t>(value >> 16), static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value)});
+    }
+
+    static void writeChunk(File &file, const char *type, const std::vector<uint8_t> &data)
+    {
+        std::vector<uint8_t> length;
+        putBigEndian(length, data.size());
+        file.write(length.data(), 4);
+        file.write(type, 4);
+        file.write(data.data(), data.size());
+        uLong crc = crc32(0, reinterpret_cast<const Bytef *>(type), 4);
+        crc = crc32(crc, data.data(), data.size());
+        std::vector<uint8_t> checksum;
+        putBigEndian(checksum, crc);
+        file.write(checksum.data(), 4);
+    }
+
+    // Bytes of a pixel, for Sub, Average and Paeth.
+    static constexpr size_t pixelSize = 3;
+
+    static void filterRow(PngFilter type, const uint8_t *row, const uint8_t *above, size_t stride, uint8_t *out)
+    {
+        auto left = [&](size_t i) -> int
+        { return i >= pixelSize ? row[i - pixelSize] : 0; };
+        auto up = [&](size_t i) -> int
+        { return above ? above[i] : 0; };
+        auto upLeft = [&](size_t i) -> int
+        { return above && i >= pixelSize ? above[i - pixelSize] : 0; };
+
+        for (size_t i = 0; i < stride; i++)
+        {
+            int predictor = 0;
+            switch (type)
+            {
+            case PngFilter::Sub:
+                predictor = left(i);
+                break;
+            case PngFilter::Up:
+                predictor = up(i);
+                break;
+            case PngFilter::Average:
+                predictor = (left(i) + up(i)) / 2;
+                break;
+            case PngFilter::Paeth:
+            {
+                const int a = left(i), b = up(i), c = upLeft(i);
+                const int p = a + b - c;
+                const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                break;
+            }
+            default:
+                break;
+            }
+            out[i] = static_cast<uint8_t>(row[i] - predictor);
+        }
+    }
+};
+
+// Writes images on background threads, so that the render loop does not wait for the
+// compression of a frame before starting the next one. Frames wait in a bounded queue:
+// when it is full, write() blocks until an encoder takes one, which keeps the memory
+// used by frames in flight to (capacity + threads) images whatever the encoding speed.
+// Failures are reported on stderr and counted, they do not stop the render.
+class ImageWriter
+{
+public:
+    enum class Format
+    {
+        Png,
+        Ppm,
+        Pfm
+    };
+
+    struct Statistics
+    {
+        size_t written = 0;
+        size_t failed = 0;
+        // Time write() spent waiting for room in the queue, in seconds.
+        double blockedSeconds = 0;
+        // Time spent encoding, summed over the encoder threads, in seconds.
+        double encodeSeconds = 0;
+    };
+
+    ImageEncoder::PngSettings pngSettings;
+
+    ImageWriter(size_t threads = 1, size_t _capacity = 2) : capacity(std::max<size_t>(_capacity, 1))
+    {
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); i++)
+            encoders.emplace_back([this]
+                                  { run(); });
+    }
+
+    ~ImageWriter()
+    {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        notEmpty.notify_all();
+        for (auto &encoder : encoders)
+            encoder.join();
+    }
+
+    ImageWriter(const ImageWriter &) = delete;
+    ImageWriter &operator=(const ImageWriter &) = delete;
+
+    // Queues interleaved 8-bit RGB, as a PNG or a PPM.
+    void write(const std::string &path, Format format, int width, int height, std::vector<uint8_t> rgb, const std::string &title = "")
+    {
+        const auto settings = pngSettings;
+        push(path, [=, rgb = std::move(rgb)]
+             {
+                 if (format == Format::Ppm)
+                     ImageEncoder::writePpm(path, width, height, rgb);
+                 else
+                     ImageEncoder::writePng(path, width, height, rgb, title, settings); });
+    }
+
+    // Queues interleaved linear float RGB, as a PFM.
+    void write(const std::string &path, int width, int height, std::vector<float> rgb)
+    {
+        push(path, [=, rgb = std::move(rgb)]
+             { ImageEncoder::writePfm(path, width, height, rgb); });
+    }
+
+    // Waits until every queued image is written.
+    void finish()
+    {
+        std::unique_lock lock(mutex);
+        idle.wait(lock, [this]
+                  { return jobs.empty() && busy == 0; });
+    }
+
+    Statistics getStatistics()
+    {
+        std::lock_guard lock(mutex);
+        return statistics;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Job
+    {
+        std::string path;
+        std::function<void()> encode;
+    };
+
+    template <typename F>
+    void push(const std::string &path, F encode)
+    {
+        const auto start = Clock::now();
+        std::unique_lock lock(mutex);
+        notFull.wait(lock, [this]
+                     { return jobs.size() < capacity; });
+        statistics.blockedSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+        jobs.push_back({path, std::move(encode)});
+        lock.unlock();
+        notEmpty.notify_one();
+    }
+
+    void run()
+    {
+        while (true)
+        {
+            std::unique_lock lock(mutex);
+            notEmpty.wait(lock, [this]
+                          { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            busy++;
+            lock.unlock();
+            notFull.notify_one();
+
+            // Every exception is caught: one escaping the thread would terminate the
+            // program, and busy must go back down for finish() to return
+            const auto start = Clock::now();
+            bool ok = false;
+            try
+            {
+                job.encode();
+                ok = true;
+            }
+            catch (const char *message)
+            {
+                std::cerr << job.path << ": " << message << std::endl;
+            }
+            catch (const std::exception &exception)
+            {
+                std::cerr << job.path << ": " << exception.what() << std::endl;
+            }
+            catch (...)
+            {
+                std::cerr << job.path << ": Could not write image" << std::endl;
+            }
+
+            lock.lock();
+            statistics.encodeSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+            (ok ? statistics.written : statistics.failed)++;
+            busy--;
+            if (jobs.empty() && busy == 0)
+                idle.notify_all();
+        }
+    }
+
+    size_t capacity;
+    std::deque<Job> jobs;
+    size_t busy = 0;
+    bool stopping = false;
+    Statistics statistics;
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty, idle;
+    std::vector<std::thread> encoders;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "common.hpp"
+
+// Triangle mesh with shared vertices: every vertex has a position, a normal and texture
+// coordinates, and every triangle is three indices into the vertex arrays. The arrays are
+// read through spans, so that they can point into a mapped cache file as well as into
+// the buffers of a MeshBuffers.
+struct IndexedMesh
+{
+    std::span<const Point> positions;
+    std::span<const Point> normals;
+    std::span<const TriangleVertex::VertexTexture> uvs;
+    std::span<const uint32_t> indices;
+
+    size_t vertexCount() const
+    {
+        return positions.size();
+    }
+
+    size_t triangleCount() const
+    {
+        return indices.size() / 3;
+    }
+
+    BvhTriangle bvhTriangle(size_t triangle) const
+    {
+        return BvhTriangle(
+            positions[indices[3 * triangle]],
+            positions[indices[3 * triangle + 1]],
+            positions[indices[3 * triangle + 2]]);
+    }
+};
+
+// Storage for an IndexedMesh.
+struct MeshBuffers
+{
+    std::vector<Point> positions;
+    std::vector<Point> normals;
+    std::vector<TriangleVertex::VertexTexture> uvs;
+    std::vector<uint32_t> indices;
+
+    IndexedMesh view() const
+    {
+        return {positions, normals, uvs, indices};
+    }
+};
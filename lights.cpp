@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <variant>
+
+#include "common.hpp"
+#include "framebuffer.cpp"
+#include "sampling.cpp"
+
+// Light sources, in world space. Lit materials sample every light once per hit and
+// trace a shadow ray towards the sampled point; the light contributes if nothing is in
+// the way.
+
+// Unit direction from a shaded point to a point of a light, the distance to that point,
+// and the radiance arriving from it, before the cosine at the shaded point.
+struct LightSample
+{
+    Point direction;
+    float distance;
+    Rgb radiance;
+};
+
+struct PointLight
+{
+    Point position;
+    Rgb intensity;
+
+    LightSample sample(const Point &point, Sampler &) const
+    {
+        const Point toLight = position - point;
+        const float squaredDistance = toLight * toLight;
+        const float distance = std::sqrt(squaredDistance);
+        return {toLight / distance, distance, intensity * (1 / squaredDistance)};
+    }
+};
+
+// Light from infinitely far away, such as the sun.
+struct DirectionalLight
+{
+    // Direction in which the light travels.
+    Point direction;
+    Rgb irradiance;
+
+    LightSample sample(const Point &, Sampler &) const
+    {
+        return {direction.normal() * -1, std::numeric_limits<float>::infinity(), irradiance};
+    }
+};
+
+// Parallelogram emitting on both sides, sampled uniformly: soft shadows converge with
+// the number of samples per pixel.
+struct AreaLight
+{
+    Point corner;
+    Point edge1;
+    Point edge2;
+    Rgb radiance;
+
+    LightSample sample(const Point &point, Sampler &sampler) const
+    {
+        const auto [u, v] = sampler.next2D();
+        const Point toLight = corner + edge1 * u + edge2 * v - point;
+        const float squaredDistance = toLight * toLight;
+        const float distance = std::sqrt(squaredDistance);
+        const Point normal = edge1 & edge2;
+        // Area times the cosine at the light, over the squared distance
+        const float solidAngle = std::abs(normal * toLight) / (distance * squaredDistance);
+        return {toLight / distance, distance, radiance * solidAngle};
+    }
+};
+
+using Light = std::variant<PointLight, DirectionalLight, AreaLight>;
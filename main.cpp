@@ -1,193 +1,219 @@
 // #include "mirror.cpp"
+#include "animation.cpp"
 #include "rayTracer.cpp"
+#include "threads.cpp"
+#include "imageWriter.cpp"
 #include <iostream>
-#include <png.h>
 #include <cmath>
+#include <string>
+#include <utility>
 
-int writeImage(const char *filename, int width, int height, const std::vector<Color> &buffer, char *title)
+const char *bvhUpdateName(Scene::BvhUpdate update)
 {
-    int code = 0;
-    FILE *fp = NULL;
-    png_structp png_ptr = NULL;
-    png_infop info_ptr = NULL;
-    png_bytep row = NULL;
-
-    // Open file for writing (binary mode)
-    fp = fopen(filename, "wb");
-    if (fp == NULL)
-    {
-        fprintf(stderr, "Could not open file %s for writing\n", filename);
-        code = 1;
-        goto finalise;
-    }
-
-    // Initialize write structure
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (png_ptr == NULL)
-    {
-        fprintf(stderr, "Could not allocate write struct\n");
-        code = 1;
-        goto finalise;
-    }
-
-    // Initialize info structure
-    info_ptr = png_create_info_struct(png_ptr);
-    if (info_ptr == NULL)
+    switch (update)
     {
-        fprintf(stderr, "Could not allocate info struct\n");
-        code = 1;
-        goto finalise;
+    case Scene::BvhUpdate::Build:
+        return "build";
+    case Scene::BvhUpdate::Refit:
+        return "refit";
+    case Scene::BvhUpdate::Optimize:
+        return "refit+optimize";
+    default:
+        return "none";
     }
+}
 
-    // Setup Exception handling
-    if (setjmp(png_jmpbuf(png_ptr)))
-    {
-        fprintf(stderr, "Error during png creation\n");
-        code = 1;
-        goto finalise;
-    }
-
-    png_init_io(png_ptr, fp);
-
-    // Write header (8 bit colour depth)
-    png_set_IHDR(png_ptr, info_ptr, width, height,
-                 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-
-    // Set title
-    if (title != NULL)
-    {
-        png_text title_text;
-        title_text.compression = PNG_TEXT_COMPRESSION_NONE;
-        title_text.key = "Title";
-        title_text.text = title;
-        png_set_text(png_ptr, info_ptr, &title_text, 1);
-    }
-
-    png_write_info(png_ptr, info_ptr);
-
-    // Allocate memory for one row (3 bytes per pixel - RGB)
-    row = (png_bytep)malloc(3 * width * sizeof(png_byte));
-
-    // Write image data
-    int x, y;
-    for (y = 0; y < height; y++)
+// Sets value to the choice named by the argument of an option. Unknown names are reported
+// along with the accepted ones, and leave the value as it is.
+template <typename T, size_t N>
+bool parseChoice(const char *option, const char *name, const std::pair<const char *, T> (&choices)[N], T &value)
+{
+    for (const auto &[choiceName, choice] : choices)
     {
-        for (x = 0; x < width; x++)
+        if (std::string(name) == choiceName)
         {
-            row[x * 3] = buffer[y * width + x].r;
-            row[x * 3 + 1] = buffer[y * width + x].g;
-            row[x * 3 + 2] = buffer[y * width + x].b;
+            value = choice;
+            return true;
         }
-        png_write_row(png_ptr, row);
     }
-
-    // End write
-    png_write_end(png_ptr, NULL);
-
-finalise:
-    if (fp != NULL)
-        fclose(fp);
-    if (info_ptr != NULL)
-        png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
-    if (png_ptr != NULL)
-        png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-    if (row != NULL)
-        free(row);
-
-    return code;
+    std::cerr << "unknown value '" << name << "' for " << option << ", expected one of:";
+    for (const auto &choice : choices)
+        std::cerr << " " << choice.first;
+    std::cerr << std::endl;
+    return false;
 }
 
 int main(int argc, char const *argv[])
 {
     constexpr int dim = 1000;
 
-    read_png_file("spot/spot_texture.png");
-
-    Obj textureCow("spot/spot_triangulated.obj", [&](const Triangle &tr, const TriangleVertex::VertexTexture &vt, png_bytep *, std::function<Color(Ray, int)> rec, const Ray &ray, float t, float u, float v, int depth = 0)
-                   {
-                       uint row = read_height - 1 - read_height * std::clamp(vt.v, 0.0f, 0.99f);
-                       uint col = read_width * std::clamp(vt.u, 0.0f, 0.99f);
-                       png_bytep rowVals = row_pointers[row];
-                       return Color{rowVals[col * 4 + 0], rowVals[col * 4 + 1], rowVals[col * 4 + 2]};
-                   });
-
-    Obj rTextureCow("spot/spot_triangulated.obj", [&](const Triangle &tr, const TriangleVertex::VertexTexture &vt, png_bytep *, std::function<Color(Ray, int)> rec, const Ray &ray, float t, float u, float v, int depth = 0)
-                    {
-                        float sum = (ray.origin + ray.unitDir * t) * Point(1, 1, 1);
-                        float sum1 = fmod(sum, 1);
-                        float sum2 = fmod(sum1 + 0.33, 1);
-                        float sum3 = fmod(sum2 + 0.33, 1);
-
-                        return Color{std::sin(sum1 * 3.1415) * 255, std::sin(sum2 * 3.1415) * 255, std::sin(sum3 * 3.1415) * 255};
-                    });
-
-    Obj mirrowCow("spot/spot_triangulated.obj", [&](const Triangle &tr, const TriangleVertex::VertexTexture &vt, png_bytep *, std::function<Color(Ray, int)> rec, const Ray &ray, float t, float u, float v, int depth = 0)
-                  {
-                      if (depth >= 5)
-                          return Color{-1, -1, -1};
-
-                      const auto normal = (tr.v2.normal * u + tr.v3.normal * v + tr.v1.normal * (1 - u - v));
-                      return rec(Ray{ray.origin + ray.unitDir * t, ray.unitDir - (normal * (ray.unitDir * 2 * normal) / (normal * normal))}, depth + 1);
-                  });
-
-    Obj metalCow("spot/spot_triangulated.obj", [&](const Triangle &tr, const TriangleVertex::VertexTexture &vt, png_bytep *, std::function<Color(Ray, int)> rec, const Ray &ray, float t, float u, float v, int depth = 0)
-                 {
-                     const auto normal = (tr.v2.normal * u + tr.v3.normal * v + tr.v1.normal * (1 - u - v));
-
-                     if (depth > 3)
-                         return Color{-1, -1, -1};
-                     const int refl = 10;
-                     int count = 0;
-
-                     Color res;
-                     Ray fakeRay{ray.origin + ray.unitDir * t, ray.unitDir - (normal * (ray.unitDir * 2 * normal) / (normal * normal))};
-                     for (size_t idx = 0; idx < refl; idx++)
-                     {
-                         float dx = static_cast<float>(rand()) / (static_cast<float>(RAND_MAX) / 0.2) - 0.1;
-                         float dy = static_cast<float>(rand()) / (static_cast<float>(RAND_MAX) / 0.2) - 0.1;
-                         float dz = static_cast<float>(rand()) / (static_cast<float>(RAND_MAX) / 0.2) - 0.1;
-
-                         Ray useRay{
-                             fakeRay.origin, {fakeRay.unitDir.x + dx, fakeRay.unitDir.y + dy, fakeRay.unitDir.z + dz}};
-
-                         Color tmp = rec(useRay, depth + 1);
-
-                         res.r += tmp.r;
-                         res.g += tmp.g;
-                         res.b += tmp.b;
-
-                         if (tmp.r != -1)
-                             count++;
-                     }
-                     if (count == 0)
-                         return Color{-1, -1, -1};
-
-                     return Color{res.r / count, res.g / count, res.b / count};
-                 });
-
-    for (int i = 0; i <= 100; i++)
+    size_t threads = ThreadLimit::hardwareThreads();
+    // Progressive rendering, enabled by either a per-frame time budget or a sample count
+    std::optional<ProgressiveSettings> progressive;
+    SampleSequence sequence = SampleSequence::Sobol;
+    bool lights = false;
+    RayTracer::TraceMode traceMode = RayTracer::TraceMode::DepthFirst;
+    ImageWriter::Format format = ImageWriter::Format::Png;
+    ImageEncoder::PngSettings pngSettings;
+    size_t encoders = 1;
+    bool overlap = true;
+    bool heatmaps = false;
+    auto progressiveSettings = [&]() -> ProgressiveSettings &
     {
-        RayTracer tracer(Point{0, 0, 0}, Point{0, 0, 3}, dim, dim);
-
-        // auto triangles = textureCow.setDisplacement(-1, 0, 1.5).setRotation(3.1415 * i / 50, 3.1415 * i / 50, 0).getTriangles();
-        tracer.addTriangles(mirrowCow.setDisplacement(-0.9, 0, 1.5).setRotation(3.1415 * i / 50, 3.1415 * i / 50, 0).getTriangles());
-        tracer.addTriangles(mirrowCow.setDisplacement(0.9, 0, 2.5).setRotation(3.1415 * i / 50, 3.1415 * i / 50, 0).getTriangles());
-        tracer.addTriangles(rTextureCow.setDisplacement(0, 0, 2.5).setRotation(3.1415 * i / 50, 3.1415 * i / 50, 0).getTriangles());
-        // auto metalTriangles = metalCow.setDisplacement(0, 0, 1.5).setRotation(3.1415 * i / 50, 3.1415 * i / 50, 0).getTriangles();
-        // auto rtTriangles = rTextureCow.setDisplacement(0.4, 0, 1.5).setRotation(3.1415 * i / 50, 3.1415 * i / 50, 0).getTriangles();
-
-        std::cout
-            << "rendering" << std::endl;
-        auto colors = tracer.render();
-        for (size_t idx = 1; idx < colors.size(); idx++)
+        return progressive ? *progressive : progressive.emplace();
+    };
+    for (int arg = 1; arg + 1 < argc; arg++)
+    {
+        if (std::string(argv[arg]) == "--threads")
+            threads = std::stoul(argv[++arg]);
+        else if (std::string(argv[arg]) == "--budget")
+            progressiveSettings().timeBudget = std::stod(argv[++arg]) / 1000;
+        else if (std::string(argv[arg]) == "--samples")
+            progressiveSettings().maxSamples = std::stoi(argv[++arg]);
+        else if (std::string(argv[arg]) == "--mode")
+        {
+            const std::pair<const char *, RayTracer::TraceMode> modes[] = {
+                {"depth-first", RayTracer::TraceMode::DepthFirst},
+                {"wavefront", RayTracer::TraceMode::Wavefront}};
+            if (!parseChoice(argv[arg], argv[arg + 1], modes, traceMode))
+                return 1;
+            arg++;
+        }
+        else if (std::string(argv[arg]) == "--lights")
+            lights = std::string(argv[++arg]) == "on";
+        else if (std::string(argv[arg]) == "--format")
+        {
+            const std::pair<const char *, ImageWriter::Format> formats[] = {
+                {"png", ImageWriter::Format::Png},
+                {"ppm", ImageWriter::Format::Ppm},
+                {"pfm", ImageWriter::Format::Pfm}};
+            if (!parseChoice(argv[arg], argv[arg + 1], formats, format))
+                return 1;
+            arg++;
+        }
+        else if (std::string(argv[arg]) == "--png-level")
+            pngSettings.level = std::stoi(argv[++arg]);
+        else if (std::string(argv[arg]) == "--png-filter")
+        {
+            const std::pair<const char *, ImageEncoder::PngFilter> filters[] = {
+                {"none", ImageEncoder::PngFilter::None},
+                {"sub", ImageEncoder::PngFilter::Sub},
+                {"up", ImageEncoder::PngFilter::Up},
+                {"average", ImageEncoder::PngFilter::Average},
+                {"paeth", ImageEncoder::PngFilter::Paeth},
+                {"adaptive", ImageEncoder::PngFilter::Adaptive}};
+            if (!parseChoice(argv[arg], argv[arg + 1], filters, pngSettings.filter))
+                return 1;
+            arg++;
+        }
+        else if (std::string(argv[arg]) == "--heatmaps")
+            heatmaps = std::string(argv[++arg]) == "on";
+        else if (std::string(argv[arg]) == "--overlap")
+            overlap = std::string(argv[++arg]) != "off";
+        else if (std::string(argv[arg]) == "--encoders")
+            encoders = std::stoul(argv[++arg]);
+        else if (std::string(argv[arg]) == "--sequence")
         {
-            if (colors.at(idx).r == -1)
-                colors.at(idx) = colors.at(idx - 1);
+            const std::pair<const char *, SampleSequence> sequences[] = {
+                {"random", SampleSequence::Random},
+                {"sobol", SampleSequence::Sobol},
+                {"halton", SampleSequence::Halton}};
+            if (!parseChoice(argv[arg], argv[arg + 1], sequences, sequence))
+                return 1;
+            arg++;
         }
-        std::string name = "out/cow" + std::to_string(i) + ".png";
-        writeImage(name.c_str(), dim, dim, colors, "cow");
     }
+    ThreadLimit threadLimit(threads);
+
+    RayTracer tracer(Point{0, 0, 0}, Point{0, 0, 3}, dim, dim);
+    tracer.sampleSequence = sequence;
+    tracer.traceMode = traceMode;
+    Scene scene;
+
+    Obj textureCow("spot/spot_triangulated.obj", scene.addMaterial(TexturedMaterial{scene.addTexture(Texture::load("spot/spot_texture.png"))}));
+    Obj rTextureCow("spot/spot_triangulated.obj", scene.addMaterial(ProceduralMaterial{}));
+    Obj mirrowCow("spot/spot_triangulated.obj", scene.addMaterial(MirrorMaterial{}));
+    Obj metalCow("spot/spot_triangulated.obj", scene.addMaterial(MetalMaterial{}));
+    const auto &load = textureCow.getLoadStatistics();
+    std::cout << "loaded spot/spot_triangulated.obj in " << load.seconds * 1000 << " ms (" << load.megabytesPerSecond() << " MB/s"
+              << (load.cached ? ", from cache" : "") << ")" << std::endl;
+
+    if (lights)
+    {
+        // Warm sun from the upper left, and a cool area light above the camera
+        scene.addLight(DirectionalLight{Point{0.5f, -1, 0.5f}, Rgb{1.2f, 1.1f, 0.9f}});
+        scene.addLight(AreaLight{Point{-1, 2, 0}, Point{2, 0, 0}, Point{0, 0, 2}, Rgb{0.4f, 0.45f, 0.6f}});
+    }
+
+    // High-quality BVHs: built once, then loaded from the cache on later runs
+    const auto mirrowCowMesh = scene.addMesh(mirrowCow, Mesh::BvhBuild::SpatialSplit);
+    const auto rTextureCowMesh = scene.addMesh(rTextureCow, Mesh::BvhBuild::SpatialSplit);
+
+    // Frames are encoded in the background while the next ones render
+    ImageWriter writer(encoders);
+    writer.pngSettings = pngSettings;
+    Animation animation(scene, tracer);
+    animation.progressive = progressive;
+    animation.overlap = overlap;
+    const auto statistics = animation.run(
+        0, 100,
+        [&](Scene &frameScene, int i)
+        {
+            // frameScene.addInstance(textureCowMesh, textureCow.setDisplacement(-1, 0, 1.5).setRotation(3.1415 * i / 50, 3.1415 * i / 50, 0).getTransform());
+            frameScene.addInstance(mirrowCowMesh, mirrowCow.setDisplacement(-0.9, 0, 1.5).setRotation(3.1415 * i / 50, 3.1415 * i / 50, 0).getTransform());
+            frameScene.addInstance(mirrowCowMesh, mirrowCow.setDisplacement(0.9, 0, 2.5).setRotation(3.1415 * i / 50, 3.1415 * i / 50, 0).getTransform());
+            frameScene.addInstance(rTextureCowMesh, rTextureCow.setDisplacement(0, 0, 2.5).setRotation(3.1415 * i / 50, 3.1415 * i / 50, 0).getTransform());
+            // frameScene.addInstance(metalCowMesh, metalCow.setDisplacement(0, 0, 1.5).setRotation(3.1415 * i / 50, 3.1415 * i / 50, 0).getTransform());
+            // frameScene.addInstance(rTextureCowMesh, rTextureCow.setDisplacement(0.4, 0, 1.5).setRotation(3.1415 * i / 50, 3.1415 * i / 50, 0).getTransform());
+        },
+        [&](const Scene &frameScene, const Framebuffer &framebuffer, const Animation::FrameTimes &times)
+        {
+            const auto &topLevel = frameScene.getTopLevel();
+            std::cout << "frame " << times.frame << ": bvh " << bvhUpdateName(topLevel.getLastUpdate()) << ", sah cost " << topLevel.getSahCost()
+                      << " (" << topLevel.getRelativeSahCost() << "x last build), rendered in " << times.render * 1000 << " ms" << std::endl;
+            if (times.progressive)
+            {
+                const auto &progressive = *times.progressive;
+                std::cout << progressive.passes << " passes, " << static_cast<double>(progressive.samples) / framebuffer.size() << " samples per pixel in "
+                          << progressive.seconds * 1000 << " ms, max tile error " << progressive.maxTileError << ", " << progressive.noisyPixels << " noisy pixels" << std::endl;
+            }
+
+            // Cost of the primary rays, to spot the regions where the BVHs do poorly
+            if (heatmaps)
+            {
+                const auto traversal = tracer.renderStatistics(frameScene);
+                const std::pair<TraversalStatistics::Counter, std::string> counters[] = {
+                    {TraversalStatistics::Counter::TraversalSteps, "steps"},
+                    {TraversalStatistics::Counter::TriangleTests, "triangles"}};
+                for (const auto &[counter, counterName] : counters)
+                {
+                    const auto summary = traversal.summary(counter);
+                    std::cout << counterName << " per primary ray: mean " << summary.mean << ", 99th percentile " << summary.percentile99
+                              << ", max " << summary.max << ", histogram by powers of two:";
+                    for (size_t count : summary.histogram)
+                        std::cout << " " << count;
+                    std::cout << std::endl;
+                    writer.write("out/" + counterName + std::to_string(times.frame) + ".png", ImageWriter::Format::Png, dim, dim, traversal.heatmap(counter), counterName);
+                }
+            }
+
+            const std::string name = "out/cow" + std::to_string(times.frame);
+            if (format == ImageWriter::Format::Pfm)
+                writer.write(name + ".pfm", dim, dim, framebuffer.radiance());
+            else
+                writer.write(name + (format == ImageWriter::Format::Ppm ? ".ppm" : ".png"), format, dim, dim, framebuffer.resolve(), "cow");
+        });
+
+    writer.finish();
+    const auto output = writer.getStatistics();
+    std::cout << output.written << " images written (" << output.failed << " failed), " << output.encodeSeconds * 1000 << " ms encoding, "
+              << output.blockedSeconds * 1000 << " ms waiting for the encoders" << std::endl;
+
+    // Stages overlap, so their sum is larger than the wall-clock time when they do
+    const auto total = statistics.total();
+    std::cout << statistics.frames.size() << " frames in " << statistics.seconds * 1000 << " ms: update " << total.update * 1000 << " ms, bvh "
+              << total.build * 1000 << " ms, render " << total.render * 1000 << " ms, output " << total.output * 1000 << " ms, waiting for setup "
+              << statistics.waitSeconds * 1000 << " ms" << std::endl;
 
     return 0;
 }
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cmath>
+#include <variant>
+#include <algorithm>
+
+#include "common.hpp"
+#include "texture.cpp"
+
+// Shading inputs at a ray hit, in world space.
+struct SurfaceHit
+{
+    Point position;
+    // Interpolated vertex normal, not normalized.
+    Point normal;
+    TriangleVertex::VertexTexture vt;
+    float t;
+    MaterialId material;
+    // Width of the pixel footprint at the hit, in UV units.
+    float uvFootprint;
+};
+
+// Mirror direction of the ray around the normal of the hit.
+inline Ray reflect(const Ray &ray, const SurfaceHit &hit)
+{
+    return Ray{hit.position, ray.unitDir - (hit.normal * (ray.unitDir * 2 * hit.normal) / (hit.normal * hit.normal))};
+}
+
+// Materials are a closed set of types dispatched with std::visit, so that shading
+// can be inlined into the render loop. A material either ends the path with
+// path.emit(color), or continues it with path.scatter(ray, weight) once per
+// secondary ray, where the weights of one hit sum up to one. A material that does
+// neither drops the path, which then does not count towards the pixel color. Opaque
+// surfaces end it with path.diffuse(ray, hit, color) instead, to be lit by the lights
+// of the scene. scatteredRays(depth) is the number of rays shade() scatters at a given
+// depth, from which the renderer sizes the stack of pending rays of a path.
+// Random numbers come from path.sampler(), never from global state, so that images
+// are reproducible.
+
+// Diffuse surface colored by a texture, filtered according to the footprint of the hit.
+struct TexturedMaterial
+{
+    const Texture *texture;
+
+    template <typename Path>
+    void shade(const Ray &ray, const SurfaceHit &hit, int, Path &path) const
+    {
+        path.diffuse(ray, hit, texture->sample(hit.vt.u, hit.vt.v, hit.uvFootprint));
+    }
+
+    int scatteredRays(int) const
+    {
+        return 0;
+    }
+};
+
+// Rainbow bands along the diagonal of the world.
+struct ProceduralMaterial
+{
+    template <typename Path>
+    void shade(const Ray &ray, const SurfaceHit &hit, int, Path &path) const
+    {
+        float sum = hit.position * Point(1, 1, 1);
+        float sum1 = fmod(sum, 1);
+        float sum2 = fmod(sum1 + 0.33, 1);
+        float sum3 = fmod(sum2 + 0.33, 1);
+
+        path.diffuse(ray, hit, Color{static_cast<int>(std::sin(sum1 * 3.1415) * 255), static_cast<int>(std::sin(sum2 * 3.1415) * 255), static_cast<int>(std::sin(sum3 * 3.1415) * 255)});
+    }
+
+    int scatteredRays(int) const
+    {
+        return 0;
+    }
+};
+
+struct MirrorMaterial
+{
+    int maxDepth = 5;
+
+    template <typename Path>
+    void shade(const Ray &ray, const SurfaceHit &hit, int depth, Path &path) const
+    {
+        if (depth < maxDepth)
+            path.scatter(reflect(ray, hit), 1);
+    }
+
+    int scatteredRays(int depth) const
+    {
+        return depth < maxDepth ? 1 : 0;
+    }
+};
+
+// Averages several reflected rays, jittered around the mirror direction.
+struct MetalMaterial
+{
+    int maxDepth = 3;
+    int samples = 10;
+    float roughness = 0.1f;
+
+    template <typename Path>
+    void shade(const Ray &ray, const SurfaceHit &hit, int depth, Path &path) const
+    {
+        if (depth > maxDepth)
+            return;
+
+        const Ray mirrorRay = reflect(ray, hit);
+        auto &sampler = path.sampler();
+        for (int idx = 0; idx < samples; idx++)
+        {
+            const auto [u, v] = sampler.next2D();
+            float dx = (2 * u - 1) * roughness;
+            float dy = (2 * v - 1) * roughness;
+            float dz = (2 * sampler.next1D() - 1) * roughness;
+
+            path.scatter(Ray{mirrorRay.origin, {mirrorRay.unitDir.x + dx, mirrorRay.unitDir.y + dy, mirrorRay.unitDir.z + dz}}, 1.0f / samples);
+        }
+    }
+
+    int scatteredRays(int depth) const
+    {
+        return depth > maxDepth ? 0 : std::max(samples, 0);
+    }
+};
+
+using Material = std::variant<TexturedMaterial, ProceduralMaterial, MirrorMaterial, MetalMaterial>;
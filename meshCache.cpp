@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <type_traits>
+
+#include "common.hpp"
+#include "mappedFile.cpp"
+#include "indexedMesh.cpp"
+
+// Binary copies of parsed meshes, named after a hash of their source file. A cache file is
+// a header followed by the arrays of an IndexedMesh, each aligned to 64 bytes, so that a
+// mapping of the file can be used as is. Files with another version or source are ignored.
+class MeshCache
+{
+public:
+    static constexpr uint32_t version = 2;
+
+    // Where cache files are written, relative to the working directory.
+    static inline std::string directory = "cache";
+
+    // 64-bit FNV-1a, over 8 bytes at a time.
+    static uint64_t hash(const char *data, size_t size)
+    {
+        uint64_t hash = 0xcbf29ce484222325;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            hash = (hash ^ word) * 0x100000001b3;
+        }
+        for (; i < size; i++)
+            hash = (hash ^ static_cast<uint8_t>(data[i])) * 0x100000001b3;
+        return hash;
+    }
+
+    // Maps the cache file of the given source, if there is a valid one.
+    static std::optional<MeshCache> open(uint64_t sourceHash, uint64_t sourceSize)
+    {
+        std::unique_ptr<MappedFile> file;
+        try
+        {
+            file = std::make_unique<MappedFile>(pathOf(sourceHash));
+        }
+        catch (const char *)
+        {
+            return std::nullopt;
+        }
+
+        if (file->size() < sizeof(Header))
+            return std::nullopt;
+        const auto *header = reinterpret_cast<const Header *>(file->data());
+        if (std::memcmp(header->magic, magic, sizeof(magic)) != 0 || header->version != version ||
+            header->sourceHash != sourceHash || header->sourceSize != sourceSize)
+            return std::nullopt;
+        for (const auto &array : header->arrays)
+        {
+            if (array.offset % alignment != 0 || array.offset > file->size() || array.size > file->size() - array.offset)
+                return std::nullopt;
+        }
+
+        MeshCache cache(std::move(file));
+        const auto mesh = cache.view();
+        if (mesh.normals.size() != mesh.vertexCount() || mesh.uvs.size() != mesh.vertexCount() || mesh.indices.size() % 3 != 0)
+            return std::nullopt;
+        for (auto index : mesh.indices)
+        {
+            if (index >= mesh.vertexCount())
+                return std::nullopt;
+        }
+        return cache;
+    }
+
+    // Writes the cache file of the given source. The file is written under a temporary
+    // name and then renamed, so that concurrent runs never map a partial file.
+    static void write(uint64_t sourceHash, uint64_t sourceSize, const IndexedMesh &mesh)
+    {
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+
+        Header header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.sourceHash = sourceHash;
+        header.sourceSize = sourceSize;
+        const std::span<const std::byte> arrays[] = {
+            std::as_bytes(mesh.positions),
+            std::as_bytes(mesh.normals),
+            std::as_bytes(mesh.uvs),
+            std::as_bytes(mesh.indices)};
+        uint64_t offset = alignUp(sizeof(Header));
+        for (size_t i = 0; i < arrayCount; i++)
+        {
+            header.arrays[i] = {offset, arrays[i].size()};
+            offset = alignUp(offset + arrays[i].size());
+        }
+
+        const auto path = pathOf(sourceHash);
+        const auto temporary = path + ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream out(temporary, std::ios::binary);
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            uint64_t position = sizeof(header);
+            const char padding[alignment] = {};
+            for (size_t i = 0; i < arrayCount; i++)
+            {
+                out.write(padding, header.arrays[i].offset - position);
+                out.write(reinterpret_cast<const char *>(arrays[i].data()), arrays[i].size());
+                position = header.arrays[i].offset + arrays[i].size();
+            }
+            if (!out)
+            {
+                out.close();
+                std::remove(temporary.c_str());
+                return;
+            }
+        }
+        std::filesystem::rename(temporary, path, error);
+        if (error)
+            std::remove(temporary.c_str());
+    }
+
+    // Path of a cache file derived from the given source, such as the mesh itself
+    // (".mesh") or data computed from it.
+    static std::string pathOf(uint64_t sourceHash, const std::string &extension = ".mesh")
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(sourceHash));
+        return (std::filesystem::path(directory) / (name + extension)).string();
+    }
+
+    IndexedMesh view() const
+    {
+        return {
+            array<Point>(0),
+            array<Point>(1),
+            array<TriangleVertex::VertexTexture>(2),
+            array<uint32_t>(3)};
+    }
+
+private:
+    static constexpr char magic[8] = {'R', 'M', 'E', 'S', 'H', 0, 0, 0};
+    static constexpr size_t alignment = 64;
+    static constexpr size_t arrayCount = 4;
+
+    static_assert(std::is_trivially_copyable_v<Point> && sizeof(Point) == 3 * sizeof(float));
+    static_assert(std::is_trivially_copyable_v<TriangleVertex::VertexTexture> && sizeof(TriangleVertex::VertexTexture) == 2 * sizeof(float));
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t sourceHash;
+        uint64_t sourceSize;
+        // Positions, normals, UVs and indices, as byte offsets and sizes.
+        struct
+        {
+            uint64_t offset;
+            uint64_t size;
+        } arrays[arrayCount];
+    };
+
+    static uint64_t alignUp(uint64_t offset)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    explicit MeshCache(std::unique_ptr<MappedFile> _file) : file(std::move(_file)) {}
+
+    template <typename T>
+    std::span<const T> array(size_t i) const
+    {
+        const auto &array = reinterpret_cast<const Header *>(file->data())->arrays[i];
+        return {reinterpret_cast<const T *>(file->data() + array.offset), array.size / sizeof(T)};
+    }
+
+    std::unique_ptr<MappedFile> file;
+};
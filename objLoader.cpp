@@ -1,101 +1,350 @@
 #include <string>
+#include <string_view>
 #include <vector>
-#include <fstream>
-#include <sstream>
 #include <algorithm>
 #include <iostream>
 #include <memory>
-#include <unordered_map>
+#include <chrono>
+#include <charconv>
+#include <cstring>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "common.hpp"
+#include "mappedFile.cpp"
+#include "meshCache.cpp"
+#include "vertexBuffer.cpp"
 
-class Obj
+// Parses the text of an OBJ file. The text is split at line boundaries into chunks that are
+// parsed in parallel, and the per-chunk arrays are then concatenated, offsetting relative
+// indices by the number of elements in the preceding chunks.
+class ObjParser
 {
 public:
-    Obj(std::string path, ColorFunction _colorFunction) : colorFunction(_colorFunction)
+    // One corner of a face. Indices are 0-based, or `missing`.
+    struct Corner
+    {
+        static constexpr int64_t missing = INT64_MIN;
+
+        int64_t v = missing;
+        int64_t vt = missing;
+        int64_t vn = missing;
+    };
+
+    std::vector<Point> vertices;
+    std::vector<TriangleVertex::VertexTexture> vertexTextures;
+    std::vector<Point> normals;
+    // Three corners per triangle; polygons are triangulated as fans.
+    std::vector<Corner> corners;
+
+    ObjParser(const char *text, size_t size)
     {
-        std::unordered_map<size_t, std::vector<size_t>> vertexToFaces;
-        std::unordered_map<size_t, Point> vertexToNormal;
-        std::vector<std::tuple<std::pair<int, int>, std::pair<int, int>, std::pair<int, int>>> f;
+        // Small files are parsed in one piece, the chunks are only there to share the work
+        constexpr size_t minChunkSize = 256 * 1024;
+        size_t chunkCount = std::max<size_t>(1, std::min<size_t>(size / minChunkSize, 4 * maxThreads()));
+
+        std::vector<size_t> bounds(chunkCount + 1, size);
+        bounds[0] = 0;
+        for (size_t i = 1; i < chunkCount; i++)
+        {
+            const char *newline = static_cast<const char *>(std::memchr(text + size * i / chunkCount, '\n', size - size * i / chunkCount));
+            bounds[i] = newline ? std::max<size_t>(newline + 1 - text, bounds[i - 1]) : size;
+        }
 
-        std::ifstream infile(path);
-        for (std::string line; getline(infile, line);)
+        std::vector<Chunk> chunks(chunkCount);
+#pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < chunkCount; i++)
+            chunks[i].parse(text + bounds[i], text + bounds[i + 1]);
+
+        for (const auto &chunk : chunks)
         {
-            std::istringstream ss(line);
-            std::string word;
+            if (!chunk.valid)
+                throw "Invalid Obj file";
+        }
 
-            ss >> word;
+        // Relative indices count back from the end of the chunk prefix, so they need the
+        // number of elements defined before each chunk.
+        std::vector<Chunk::Counts> offsets(chunkCount + 1);
+        for (size_t i = 0; i < chunkCount; i++)
+            offsets[i + 1] = offsets[i] + chunks[i].counts();
+        const auto total = offsets[chunkCount];
 
-            if (word == "v")
+#pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < chunkCount; i++)
+            chunks[i].resolve(offsets[i], total);
+
+        for (const auto &chunk : chunks)
+        {
+            if (!chunk.valid)
+                throw "Invalid Obj file";
+        }
+
+        vertices.reserve(total.vertices);
+        vertexTextures.reserve(total.vertexTextures);
+        normals.reserve(total.normals);
+        corners.reserve(total.corners);
+        for (auto &chunk : chunks)
+        {
+            vertices.insert(vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+            vertexTextures.insert(vertexTextures.end(), chunk.vertexTextures.begin(), chunk.vertexTextures.end());
+            normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+            corners.insert(corners.end(), chunk.corners.begin(), chunk.corners.end());
+        }
+    }
+
+private:
+    static size_t maxThreads()
+    {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    struct Chunk
+    {
+        struct Counts
+        {
+            size_t vertices = 0;
+            size_t vertexTextures = 0;
+            size_t normals = 0;
+            size_t corners = 0;
+
+            Counts operator+(const Counts &other) const
             {
-                ss >> word;
-                float x = std::stof(word);
-                ss >> word;
-                float y = std::stof(word);
-                ss >> word;
-                float z = std::stof(word);
+                return {vertices + other.vertices, vertexTextures + other.vertexTextures, normals + other.normals, corners + other.corners};
+            }
+        };
 
+        std::vector<Point> vertices;
+        std::vector<TriangleVertex::VertexTexture> vertexTextures;
+        std::vector<Point> normals;
+        std::vector<Corner> corners;
+        // Which indices of `corners` are relative to the end of this chunk's prefix (bit 0: v, 1: vt, 2: vn).
+        std::vector<uint8_t> relative;
+        bool valid = true;
+
+        Counts counts() const
+        {
+            return {vertices.size(), vertexTextures.size(), normals.size(), corners.size()};
+        }
+
+        static bool isSpace(char c)
+        {
+            return c == ' ' || c == '\t' || c == '\r';
+        }
+
+        static const char *skipSpaces(const char *p, const char *end)
+        {
+            while (p < end && isSpace(*p))
+                p++;
+            return p;
+        }
+
+        static bool parseFloat(const char *&p, const char *end, float &value)
+        {
+            p = skipSpaces(p, end);
+            if (p < end && *p == '+')
+                p++;
+            auto [next, error] = std::from_chars(p, end, value);
+            if (error != std::errc())
+                return false;
+            p = next;
+            return true;
+        }
+
+        // Parses a 1-based index, or a negative index relative to the current element count.
+        // Returns the 0-based index, counted from the start of this chunk if relative.
+        static bool parseIndex(const char *&p, const char *end, size_t count, int64_t &index, bool &isRelative)
+        {
+            int64_t value;
+            auto [next, error] = std::from_chars(p, end, value);
+            if (error != std::errc() || value == 0)
+                return false;
+            p = next;
+            isRelative = value < 0;
+            index = isRelative ? static_cast<int64_t>(count) + value : value - 1;
+            return true;
+        }
+
+        // Parses `v`, `v/vt`, `v//vn` or `v/vt/vn`.
+        bool parseCorner(const char *&p, const char *end, Corner &corner, uint8_t &relativeBits) const
+        {
+            bool isRelative;
+            relativeBits = 0;
+            if (!parseIndex(p, end, vertices.size(), corner.v, isRelative))
+                return false;
+            relativeBits |= isRelative << 0;
+            if (p == end || *p != '/')
+                return true;
+            p++;
+            if (p < end && *p != '/')
+            {
+                if (!parseIndex(p, end, vertexTextures.size(), corner.vt, isRelative))
+                    return false;
+                relativeBits |= isRelative << 1;
+            }
+            if (p == end || *p != '/')
+                return true;
+            p++;
+            if (!parseIndex(p, end, normals.size(), corner.vn, isRelative))
+                return false;
+            relativeBits |= isRelative << 2;
+            return true;
+        }
+
+        bool parseLine(const char *p, const char *end)
+        {
+            p = skipSpaces(p, end);
+            const char *keyword = p;
+            while (p < end && !isSpace(*p))
+                p++;
+            const std::string_view word(keyword, p - keyword);
+
+            if (word == "v")
+            {
+                float x, y, z;
+                if (!parseFloat(p, end, x) || !parseFloat(p, end, y) || !parseFloat(p, end, z))
+                    return false;
                 vertices.emplace_back(x, y, z);
             }
             else if (word == "vt")
             {
-                ss >> word;
-                float u = std::stof(word);
-                ss >> word;
-                float v = std::stof(word);
-
+                float u, v = 0;
+                if (!parseFloat(p, end, u))
+                    return false;
+                parseFloat(p, end, v);
                 vertexTextures.emplace_back(u, v);
             }
+            else if (word == "vn")
+            {
+                float x, y, z;
+                if (!parseFloat(p, end, x) || !parseFloat(p, end, y) || !parseFloat(p, end, z))
+                    return false;
+                normals.emplace_back(x, y, z);
+            }
             else if (word == "f")
             {
-                ss >> word;
-                auto [v1, vt1] = split(word);
-                ss >> word;
-                auto [v2, vt2] = split(word);
-                ss >> word;
-                auto [v3, vt3] = split(word);
-
-                vertexToFaces[v1 - 1].push_back(f.size());
-                vertexToFaces[v2 - 1].push_back(f.size());
-                vertexToFaces[v3 - 1].push_back(f.size());
-
-                f.emplace_back(std::make_pair(v1 - 1, vt1 - 1), std::make_pair(v2 - 1, vt2 - 1), std::make_pair(v3 - 1, vt3 - 1));
+                Corner first, previous, corner;
+                uint8_t firstBits = 0, previousBits = 0, bits = 0;
+                size_t count = 0;
+                for (p = skipSpaces(p, end); p < end; p = skipSpaces(p, end), count++)
+                {
+                    if (!parseCorner(p, end, corner, bits))
+                        return false;
+                    if (count >= 2)
+                    {
+                        corners.insert(corners.end(), {first, previous, corner});
+                        relative.insert(relative.end(), {firstBits, previousBits, bits});
+                    }
+                    if (count == 0)
+                    {
+                        first = corner;
+                        firstBits = bits;
+                    }
+                    previous = corner;
+                    previousBits = bits;
+                }
+                return count >= 3;
             }
-            else
+            // Groups, objects and materials: every mesh has a single material, set by the caller
+            else if (word == "o" || word == "g" || word == "s" || word == "usemtl" || word == "mtllib")
             {
-                throw "Invalid Obj file";
+                return true;
+            }
+            else if (!word.empty())
+            {
+                return false;
             }
+            return true;
         }
 
-        // set normals
-        for (const auto &[v, fcs] : vertexToFaces)
+        void parse(const char *begin, const char *end)
         {
-            int n = fcs.size();
-            for (const auto &fc : fcs)
+            for (const char *line = begin; line < end && valid;)
             {
-                const auto &v1 = vertices.at(std::get<0>(std::get<0>(f[fc])));
-                const auto &v2 = vertices.at(std::get<0>(std::get<1>(f[fc])));
-                const auto &v3 = vertices.at(std::get<0>(std::get<2>(f[fc])));
-                auto normal = ((v2 - v1) & (v3 - v1)).normal();
+                const char *lineEnd = static_cast<const char *>(std::memchr(line, '\n', end - line));
+                if (!lineEnd)
+                    lineEnd = end;
+                const char *comment = static_cast<const char *>(std::memchr(line, '#', lineEnd - line));
+                valid = parseLine(line, comment ? comment : lineEnd);
+                line = lineEnd + 1;
+            }
+        }
 
-                vertexToNormal[v] += normal / n;
+        // Makes relative indices absolute, given the element counts before this chunk, and checks the bounds.
+        void resolve(const Counts &offset, const Counts &total)
+        {
+            auto fix = [&](int64_t &index, bool isRelative, size_t offset, size_t total)
+            {
+                if (index == Corner::missing)
+                    return;
+                if (isRelative)
+                    index += offset;
+                if (index < 0 || index >= static_cast<int64_t>(total))
+                    valid = false;
+            };
+            for (size_t i = 0; i < corners.size(); i++)
+            {
+                fix(corners[i].v, relative[i] & 1, offset.vertices, total.vertices);
+                fix(corners[i].vt, relative[i] & 2, offset.vertexTextures, total.vertexTextures);
+                fix(corners[i].vn, relative[i] & 4, offset.normals, total.normals);
             }
         }
+    };
+};
+
+class Obj
+{
+public:
+    struct LoadStatistics
+    {
+        size_t bytes = 0;
+        double seconds = 0;
+        bool cached = false;
 
-        for (const auto &fc : f)
+        double megabytesPerSecond() const
         {
-            const auto &[vp1, vp2, vp3] = fc;
-            const auto &[v1, vt1] = vp1;
-            const auto &[v2, vt2] = vp2;
-            const auto &[v3, vt3] = vp3;
-            triangles.emplace_back(
-                TriangleVertex{vertices.at(v1), vertexTextures.at(vt1), vertexToNormal.at(v1)},
-                TriangleVertex{vertices.at(v2), vertexTextures.at(vt2), vertexToNormal.at(v2)}, TriangleVertex{vertices.at(v3), vertexTextures.at(vt3), vertexToNormal.at(v3)}, colorFunction);
+            return seconds > 0 ? bytes / seconds / 1e6 : 0;
         }
+    };
+
+    // Loads the mesh from the cache when `cached` is set and the cache has a copy of this
+    // file, and otherwise parses it and writes it to the cache.
+    Obj(std::string path, MaterialId _material, bool cached = true) : material(_material)
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        MappedFile file(path);
+        const auto hash = MeshCache::hash(file.data(), file.size());
+        if (cached)
+            cache = MeshCache::open(hash, file.size());
+
+        if (cache)
+        {
+            mesh = cache->view();
+        }
+        else
+        {
+            buffers = toIndexedMesh(ObjParser(file.data(), file.size()));
+            mesh = buffers.view();
+            if (cached)
+                MeshCache::write(hash, file.size(), mesh);
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        loadStatistics = {file.size(), elapsed.count(), cache.has_value()};
+        if (cached)
+            cacheKey = hash;
     }
 
-    Obj
-    setDisplacement(float x, float y, float z)
+    Obj(const Obj &) = delete;
+    Obj &operator=(const Obj &) = delete;
+
+    Obj &setDisplacement(float x, float y, float z)
     {
         displacement = {x, y, z};
         return *this;
@@ -106,7 +355,7 @@ public:
         return displacement;
     }
 
-    Obj setRotation(float x, float y, float z)
+    Obj &setRotation(float x, float y, float z)
     {
         rotationX = x;
         rotationY = y;
@@ -123,40 +372,133 @@ public:
         };
     }
 
-    std::vector<Triangle>
-    getTriangles() const
+    Obj &setScale(float x, float y, float z)
     {
-        std::vector<Triangle> output;
-        std::transform(triangles.begin(), triangles.end(), std::back_inserter(output), [&](auto &triangle)
-                       { return triangle.rotate(rotationX, rotationY, rotationZ) + displacement; });
-        return output;
+        scale = {x, y, z};
+        return *this;
     }
 
-private:
-    ColorFunction colorFunction;
-    std::vector<Point>
-        vertices;
-    std::vector<TriangleVertex::VertexTexture> vertexTextures;
-    std::vector<Triangle> triangles;
+    Transform getTransform() const
+    {
+        return Transform::translation(displacement) * Transform::rotation(rotationX, rotationY, rotationZ) * Transform::scale(scale);
+    }
 
-    Point displacement = {0, 0, 0};
-    float rotationX = 0;
-    float rotationY = 0;
-    float rotationZ = 0;
+    // Size of the file and time spent reading and parsing it.
+    const LoadStatistics &getLoadStatistics() const
+    {
+        return loadStatistics;
+    }
 
-    std::pair<int, int> split(std::string inp)
+    // Hash of the source file, under which data derived from this mesh can be cached.
+    // Empty if the mesh was loaded with the cache disabled.
+    std::optional<uint64_t> getCacheKey() const
     {
-        int v1;
-        int v2;
+        return cacheKey;
+    }
 
-        std::stringstream ss(inp);
+    MaterialId getMaterial() const
+    {
+        return material;
+    }
 
-        std::string segment;
-        std::getline(ss, segment, '/');
-        v1 = stoi(segment);
-        std::getline(ss, segment, '/');
-        v2 = stoi(segment);
+    // Mesh in object space, ignoring the displacement and the rotation.
+    const IndexedMesh &getMesh() const
+    {
+        return mesh;
+    }
 
-        return {v1, v2};
+    // Vertices in world space, with the current displacement, rotation and scale. Every
+    // shared vertex is transformed once, by the SIMD kernels. The first call copies the
+    // object space vertices to the layout of the kernels, which the renderer never needs.
+    TransformedVertices getWorldVertices() const
+    {
+        if (objectPositions.size() != mesh.vertexCount())
+        {
+            objectPositions = SoaVertices(mesh.positions);
+            objectNormals = SoaVertices(mesh.normals);
+        }
+        const auto transform = getTransform();
+        TransformedVertices vertices;
+        TransformKernels::apply(transform, objectPositions, vertices.positions, true);
+        TransformKernels::apply(transform.normalTransform(), objectNormals, vertices.normals, false);
+        return vertices;
     }
+
+private:
+    // Merges the corners of the parsed faces that have the same position, texture coordinates
+    // and normal into shared vertices. Corners without texture coordinates get (0, 0), and
+    // corners without a normal get the average of the normals of the faces around their position.
+    static MeshBuffers toIndexedMesh(ObjParser &&obj)
+    {
+        using Corner = ObjParser::Corner;
+        if (obj.corners.size() > UINT32_MAX)
+            throw "Obj file too large";
+
+        // Vertex normals are the average of the normals of the faces around the vertex
+        std::vector<Point> vertexNormals;
+        bool needsVertexNormals = std::any_of(obj.corners.begin(), obj.corners.end(), [](const Corner &corner)
+                                              { return corner.vn == Corner::missing; });
+        if (needsVertexNormals)
+        {
+            std::vector<size_t> faceCounts(obj.vertices.size(), 0);
+            for (const auto &corner : obj.corners)
+                faceCounts[corner.v]++;
+            vertexNormals.resize(obj.vertices.size());
+            for (size_t i = 0; i < obj.corners.size(); i += 3)
+            {
+                const auto &v1 = obj.vertices[obj.corners[i].v];
+                const auto &v2 = obj.vertices[obj.corners[i + 1].v];
+                const auto &v3 = obj.vertices[obj.corners[i + 2].v];
+                auto normal = ((v2 - v1) & (v3 - v1)).normal();
+                for (size_t j = i; j < i + 3; j++)
+                    vertexNormals[obj.corners[j].v] += normal / faceCounts[obj.corners[j].v];
+            }
+        }
+
+        // Shared vertices are found by walking, for each position, the list of the
+        // vertices already created at that position. These lists are short in practice.
+        constexpr uint32_t none = UINT32_MAX;
+        std::vector<uint32_t> firstAtPosition(obj.vertices.size(), none);
+        std::vector<uint32_t> nextAtPosition;
+        std::vector<Corner> keys;
+
+        MeshBuffers mesh;
+        mesh.indices.reserve(obj.corners.size());
+        for (const auto &corner : obj.corners)
+        {
+            uint32_t vertex = firstAtPosition[corner.v];
+            while (vertex != none && (keys[vertex].vt != corner.vt || keys[vertex].vn != corner.vn))
+                vertex = nextAtPosition[vertex];
+            if (vertex == none)
+            {
+                vertex = keys.size();
+                keys.push_back(corner);
+                nextAtPosition.push_back(firstAtPosition[corner.v]);
+                firstAtPosition[corner.v] = vertex;
+                mesh.positions.push_back(obj.vertices[corner.v]);
+                mesh.normals.push_back(corner.vn != Corner::missing ? obj.normals[corner.vn] : vertexNormals[corner.v]);
+                mesh.uvs.push_back(corner.vt != Corner::missing ? obj.vertexTextures[corner.vt] : TriangleVertex::VertexTexture{0, 0});
+            }
+            mesh.indices.push_back(vertex);
+        }
+        return mesh;
+    }
+
+    MaterialId material;
+    // The mesh points either into the cache file or into the buffers
+    std::optional<MeshCache> cache;
+    MeshBuffers buffers;
+    IndexedMesh mesh;
+    // Copies of the positions and normals for the transform kernels, made on the first
+    // call to getWorldVertices()
+    mutable SoaVertices objectPositions;
+    mutable SoaVertices objectNormals;
+
+    Point displacement = {0, 0, 0};
+    float rotationX = 0;
+    float rotationY = 0;
+    float rotationZ = 0;
+    Point scale = {1, 1, 1};
+    LoadStatistics loadStatistics;
+    std::optional<uint64_t> cacheKey;
 };
\ No newline at end of file
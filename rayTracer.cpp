@@ -1,78 +1,1019 @@
+#pragma once
 
 #include <vector>
-#include <execution>
+#include <functional>
+#include <bit>
+#include <chrono>
+#include <optional>
+#include <numeric>
+#include <memory>
 
-#include "objLoader.cpp"
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/partitioner.h>
+#include <tbb/parallel_reduce.h>
+
+#include "scene.cpp"
+#include "framebuffer.cpp"
+#include "sampling.cpp"
+#include "traversalStatistics.cpp"
+#include "bvh/morton.hpp"
 #include "common.hpp"
 
+// Everything needed to trace paths through a scene. It is built once per render
+// and shared by reference between all the threads, so that nothing is copied
+// when a path bounces.
+struct RenderContext
+{
+    using PrimitiveIntersector = bvh::ClosestPrimitiveIntersector<Bvh, Instance>;
+    using OcclusionIntersector = bvh::AnyPrimitiveIntersector<Bvh, Instance>;
+    using Traverser = bvh::SingleRayTraverser<Bvh>;
+
+    // Upper bound on the number of bounces of a path, on top of the limits of the materials.
+    static constexpr int maxDepth = 8;
+
+    // Primary rays are the axes of cones that widen by pixelSpread per unit of distance.
+    RenderContext(const Scene &scene, float _pixelSpread = 0)
+        : bvh(scene.getBvh()), instances(scene.getInstances()), materials(scene.getMaterials()), lights(scene.getLights()), ambient(scene.ambient), pixelSpread(_pixelSpread),
+          maxPendingRays(pendingRayBudget(materials)), primitiveIntersector(bvh, instances.data()), occlusionIntersector(bvh, instances.data()), traverser(bvh)
+    {
+    }
+
+    // Paths are traced depth-first, so a ray that scatters n rays leaves n - 1 of them on
+    // the stack while the first one is followed. The stack never holds more than the
+    // largest n - 1 of every depth, plus the ray being pushed.
+    static size_t pendingRayBudget(const std::vector<Material> &materials)
+    {
+        size_t budget = 1;
+        for (int depth = 0; depth < maxDepth; depth++)
+        {
+            int rays = 1;
+            for (const auto &material : materials)
+                rays = std::max(rays, std::visit([&](const auto &m)
+                                                 { return m.scatteredRays(depth); },
+                                                 material));
+            budget += rays - 1;
+        }
+        return budget;
+    }
+
+    // Whether anything lies on the ray before the given distance. The traversal stops at
+    // the first hit it finds, and does not compute any hit information.
+    bool occluded(const Ray &ray, float distance) const
+    {
+        BvhRay bvhRay = ray;
+        bvhRay.tmax = std::min(bvhRay.tmax, distance - bvhRay.tmin);
+        return traverser.traverse(bvhRay, occlusionIntersector).has_value();
+    }
+
+    const Bvh &bvh;
+    const std::vector<Instance> &instances;
+    const std::vector<Material> &materials;
+    const std::vector<Light> &lights;
+    Rgb ambient;
+    float pixelSpread;
+    // Capacity that the stack of pending rays of a path needs, so that no ray is dropped.
+    size_t maxPendingRays;
+    PrimitiveIntersector primitiveIntersector;
+    OcclusionIntersector occlusionIntersector;
+    Traverser traverser;
+};
+
+// Closest-hit intersector for the top-level BVH that also counts the steps of the
+// traversals of the meshes, for RayTracer::renderStatistics().
+struct CountingPrimitiveIntersector : RenderContext::PrimitiveIntersector
+{
+    CountingPrimitiveIntersector(const RenderContext &context, Mesh::Statistics &_meshStatistics)
+        : RenderContext::PrimitiveIntersector(context.bvh, context.instances.data()), meshStatistics(_meshStatistics) {}
+
+    std::optional<Result> intersect(size_t index, const BvhRay &ray) const
+    {
+        auto [instance, i] = primitive_at(index);
+        if (auto hit = instance.intersect(ray, meshStatistics))
+            return std::make_optional(Result{i, *hit});
+        return std::nullopt;
+    }
+
+    Mesh::Statistics &meshStatistics;
+};
+
+// Traversal kernels for packets of primary rays. Each width is compiled for the
+// instruction set whose registers hold a whole packet, with everything it calls
+// inlined into it, and the widest one the CPU supports is picked at run time.
+// Arguments are passed by reference, so that vector types never cross the
+// boundary between two targets in registers.
+struct PacketKernels
+{
+    template <size_t N>
+    using Packet = bvh::RayPacket<BvhScalar, N>;
+    template <size_t N>
+    using Mask = typename Packet<N>::Mask;
+    template <size_t N>
+    using Result = typename bvh::ClosestPacketIntersector<Bvh, Instance, N>::Result;
+
+    template <size_t N>
+    using Kernel = void (*)(const RenderContext &, const Packet<N> &, const Mask<N> &, Result<N> &);
+
+    __attribute__((flatten)) static void trace4(const RenderContext &context, const Packet<4> &packet, const Mask<4> &active, Result<4> &result)
+    {
+        trace(context, packet, active, result);
+    }
+
+    __attribute__((target("avx2,fma"), flatten)) static void trace8(const RenderContext &context, const Packet<8> &packet, const Mask<8> &active, Result<8> &result)
+    {
+        trace(context, packet, active, result);
+    }
+
+    __attribute__((target("avx512f"), flatten)) static void trace16(const RenderContext &context, const Packet<16> &packet, const Mask<16> &active, Result<16> &result)
+    {
+        trace(context, packet, active, result);
+    }
+
+    // Widest packet the CPU can trace in one register per component.
+    static int nativeWidth()
+    {
+        if (__builtin_cpu_supports("avx512f"))
+            return 16;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return 8;
+        return 4;
+    }
+
+private:
+    template <size_t N>
+    static void trace(const RenderContext &context, const Packet<N> &packet, const Mask<N> &active, Result<N> &result)
+    {
+        bvh::ClosestPacketIntersector<Bvh, Instance, N> intersector(context.bvh, context.instances.data());
+        bvh::PacketTraverser<Bvh, N> traverser(context.bvh);
+        result = traverser.traverse(packet, active, intersector);
+    }
+};
+
+// Scratch memory of the thread that traces a path. It lives on the stack of the
+// worker, and holds the rays that still have to be traced along with their weight.
+// Scenes whose materials scatter more rays than fit on the stack get a buffer on the heap.
+class PathScratch
+{
+public:
+    struct PendingRay
+    {
+        Ray ray;
+        int depth;
+        float weight;
+    };
+
+    explicit PathScratch(size_t capacity)
+    {
+        if (capacity > inlineCapacity)
+        {
+            heapRays = std::make_unique<PendingRay[]>(capacity);
+            pendingRays = heapRays.get();
+        }
+    }
+
+    void push(const PendingRay &pending)
+    {
+        pendingRays[size++] = pending;
+    }
+
+    PendingRay pop()
+    {
+        return pendingRays[--size];
+    }
+
+    bool empty() const
+    {
+        return size == 0;
+    }
+
+private:
+    static constexpr size_t inlineCapacity = 64;
+
+    PendingRay inlineRays[inlineCapacity];
+    std::unique_ptr<PendingRay[]> heapRays;
+    PendingRay *pendingRays = inlineRays;
+    size_t size = 0;
+};
+
+// Shadow rays of the paths of a tile. They are queued while the paths are traced, and
+// traced together once the whole tile is done (see RayTracer::traceShadows()).
+struct ShadowQueue
+{
+    struct Query
+    {
+        Ray ray;
+        float distance;
+        uint32_t light;
+        // Position of the pixel in the tile.
+        uint32_t pixel;
+        // Added to the pixel if the ray reaches the light.
+        Rgb contribution;
+    };
+
+    std::vector<Query> queries;
+};
+
+// Rays of one bounce of the paths of a tile, in wavefront mode, as a structure of arrays:
+// each ray comes with the pixel of its path, and its depth and weight in the path.
+struct RayQueue
+{
+    std::vector<Ray> rays;
+    std::vector<uint32_t> pixels;
+    std::vector<int> depths;
+    std::vector<float> weights;
+
+    size_t size() const
+    {
+        return rays.size();
+    }
+
+    void push(const Ray &ray, uint32_t pixel, int depth, float weight)
+    {
+        rays.push_back(ray);
+        pixels.push_back(pixel);
+        depths.push_back(depth);
+        weights.push_back(weight);
+    }
+
+    void clear()
+    {
+        rays.clear();
+        pixels.clear();
+        depths.clear();
+        weights.clear();
+    }
+
+    // Reorders the rays by increasing key.
+    void sort(const std::vector<uint64_t> &keys)
+    {
+        std::vector<uint32_t> order(size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+                  { return keys[a] < keys[b]; });
+        RayQueue sorted;
+        for (auto i : order)
+            sorted.push(rays[i], pixels[i], depths[i], weights[i]);
+        std::swap(*this, sorted);
+    }
+};
+
+// Accumulates the contributions of every ray of a path. Colors are converted from
+// sRGB to linear and weighted by the fraction of the path that produced them, and
+// dropped rays are excluded from the average. Materials draw their random numbers
+// from the sampler of the path. Scattered rays are pushed to `Pending`, which is the
+// stack of the thread when paths are traced depth-first, and the queue of the next
+// bounce in wavefront mode.
+template <typename Pending = PathScratch>
+class PathAccumulator
+{
+public:
+    PathAccumulator(const RenderContext &_context, Pending &_pending, Sampler &_sampler, ShadowQueue &_shadows, uint32_t _pixel)
+        : context(_context), pending(_pending), samplerRef(_sampler), shadows(_shadows), pixel(_pixel), firstShadow(_shadows.queries.size()) {}
+
+    Sampler &sampler()
+    {
+        return samplerRef;
+    }
+
+    void setCurrent(int depth, float weight)
+    {
+        currentDepth = depth;
+        currentWeight = weight;
+    }
+
+    void emit(const Color &color)
+    {
+        emit(Srgb::toLinear(color));
+    }
+
+    void emit(const Rgb &color)
+    {
+        r += color.r * currentWeight;
+        g += color.g * currentWeight;
+        b += color.b * currentWeight;
+        validWeight += currentWeight;
+    }
+
+    // Ends the path on a diffuse surface of the given color. Without lights in the scene,
+    // the color is emitted as is. Otherwise, the surface reflects the ambient light, and
+    // the light that reaches it from each light source, which is queued as a shadow ray.
+    // Light intensities include the 1/pi of the diffuse BRDF.
+    void diffuse(const Ray &ray, const SurfaceHit &hit, const Color &color)
+    {
+        diffuse(ray, hit, Srgb::toLinear(color));
+    }
+
+    void diffuse(const Ray &ray, const SurfaceHit &hit, const Rgb &albedo)
+    {
+        if (context.lights.empty())
+            return emit(albedo);
+
+        emit(albedo * context.ambient);
+        Point normal = hit.normal.normal();
+        if (normal * ray.unitDir > 0)
+            normal = normal * -1;
+        for (uint32_t light = 0; light < context.lights.size(); light++)
+        {
+            const auto sample = std::visit([&](const auto &source)
+                                           { return source.sample(hit.position, samplerRef); },
+                                           context.lights[light]);
+            const float cosine = normal * sample.direction;
+            if (cosine > 0)
+                shadows.queries.push_back({Ray{hit.position, sample.direction}, sample.distance, light, pixel, albedo * sample.radiance * (cosine * currentWeight)});
+        }
+    }
+
+    void scatter(const Ray &ray, float weight)
+    {
+        if (currentDepth < RenderContext::maxDepth)
+            pending.push({ray, currentDepth + 1, currentWeight * weight});
+    }
+
+    // Average of the valid rays, or an invalid sample if they were all dropped.
+    Sample result() const
+    {
+        if (validWeight <= 0)
+            return {};
+        return {r / validWeight, g / validWeight, b / validWeight, 1};
+    }
+
+    // Factor from the sums of the path to its average, which also applies to its shadow rays.
+    float normalization() const
+    {
+        return validWeight > 0 ? 1 / validWeight : 0;
+    }
+
+    // Result of a path traced on its own: its shadow rays are the last ones of the queue.
+    Sample finish()
+    {
+        for (size_t i = firstShadow; i < shadows.queries.size(); i++)
+            shadows.queries[i].contribution = shadows.queries[i].contribution * normalization();
+        return result();
+    }
+
+private:
+    const RenderContext &context;
+    Pending &pending;
+    Sampler &samplerRef;
+    ShadowQueue &shadows;
+    uint32_t pixel;
+    size_t firstShadow;
+    int currentDepth = 0;
+    float currentWeight = 1;
+
+    float r = 0;
+    float g = 0;
+    float b = 0;
+    float validWeight = 0;
+};
+
+// Scattered rays of one path in wavefront mode, which go to the queue of the next bounce.
+struct QueueSink
+{
+    RayQueue *queue;
+    uint32_t pixel;
+
+    void push(const PathScratch::PendingRay &pending)
+    {
+        queue->push(pending.ray, pixel, pending.depth, pending.weight);
+    }
+};
+
+// Rectangular block of pixels, rendered as one unit of work.
+struct Tile
+{
+    int x;
+    int y;
+    int width;
+    int height;
+    // Pixels of the tile, in row-major order.
+    std::vector<Sample> samples = {};
+    // Pixels to render, in the same order, or empty to render all of them. The samples
+    // of the other pixels are left invalid and must not be accumulated.
+    std::vector<uint8_t> active = {};
+    // Progressive pass the samples belong to. Primary rays go through the corner of
+    // their pixel in single-pass renders, and through a random point of it otherwise.
+    std::optional<uint32_t> pass = {};
+
+    bool isActive(int x, int y) const
+    {
+        return active.empty() || active[y * width + x];
+    }
+};
+
+// Settings of progressive renders. Every pixel gets at least minSamples samples; after
+// that, only the pixels whose relative error is above the target keep receiving samples,
+// up to maxSamples. The render also stops before starting a pass that would exceed the
+// time budget, if there is one.
+struct ProgressiveSettings
+{
+    int minSamples = 4;
+    int maxSamples = 64;
+    float targetError = 0.02f;
+    // In seconds, or 0 for no limit.
+    double timeBudget = 0;
+};
+
+struct ProgressiveStatistics
+{
+    int passes = 0;
+    size_t samples = 0;
+    double seconds = 0;
+    // Pixels that would have received more samples, and largest error of a tile.
+    size_t noisyPixels = 0;
+    float maxTileError = 0;
+};
+
+// Called once per finished tile, from the thread that rendered it.
+// Tiles can be delivered concurrently and in any order.
+using TileCallback = std::function<void(const Tile &)>;
+
 class RayTracer
 {
 public:
     RayTracer(Point _origin, Point _dir, int _h, int _w) : origin(_origin), dir(_dir), h(_h), w(_w) {}
 
-    void addTriangles(const std::vector<Triangle> &_triangles)
+    int getWidth() const
     {
-        triangles.insert(triangles.begin(), _triangles.begin(), _triangles.end());
+        return w;
     }
 
-    std::vector<Color> render() const
+    int getHeight() const
     {
-        auto rays = generateRays();
+        return h;
+    }
 
-        std::vector<BvhTriangle> bvhTriangles(triangles.size());
-        std::vector<Color> colors(rays.size());
+    // Width and height of the tiles, in pixels.
+    int tileSize = 32;
+    // Number of primary rays traced together: 4, 8 or 16, or 1 to trace every ray on
+    // its own. Widths the CPU does not support are narrowed. 16-wide packets cover
+    // 4x4 pixels, and lose more lanes to divergence than they gain from AVX-512 on
+    // the spot scene (see `make packets`), so 8 is the default.
+    int packetWidth = 8;
 
-        std::transform(triangles.begin(), triangles.end(), bvhTriangles.begin(), [&](const auto &triangle)
-                       { return BvhTriangle(triangle.v1.v, triangle.v2.v, triangle.v3.v); });
+    enum class TraceMode
+    {
+        // Every path is traced to the end before the next one starts.
+        DepthFirst,
+        // All the rays of one bounce of a tile are traced, then shaded material by
+        // material, before the next bounce (see renderTileWavefront()).
+        Wavefront
+    };
+    TraceMode traceMode = TraceMode::DepthFirst;
+    // Random numbers of the jitter and of the materials. They only depend on the pixel,
+    // the progressive pass and the frame index, so renders are reproducible whatever
+    // the number of threads.
+    SampleSequence sampleSequence = SampleSequence::Sobol;
+    uint32_t frame = 0;
 
-        auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(bvhTriangles.data(), bvhTriangles.size());
-        auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), bvhTriangles.size());
+    Framebuffer render(const Scene &scene) const
+    {
+        Framebuffer framebuffer(w, h);
+        render(scene, framebuffer);
+        return framebuffer;
+    }
 
-        Bvh bvh;
-        bvh::SweepSahBuilder<Bvh> builder(bvh);
-        builder.build(global_bbox, bboxes.get(), centers.get(), bvhTriangles.size());
+    // Adds one sample per pixel to the framebuffer, which must be as large as the image.
+    void render(const Scene &scene, Framebuffer &framebuffer) const
+    {
+        render(scene, [&](const Tile &tile)
+               {
+                   accumulate(tile, framebuffer); });
+    }
 
-        bvh::ClosestPrimitiveIntersector<Bvh, BvhTriangle> primitive_intersector(bvh, bvhTriangles.data());
-        bvh::SingleRayTraverser<Bvh> traverser(bvh);
+    // Renders the image tile by tile. Tiles are handed out to the TBB work-stealing
+    // scheduler, and each one is passed to the callback as soon as it is done.
+    void render(const Scene &scene, const TileCallback &onTile) const
+    {
+        renderTiles(RenderContext(scene, pixelSpread()), tileOrder(), onTile);
+    }
 
-        std::function<Color(Ray, int)> fr = [&](Ray ray, int depth)
-        { return getRayColor(ray, depth, primitive_intersector, traverser, fr); };
+    // Adds jittered samples to the framebuffer, pass after pass, until every pixel is
+    // below the target error or has the maximum number of samples, or the time budget is
+    // spent. After the first minSamples passes, the error of every pixel is estimated from
+    // its samples, and the next passes only cover the noisy pixels of the noisy tiles.
+    // Samples already in the framebuffer count towards the limits, so that the render of
+    // a still scene can be resumed.
+    ProgressiveStatistics renderProgressive(const Scene &scene, Framebuffer &framebuffer, const ProgressiveSettings &settings) const
+    {
+        const auto start = std::chrono::steady_clock::now();
+        auto elapsed = [&]
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        };
+
+        const RenderContext context(scene, pixelSpread());
+        ProgressiveStatistics statistics;
+        auto tiles = tileOrder();
+        double lastPassSeconds = 0;
+        size_t lastPassSamples = 0;
+        while (!tiles.empty())
+        {
+            const size_t passSamples = activePixels(tiles);
+            // Extrapolated from the previous pass, which had as many or more pixels
+            if (settings.timeBudget > 0 && statistics.passes > 0 &&
+                elapsed() + lastPassSeconds * passSamples / lastPassSamples > settings.timeBudget)
+                break;
+
+            const double passStart = elapsed();
+            for (auto &tile : tiles)
+                tile.pass = framebuffer.passes;
+            renderTiles(context, tiles, [&](const Tile &tile)
+                        { accumulate(tile, framebuffer); });
+            framebuffer.passes++;
+            statistics.passes++;
+            statistics.samples += passSamples;
+            lastPassSeconds = elapsed() - passStart;
+            lastPassSamples = passSamples;
 
-        std::transform(std::execution::par_unseq, rays.begin(), rays.end(), colors.begin(), [&](auto &ray)
-                       { return fr(ray, 0); });
+            tiles = noisyTiles(tiles, framebuffer, settings, statistics);
+        }
+        statistics.seconds = elapsed();
+        return statistics;
+    }
 
-        return colors;
+    // Diagnostic render: traces the primary ray through the corner of every pixel, as the
+    // first pass of render() does, and records the cost of its traversal instead of
+    // shading it. Secondary and shadow rays are not traced.
+    TraversalStatistics renderStatistics(const Scene &scene) const
+    {
+        const RenderContext context(scene, pixelSpread());
+        TraversalStatistics statistics(w, h);
+        const auto tiles = tileOrder();
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, tiles.size(), 1), [&](const tbb::blocked_range<size_t> &range)
+            {
+                for (size_t idx = range.begin(); idx != range.end(); idx++)
+                {
+                    const auto &tile = tiles[idx];
+                    for (int i = tile.y; i < tile.y + tile.height; i++)
+                    {
+                        for (int j = tile.x; j < tile.x + tile.width; j++)
+                        {
+                            RenderContext::Traverser::Statistics topLevel;
+                            Mesh::Statistics meshes;
+                            CountingPrimitiveIntersector intersector(context, meshes);
+                            context.traverser.traverse(primaryRay(i, j), intersector, topLevel);
+                            statistics.set(j, i, TraversalStatistics::Counter::TraversalSteps, topLevel.traversal_steps + meshes.traversal_steps);
+                            statistics.set(j, i, TraversalStatistics::Counter::InstanceTests, topLevel.intersections);
+                            statistics.set(j, i, TraversalStatistics::Counter::TriangleTests, meshes.intersections);
+                        }
+                    }
+                }
+            },
+            tbb::simple_partitioner());
+        return statistics;
     }
 
 private:
-    Color getRayColor(Ray ray, int depth, bvh::ClosestPrimitiveIntersector<Bvh, BvhTriangle> primitive_intersector, bvh::SingleRayTraverser<Bvh> traverser, std::function<Color(Ray, int)> rec) const
+    using Hit = RenderContext::PrimitiveIntersector::Result;
+
+    void renderTiles(const RenderContext &context, const std::vector<Tile> &tiles, const TileCallback &onTile) const
     {
-        auto hit = traverser.traverse(ray, primitive_intersector);
+        const int width = packetWidth == 1 ? 1 : std::min(packetWidth, PacketKernels::nativeWidth());
 
-        if (hit)
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, tiles.size(), 1), [&](const tbb::blocked_range<size_t> &range)
+            {
+                for (size_t idx = range.begin(); idx != range.end(); idx++)
+                {
+                    auto tile = tiles[idx];
+                    renderTile(context, tile, width);
+                    onTile(tile);
+                }
+            },
+            tbb::simple_partitioner());
+    }
+
+    static void accumulate(const Tile &tile, Framebuffer &framebuffer)
+    {
+        for (int y = 0; y < tile.height; y++)
         {
-            return triangles.at(hit->primitive_index).intersect(ray, triangles, depth, hit->intersection.distance(), hit->intersection.u, hit->intersection.v, rec);
+            for (int x = 0; x < tile.width; x++)
+            {
+                if (tile.isActive(x, y))
+                    framebuffer.add(tile.x + x, tile.y + y, tile.samples[y * tile.width + x]);
+            }
         }
+    }
+
+    static size_t activePixels(const std::vector<Tile> &tiles)
+    {
+        size_t count = 0;
+        for (const auto &tile : tiles)
+            count += tile.active.empty() ? tile.width * tile.height : std::count(tile.active.begin(), tile.active.end(), 1);
+        return count;
+    }
+
+    // Tiles of the next progressive pass, with their pixels that need more samples.
+    // Updates the error statistics.
+    static std::vector<Tile> noisyTiles(const std::vector<Tile> &tiles, const Framebuffer &framebuffer, const ProgressiveSettings &settings, ProgressiveStatistics &statistics)
+    {
+        // A maximum below the minimum, as with --samples 1, wins
+        const int minSamples = std::min(settings.minSamples, settings.maxSamples);
+        std::vector<Tile> next(tiles.size());
+        std::vector<float> errors(tiles.size());
+        tbb::parallel_for(size_t(0), tiles.size(), [&](size_t idx)
+                          {
+                              const auto &tile = tiles[idx];
+                              Tile noisy{.x = tile.x, .y = tile.y, .width = tile.width, .height = tile.height, .active = std::vector<uint8_t>(tile.width * tile.height)};
+                              bool any = false;
+                              for (int y = 0; y < tile.height; y++)
+                              {
+                                  for (int x = 0; x < tile.width; x++)
+                                  {
+                                      const int samples = framebuffer.sampleCount(tile.x + x, tile.y + y);
+                                      const float error = framebuffer.relativeError(tile.x + x, tile.y + y);
+                                      if (samples >= minSamples)
+                                          errors[idx] = std::max(errors[idx], error);
+                                      const bool active = samples < minSamples || (error > settings.targetError && samples < settings.maxSamples);
+                                      noisy.active[y * tile.width + x] = active;
+                                      any |= active;
+                                  }
+                              }
+                              if (any)
+                                  next[idx] = std::move(noisy); });
+
+        std::vector<Tile> result;
+        for (auto &tile : next)
+        {
+            if (!tile.active.empty())
+                result.push_back(std::move(tile));
+        }
+        statistics.maxTileError = *std::max_element(errors.begin(), errors.end());
+        statistics.noisyPixels = activePixels(result);
+        return result;
+    }
 
+    // Traces a path and all its secondary rays iteratively, depth-first.
+    static Sample tracePath(const RenderContext &context, const Ray &primaryRay, Sampler &sampler, ShadowQueue &shadows, uint32_t pixel)
+    {
+        return tracePath(context, primaryRay, context.traverser.traverse(primaryRay, context.primitiveIntersector), sampler, shadows, pixel);
+    }
+
+    // Same as above, when the primary ray has already been traced.
+    static Sample tracePath(const RenderContext &context, const Ray &primaryRay, const std::optional<Hit> &primaryHit, Sampler &sampler, ShadowQueue &shadows, uint32_t pixel)
+    {
+        PathScratch scratch(context.maxPendingRays);
+        PathAccumulator path(context, scratch, sampler, shadows, pixel);
+        shade(context, primaryRay, primaryHit, 0, path);
+
+        while (!scratch.empty())
+        {
+            const auto [ray, depth, weight] = scratch.pop();
+            path.setCurrent(depth, weight);
+            shade(context, ray, context.traverser.traverse(ray, context.primitiveIntersector), depth, path);
+        }
+
+        return path.finish();
+    }
+
+    template <typename Path>
+    static void shade(const RenderContext &context, const Ray &ray, const std::optional<Hit> &hit, int depth, Path &path)
+    {
+        if (!hit)
+        {
+            path.emit(skyColor(ray));
+            return;
+        }
+
+        const auto surface = context.instances[hit->primitive_index].getSurface(hit->intersection, ray, context.pixelSpread);
+        std::visit([&](const auto &material)
+                   { material.shade(ray, surface, depth, path); },
+                   context.materials[surface.material]);
+    }
+
+    static Color skyColor(const Ray &ray)
+    {
         return Color{static_cast<int>(255 * ray.unitDir.y * 0.5f + 255 * 0.5f), static_cast<int>(255 * 0.7f + ray.unitDir.y * 255 * 0.3f), 255};
     }
 
-    std::vector<Ray> generateRays() const
+    // Pixels are traced in Morton order, so that consecutive rays stay close
+    // together and hit the same parts of the BVH. Shadow rays are traced last.
+    void renderTile(const RenderContext &context, Tile &tile, int width) const
+    {
+        tile.samples.resize(tile.width * tile.height);
+        ShadowQueue shadows;
+        if (traceMode == TraceMode::Wavefront)
+        {
+            renderTileWavefront(context, tile, shadows, width);
+            traceShadows(context, shadows, tile);
+            return;
+        }
+        switch (width)
+        {
+        case 16:
+            renderTile<16>(context, tile, shadows, PacketKernels::trace16);
+            break;
+        case 8:
+            renderTile<8>(context, tile, shadows, PacketKernels::trace8);
+            break;
+        case 4:
+            renderTile<4>(context, tile, shadows, PacketKernels::trace4);
+            break;
+        default:
+            renderTile(context, tile, shadows);
+        }
+        traceShadows(context, shadows, tile);
+    }
+
+    // Traces the shadow rays of a tile light by light: the rays of one light start from
+    // neighbouring points, in Morton order, and go the same way, so they visit the same
+    // nodes of the BVH one after the other. Occlusion rays only need to find any hit.
+    static void traceShadows(const RenderContext &context, ShadowQueue &shadows, Tile &tile)
+    {
+        std::stable_sort(shadows.queries.begin(), shadows.queries.end(), [](const auto &a, const auto &b)
+                         { return a.light < b.light; });
+        for (const auto &query : shadows.queries)
+        {
+            if (context.occluded(query.ray, query.distance))
+                continue;
+            auto &sample = tile.samples[query.pixel];
+            sample.r += query.contribution.r;
+            sample.g += query.contribution.g;
+            sample.b += query.contribution.b;
+        }
+    }
+
+    // Traces the paths of a tile breadth-first. Each bounce starts from a queue of rays,
+    // which are traced in packets of the given width. The hits are grouped by material,
+    // so that every material shades all its hits in one loop, and the rays they scatter
+    // form the queue of the next bounce. That queue is sorted by direction octant, then
+    // by the Morton code of the origins, so that the rays of a packet are coherent.
+    void renderTileWavefront(const RenderContext &context, Tile &tile, ShadowQueue &shadows, int width) const
+    {
+        const size_t pixelCount = tile.width * tile.height;
+        RayQueue queue, next;
+        std::vector<std::optional<Sampler>> samplers(pixelCount);
+        std::vector<QueueSink> sinks(pixelCount);
+        std::vector<std::optional<PathAccumulator<QueueSink>>> paths(pixelCount);
+
+        const uint32_t size = std::bit_ceil(static_cast<uint32_t>(std::max(tile.width, tile.height)));
+        for (uint32_t code = 0; code < size * size; code++)
+        {
+            const auto [x, y] = mortonDecode(code);
+            if (x >= tile.width || y >= tile.height || !tile.isActive(x, y))
+                continue;
+            const uint32_t pixel = y * tile.width + x;
+            samplers[pixel] = pixelSampler(tile, x, y);
+            sinks[pixel] = QueueSink{&next, pixel};
+            paths[pixel].emplace(context, sinks[pixel], *samplers[pixel], shadows, pixel);
+            queue.push(primaryRay(tile, x, y, *samplers[pixel]), pixel, 0, 1);
+        }
+
+        const size_t materialCount = context.materials.size();
+        std::vector<std::optional<Hit>> hits;
+        std::vector<std::optional<SurfaceHit>> surfaces;
+        std::vector<uint32_t> buckets, order;
+        std::vector<uint64_t> keys;
+        while (queue.size() > 0)
+        {
+            hits.resize(queue.size());
+            switch (width)
+            {
+            case 16:
+                traceQueue<16>(context, queue, hits, PacketKernels::trace16);
+                break;
+            case 8:
+                traceQueue<8>(context, queue, hits, PacketKernels::trace8);
+                break;
+            case 4:
+                traceQueue<4>(context, queue, hits, PacketKernels::trace4);
+                break;
+            default:
+                for (size_t i = 0; i < queue.size(); i++)
+                    hits[i] = context.traverser.traverse(queue.rays[i], context.primitiveIntersector);
+            }
+
+            // Counting sort of the hits by material, with the misses last
+            surfaces.resize(queue.size());
+            buckets.assign(materialCount + 2, 0);
+            auto bucketOf = [&](size_t i)
+            {
+                return surfaces[i] ? surfaces[i]->material : materialCount;
+            };
+            for (size_t i = 0; i < queue.size(); i++)
+            {
+                surfaces[i].reset();
+                if (hits[i])
+                    surfaces[i] = context.instances[hits[i]->primitive_index].getSurface(hits[i]->intersection, queue.rays[i], context.pixelSpread);
+                buckets[bucketOf(i) + 1]++;
+            }
+            std::partial_sum(buckets.begin(), buckets.end(), buckets.begin());
+            order.resize(queue.size());
+            for (size_t i = 0; i < queue.size(); i++)
+                order[buckets[bucketOf(i)]++] = i;
+
+            size_t begin = 0;
+            for (size_t material = 0; material < materialCount; material++)
+            {
+                const size_t end = buckets[material];
+                std::visit([&](const auto &shader)
+                           {
+                               for (size_t k = begin; k < end; k++)
+                               {
+                                   const auto i = order[k];
+                                   auto &path = *paths[queue.pixels[i]];
+                                   path.setCurrent(queue.depths[i], queue.weights[i]);
+                                   shader.shade(queue.rays[i], *surfaces[i], queue.depths[i], path);
+                               } },
+                           context.materials[material]);
+                begin = end;
+            }
+            for (size_t k = begin; k < queue.size(); k++)
+            {
+                const auto i = order[k];
+                auto &path = *paths[queue.pixels[i]];
+                path.setCurrent(queue.depths[i], queue.weights[i]);
+                path.emit(skyColor(queue.rays[i]));
+            }
+
+            if (next.size() > 0 && !context.instances.empty())
+            {
+                const bvh::MortonEncoder<uint32_t, BvhScalar> encoder(context.bvh.nodes[0].bounding_box_proxy());
+                keys.resize(next.size());
+                for (size_t i = 0; i < next.size(); i++)
+                {
+                    const auto &ray = next.rays[i];
+                    const uint64_t octant = (ray.unitDir.x < 0) | (ray.unitDir.y < 0) << 1 | (ray.unitDir.z < 0) << 2;
+                    keys[i] = octant << 32 | encoder.encode(ray.origin);
+                }
+                next.sort(keys);
+            }
+            std::swap(queue, next);
+            next.clear();
+        }
+
+        for (size_t pixel = 0; pixel < pixelCount; pixel++)
+        {
+            if (paths[pixel])
+                tile.samples[pixel] = paths[pixel]->result();
+        }
+        for (auto &query : shadows.queries)
+            query.contribution = query.contribution * paths[query.pixel]->normalization();
+    }
+
+    // Closest hits of the rays of a queue, N rays at a time.
+    template <size_t N>
+    static void traceQueue(const RenderContext &context, const RayQueue &queue, std::vector<std::optional<Hit>> &hits, PacketKernels::Kernel<N> kernel)
     {
-        std::vector<Ray> rays;
-        for (size_t i = 0; i < h; i++)
-            for (size_t j = 0; j < w; j++)
+        PacketKernels::Packet<N> packet;
+        PacketKernels::Mask<N> active;
+        PacketKernels::Result<N> result;
+        for (size_t first = 0; first < queue.size(); first += N)
+        {
+            for (size_t lane = 0; lane < N; lane++)
             {
-                // TODO: consider direction
-                rays.emplace_back(origin, Point{-1 + 2.0f * j / w, +1 - 2.0f * i / h, +1});
+                const size_t i = std::min(first + lane, queue.size() - 1);
+                active[lane] = first + lane < queue.size() ? -1 : 0;
+                packet.set(lane, queue.rays[i]);
             }
 
-        return rays;
+            kernel(context, packet, active, result);
+
+            for (size_t lane = 0; lane < N && first + lane < queue.size(); lane++)
+            {
+                hits[first + lane].reset();
+                if (result.hit[lane])
+                    hits[first + lane] = Hit{static_cast<size_t>(result.primitive_index[lane]),
+                                             Instance::Intersection{result.intersection.t[lane], result.intersection.u[lane], result.intersection.v[lane], static_cast<size_t>(result.intersection.primitive_index[lane])}};
+            }
+        }
+    }
+
+    // Traces every primary ray on its own.
+    void renderTile(const RenderContext &context, Tile &tile, ShadowQueue &shadows) const
+    {
+        const uint32_t size = std::bit_ceil(static_cast<uint32_t>(std::max(tile.width, tile.height)));
+        for (uint32_t code = 0; code < size * size; code++)
+        {
+            const auto [x, y] = mortonDecode(code);
+            if (x >= tile.width || y >= tile.height || !tile.isActive(x, y))
+                continue;
+            auto sampler = pixelSampler(tile, x, y);
+            const auto ray = primaryRay(tile, x, y, sampler);
+            const uint32_t pixel = y * tile.width + x;
+            tile.samples[pixel] = tracePath(context, ray, sampler, shadows, pixel);
+        }
+    }
+
+    // Primary rays are traced by square (or 2:1) blocks of N pixels, which are
+    // visited in Morton order. Pixels of a block that fall outside of the tile are
+    // masked out. Secondary rays are incoherent and are traced one by one.
+    template <size_t N>
+    void renderTile(const RenderContext &context, Tile &tile, ShadowQueue &shadows, PacketKernels::Kernel<N> kernel) const
+    {
+        const auto [lastX, lastY] = mortonDecode(N - 1);
+        const int blockWidth = lastX + 1;
+        const int blockHeight = lastY + 1;
+        const int blocksX = (tile.width + blockWidth - 1) / blockWidth;
+        const int blocksY = (tile.height + blockHeight - 1) / blockHeight;
+        const uint32_t size = std::bit_ceil(static_cast<uint32_t>(std::max(blocksX, blocksY)));
+
+        Ray rays[N];
+        std::optional<Sampler> samplers[N];
+        PacketKernels::Packet<N> packet;
+        PacketKernels::Mask<N> active;
+        PacketKernels::Result<N> result;
+        for (uint32_t code = 0; code < size * size; code++)
+        {
+            const auto [blockX, blockY] = mortonDecode(code);
+            if (blockX >= blocksX || blockY >= blocksY)
+                continue;
+
+            for (size_t lane = 0; lane < N; lane++)
+            {
+                const auto [dx, dy] = mortonDecode(lane);
+                const int x = blockX * blockWidth + dx;
+                const int y = blockY * blockHeight + dy;
+                active[lane] = x < tile.width && y < tile.height && tile.isActive(x, y) ? -1 : 0;
+                samplers[lane] = pixelSampler(tile, std::min(x, tile.width - 1), std::min(y, tile.height - 1));
+                rays[lane] = primaryRay(tile, std::min(x, tile.width - 1), std::min(y, tile.height - 1), *samplers[lane]);
+                packet.set(lane, rays[lane]);
+            }
+
+            kernel(context, packet, active, result);
+
+            for (size_t lane = 0; lane < N; lane++)
+            {
+                if (!active[lane])
+                    continue;
+                const auto [dx, dy] = mortonDecode(lane);
+                std::optional<Hit> hit;
+                if (result.hit[lane])
+                    hit = Hit{static_cast<size_t>(result.primitive_index[lane]),
+                              Instance::Intersection{result.intersection.t[lane], result.intersection.u[lane], result.intersection.v[lane], static_cast<size_t>(result.intersection.primitive_index[lane])}};
+                const uint32_t pixel = (blockY * blockHeight + dy) * tile.width + blockX * blockWidth + dx;
+                tile.samples[pixel] = tracePath(context, rays[lane], hit, *samplers[lane], shadows, pixel);
+            }
+        }
+    }
+
+    // Angle between neighbouring primary rays, which are spread over [-1, 1] at a distance of 1.
+    float pixelSpread() const
+    {
+        return 2.0f / std::max(w, h);
+    }
+
+    Sampler pixelSampler(const Tile &tile, int x, int y) const
+    {
+        return Sampler(sampleSequence, static_cast<uint32_t>((tile.y + y) * w + tile.x + x), tile.pass.value_or(0), frame);
+    }
+
+    // Primary ray of a pixel of a tile, jittered by the first two dimensions of the
+    // sampler in progressive passes.
+    Ray primaryRay(const Tile &tile, int x, int y, Sampler &sampler) const
+    {
+        const int i = tile.y + y;
+        const int j = tile.x + x;
+        if (!tile.pass)
+            return primaryRay(i, j);
+        const auto [dj, di] = sampler.next2D();
+        return primaryRay(i, j, di, dj);
+    }
+
+    Ray primaryRay(int i, int j, float di = 0, float dj = 0) const
+    {
+        // TODO: consider direction
+        return Ray{origin, Point{-1 + 2.0f * (j + dj) / w, +1 - 2.0f * (i + di) / h, +1}};
+    }
+
+    // Tiles covering the image, sorted in Morton order of their position.
+    std::vector<Tile> tileOrder() const
+    {
+        const int tilesX = (w + tileSize - 1) / tileSize;
+        const int tilesY = (h + tileSize - 1) / tileSize;
+        const uint32_t size = std::bit_ceil(static_cast<uint32_t>(std::max(tilesX, tilesY)));
+
+        std::vector<Tile> tiles;
+        for (uint32_t code = 0; code < size * size; code++)
+        {
+            const auto [x, y] = mortonDecode(code);
+            if (x >= tilesX || y >= tilesY)
+                continue;
+            const int tx = x * tileSize;
+            const int ty = y * tileSize;
+            tiles.push_back(Tile{.x = tx, .y = ty, .width = std::min(tileSize, w - tx), .height = std::min(tileSize, h - ty)});
+        }
+        return tiles;
+    }
+
+    static std::pair<int, int> mortonDecode(uint32_t code)
+    {
+        auto compact = [](uint32_t v)
+        {
+            v &= 0x55555555;
+            v = (v | (v >> 1)) & 0x33333333;
+            v = (v | (v >> 2)) & 0x0F0F0F0F;
+            v = (v | (v >> 4)) & 0x00FF00FF;
+            v = (v | (v >> 8)) & 0x0000FFFF;
+            return static_cast<int>(v);
+        };
+        return {compact(code), compact(code >> 1)};
     }
-    std::vector<Triangle> triangles;
 
     Point origin;
     Point dir;
     int h;
     int w;
-};
\ No newline at end of file
+};
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <utility>
+
+// Random numbers for rendering. Every path owns its generator, seeded from the pixel,
+// the sample and the frame it belongs to, so that nothing is shared between threads and
+// an image does not depend on how its tiles were scheduled.
+
+// Integer hash with good avalanche (lowbias32).
+inline uint32_t hashInt(uint32_t v)
+{
+    v ^= v >> 16;
+    v *= 0x7feb352d;
+    v ^= v >> 15;
+    v *= 0x846ca68b;
+    v ^= v >> 16;
+    return v;
+}
+
+inline uint32_t hashCombine(uint32_t seed, uint32_t v)
+{
+    return hashInt(seed ^ (v + 0x9e3779b9 + (seed << 6) + (seed >> 2)));
+}
+
+// Upper 24 bits of a 32-bit integer, as a float in [0, 1).
+inline float toUnitFloat(uint32_t v)
+{
+    return (v >> 8) * 0x1p-24f;
+}
+
+// PCG32 (XSH RR): 64 bits of state and a stream selector.
+class Pcg32
+{
+public:
+    Pcg32(uint64_t seed, uint64_t stream) : increment((stream << 1) | 1)
+    {
+        next();
+        state += seed;
+        next();
+    }
+
+    uint32_t next()
+    {
+        const uint64_t old = state;
+        state = old * 6364136223846793005ull + increment;
+        const uint32_t shifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+        const uint32_t rotation = static_cast<uint32_t>(old >> 59);
+        return (shifted >> rotation) | (shifted << ((-rotation) & 31));
+    }
+
+    float nextFloat()
+    {
+        return toUnitFloat(next());
+    }
+
+private:
+    uint64_t state = 0;
+    uint64_t increment;
+};
+
+// Sequences a Sampler can draw from. Random is plain PCG32. Sobol and Halton are
+// low-discrepancy: the samples of a pixel cover each pair of dimensions evenly, which
+// converges faster than random samples for smooth integrands.
+enum class SampleSequence
+{
+    Random,
+    Sobol,
+    Halton
+};
+
+// Stream of numbers in [0, 1) for one sample of one pixel. Dimensions are drawn in
+// order: the first pair jitters the primary ray, and the next ones go to the materials
+// along the path. Low-discrepancy sequences are scrambled per pixel and per frame, so
+// that the error looks like noise rather than a pattern shared by all pixels.
+class Sampler
+{
+public:
+    Sampler(SampleSequence _sequence, uint32_t pixel, uint32_t _sample, uint32_t frame)
+        : sequence(_sequence), sample(_sample), seed(hashCombine(hashInt(pixel), frame)),
+          random(static_cast<uint64_t>(seed) << 32 | pixel, _sample) {}
+
+    float next1D()
+    {
+        switch (sequence)
+        {
+        case SampleSequence::Sobol:
+        {
+            const uint32_t dimensionSeed = hashCombine(seed, dimension++);
+            const uint32_t index = nestedUniformScramble(sample, dimensionSeed);
+            return toUnitFloat(nestedUniformScramble(sobol0(index), hashInt(dimensionSeed)));
+        }
+        case SampleSequence::Halton:
+        {
+            // Reusing a base would repeat an earlier dimension up to its rotation, so
+            // the dimensions past the last prime are random
+            const uint32_t d = dimension++;
+            if (d >= primeCount)
+                return random.nextFloat();
+            return rotate(radicalInverse(primes[d], sample), hashCombine(seed, d));
+        }
+        default:
+            return random.nextFloat();
+        }
+    }
+
+    std::pair<float, float> next2D()
+    {
+        switch (sequence)
+        {
+        case SampleSequence::Sobol:
+        {
+            // Owen-scrambled (0, 2) sequence, with the sample indices shuffled differently
+            // for every pair of dimensions so that the pairs are not correlated
+            const uint32_t dimensionSeed = hashCombine(seed, dimension);
+            dimension += 2;
+            const uint32_t index = nestedUniformScramble(sample, dimensionSeed);
+            return {toUnitFloat(nestedUniformScramble(sobol0(index), hashInt(dimensionSeed))),
+                    toUnitFloat(nestedUniformScramble(sobol1(index), hashInt(dimensionSeed + 1)))};
+        }
+        case SampleSequence::Halton:
+        {
+            const float x = next1D();
+            return {x, next1D()};
+        }
+        default:
+        {
+            const float x = random.nextFloat();
+            return {x, random.nextFloat()};
+        }
+        }
+    }
+
+private:
+    // Bases of the Halton dimensions. Every metal hit draws 30 dimensions for its rays,
+    // so the tree of rays of one sample can draw thousands, more than any table; with
+    // bases in the thousands, the first samples are not better spread than random ones.
+    static constexpr uint32_t primeCount = 256;
+    static constexpr std::array<uint32_t, primeCount> primes = []
+    {
+        std::array<uint32_t, primeCount> result{};
+        uint32_t count = 0;
+        for (uint32_t n = 2; count < primeCount; n++)
+        {
+            bool prime = true;
+            for (uint32_t i = 0; i < count && result[i] * result[i] <= n; i++)
+                prime &= n % result[i] != 0;
+            if (prime)
+                result[count++] = n;
+        }
+        return result;
+    }();
+
+    // First two dimensions of the Sobol sequence, as 32-bit fractions.
+    static uint32_t sobol0(uint32_t index)
+    {
+        return reverseBits(index);
+    }
+
+    static uint32_t sobol1(uint32_t index)
+    {
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+        {
+            if (index & 1)
+                result ^= v;
+        }
+        return result;
+    }
+
+    static uint32_t reverseBits(uint32_t v)
+    {
+        v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+        v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+        v = ((v >> 4) & 0x0F0F0F0F) | ((v & 0x0F0F0F0F) << 4);
+        v = ((v >> 8) & 0x00FF00FF) | ((v & 0x00FF00FF) << 8);
+        return (v >> 16) | (v << 16);
+    }
+
+    // Hash-based Owen scrambling (Burley, "Practical Hash-based Owen Scrambling", 2020):
+    // flips every bit depending on the bits above it, on the reversed value.
+    static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed)
+    {
+        x += seed;
+        x ^= x * 0x6c50b47c;
+        x ^= x * 0xb82f1e52;
+        x ^= x * 0xc7afe638;
+        x ^= x * 0x8d22f6e6;
+        return x;
+    }
+
+    static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+    {
+        return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+    }
+
+    static float radicalInverse(uint32_t base, uint32_t index)
+    {
+        const float inverse = 1.0f / base;
+        float factor = inverse;
+        float result = 0;
+        for (; index; index /= base, factor *= inverse)
+            result += (index % base) * factor;
+        return result;
+    }
+
+    // Cranley-Patterson rotation: a random shift, modulo 1.
+    static float rotate(float x, uint32_t seed)
+    {
+        x += toUnitFloat(seed);
+        return x >= 1 ? x - 1 : x;
+    }
+
+    SampleSequence sequence;
+    uint32_t sample;
+    uint32_t seed;
+    uint32_t dimension = 0;
+    Pcg32 random;
+};
@@ -0,0 +1,589 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <optional>
+#include <algorithm>
+
+#include "common.hpp"
+#include "objLoader.cpp"
+#include "materials.cpp"
+#include "lights.cpp"
+
+#include "bvh/sah_based_algorithm.hpp"
+#include "bvh/spatial_split_bvh_builder.hpp"
+#include "bvh/bvh_serializer.hpp"
+#include "bvh/hierarchy_refitter.hpp"
+#include "bvh/parallel_reinsertion_optimizer.hpp"
+#include "bvh/packet_traverser.hpp"
+#include "bvh/wide_bvh_converter.hpp"
+#include "bvh/wide_bvh_traverser.hpp"
+#include "bvh/packed_triangles.hpp"
+
+// Exposes the SAH cost computation of the BVH library, which is used to
+// measure how much a refitted hierarchy has degraded.
+struct SahCost : public bvh::SahBasedAlgorithm<Bvh>
+{
+    float operator()(const Bvh &bvh) const
+    {
+        return compute_cost(bvh);
+    }
+};
+
+// Triangle mesh in object space, with its bottom-level BVH. The BVH is built
+// once, no matter how many times the mesh is instantiated in the scene. Single
+// rays traverse a 4-wide copy of it, which tests the children of a node with one
+// SSE slab test; packets stay on the binary BVH, where the SIMD lanes are rays.
+//
+// After the build, triangles are addressed by their position in the leaves of the
+// BVH. The intersection data is packed as a structure of arrays in that order, so
+// that leaves are tested four triangles at a time. Shading only reads the vertex
+// indices of the triangle that is hit, and the shared vertex normals and UVs.
+//
+// Meshes loaded from a file can keep their BVH in the mesh cache, next to the parsed
+// mesh, so that slow high-quality builds are only done once per file.
+class Mesh
+{
+public:
+    // How the BVH is built. The values are stored in cached BVH files.
+    enum class BvhBuild : uint32_t
+    {
+        // Sweep SAH builder: fast, used for meshes that are not cached.
+        SweepSah = 1,
+        // Spatial splits, followed by reinsertion optimization: lower SAH cost, slower build.
+        SpatialSplit = 2,
+    };
+
+    using WideBvh = bvh::WideBvh<BvhScalar, 4>;
+    using Statistics = bvh::WideBvhTraverser<WideBvh>::Statistics;
+    using PackedTriangles = bvh::PackedTriangles<BvhScalar, 4>;
+    using Hit = bvh::ClosestPackedTriangleIntersector<BvhScalar, 4>::Result;
+    template <size_t N>
+    using PacketHit = typename bvh::ClosestPackedTrianglePacketIntersector<BvhScalar, 4, N>::Result;
+
+    // Builds the BVH of the triangles, or loads it from the cache if `cacheKey` is set
+    // and identifies the triangles (as the hash of their source file does).
+    Mesh(const IndexedMesh &mesh, MaterialId _material, BvhBuild build = BvhBuild::SweepSah, std::optional<uint64_t> cacheKey = std::nullopt)
+        : material(_material), normals(mesh.normals.begin(), mesh.normals.end()), uvs(mesh.uvs.begin(), mesh.uvs.end())
+    {
+        std::vector<BvhTriangle> bvhTriangles(mesh.triangleCount());
+        for (size_t i = 0; i < bvhTriangles.size(); i++)
+            bvhTriangles[i] = mesh.bvhTriangle(i);
+
+        bvhCached = cacheKey && loadBvh(*cacheKey, build, bvhTriangles.size());
+        if (!bvhCached)
+        {
+            buildBvh(bvhTriangles, build);
+            if (cacheKey)
+                saveBvh(*cacheKey, build);
+        }
+
+        bvh::WideBvhConverter<Bvh, 4> converter(bvh, wideBvh);
+        converter.convert();
+
+        // With spatial splits, a triangle can be referenced by several leaves
+        size_t referenceCount = 0;
+        for (size_t i = 0; i < bvh.node_count; i++)
+        {
+            if (bvh.nodes[i].is_leaf())
+                referenceCount = std::max<size_t>(referenceCount, bvh.nodes[i].first_child_or_primitive + bvh.nodes[i].primitive_count);
+        }
+
+        packedTriangles = PackedTriangles(bvhTriangles.data(), bvh.primitive_indices.get(), referenceCount);
+        indices.reserve(3 * referenceCount);
+        uvDensities.reserve(referenceCount);
+        for (size_t i = 0; i < referenceCount; i++)
+        {
+            const auto triangle = mesh.indices.subspan(3 * bvh.primitive_indices[i], 3);
+            indices.insert(indices.end(), triangle.begin(), triangle.end());
+
+            // Ratio of the lengths in UV space and in object space, for texture filtering
+            const auto &t0 = uvs[triangle[0]], &t1 = uvs[triangle[1]], &t2 = uvs[triangle[2]];
+            const float uvArea = std::abs((t1.u - t0.u) * (t2.v - t0.v) - (t2.u - t0.u) * (t1.v - t0.v));
+            const Point normal = (mesh.positions[triangle[1]] - mesh.positions[triangle[0]]) & (mesh.positions[triangle[2]] - mesh.positions[triangle[0]]);
+            const float area = std::sqrt(normal * normal);
+            uvDensities.push_back(area > 0 ? std::sqrt(uvArea / area) : 0);
+        }
+    }
+
+    std::optional<Hit> intersect(const BvhRay &ray) const
+    {
+        bvh::ClosestPackedTriangleIntersector<BvhScalar, 4> primitive_intersector(packedTriangles);
+        bvh::WideBvhTraverser<WideBvh> traverser(wideBvh);
+        return traverser.traverse(ray, primitive_intersector);
+    }
+
+    // Same as above, counting the nodes visited and the triangles tested.
+    std::optional<Hit> intersect(const BvhRay &ray, Statistics &statistics) const
+    {
+        bvh::ClosestPackedTriangleIntersector<BvhScalar, 4> primitive_intersector(packedTriangles);
+        bvh::WideBvhTraverser<WideBvh> traverser(wideBvh);
+        return traverser.traverse(ray, primitive_intersector, statistics);
+    }
+
+    // Distance to any hit, which is not necessarily the closest one.
+    std::optional<BvhScalar> intersectAny(const BvhRay &ray) const
+    {
+        bvh::AnyPackedTriangleIntersector<BvhScalar, 4> primitive_intersector(packedTriangles);
+        bvh::WideBvhTraverser<WideBvh> traverser(wideBvh);
+        if (auto hit = traverser.traverse(ray, primitive_intersector))
+            return hit->t;
+        return std::nullopt;
+    }
+
+    template <size_t N>
+    PacketHit<N> intersect(const bvh::RayPacket<BvhScalar, N> &packet, const typename bvh::RayPacket<BvhScalar, N>::Mask &active) const
+    {
+        bvh::ClosestPackedTrianglePacketIntersector<BvhScalar, 4, N> primitive_intersector(packedTriangles);
+        bvh::PacketTraverser<Bvh, N> traverser(bvh);
+        return traverser.traverse(packet, active, primitive_intersector);
+    }
+
+    bvh::BoundingBox<BvhScalar> getBoundingBox() const
+    {
+        return bvh.nodes[0].bounding_box_proxy();
+    }
+
+    // Material of all the triangles of the mesh.
+    MaterialId getMaterial() const
+    {
+        return material;
+    }
+
+    // Shading attributes of the triangle at the given position in leaf order.
+    Point normalAt(size_t primitive, float u, float v) const
+    {
+        const uint32_t *triangle = &indices[3 * primitive];
+        return normals[triangle[1]] * u + normals[triangle[2]] * v + normals[triangle[0]] * (1 - u - v);
+    }
+
+    // UV units per object space unit on the triangle.
+    float uvDensityAt(size_t primitive) const
+    {
+        return uvDensities[primitive];
+    }
+
+    TriangleVertex::VertexTexture textureAt(size_t primitive, float u, float v) const
+    {
+        const uint32_t *triangle = &indices[3 * primitive];
+        return uvs[triangle[1]] * u + uvs[triangle[2]] * v + uvs[triangle[0]] * (1 - u - v);
+    }
+
+    // Whether the BVH was loaded from the cache instead of being built.
+    bool isBvhCached() const
+    {
+        return bvhCached;
+    }
+
+private:
+    void buildBvh(const std::vector<BvhTriangle> &triangles, BvhBuild build)
+    {
+        auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(triangles.data(), triangles.size());
+        auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), triangles.size());
+
+        if (build == BvhBuild::SpatialSplit)
+        {
+            bvh::SpatialSplitBvhBuilder<Bvh, BvhTriangle, 64> builder(bvh);
+            builder.build(global_bbox, triangles.data(), bboxes.get(), centers.get(), triangles.size());
+            bvh::ParallelReinsertionOptimizer<Bvh> optimizer(bvh);
+            optimizer.optimize();
+        }
+        else
+        {
+            bvh::SweepSahBuilder<Bvh> builder(bvh);
+            builder.build(global_bbox, bboxes.get(), centers.get(), triangles.size());
+        }
+    }
+
+    bool loadBvh(uint64_t cacheKey, BvhBuild build, size_t triangleCount)
+    {
+        try
+        {
+            MappedFile file(MeshCache::pathOf(cacheKey, bvhExtension(build)));
+            bvh::BvhSerializer<Bvh> serializer(bvh);
+            auto metadata = serializer.load(file.data(), file.size(), triangleCount);
+            return metadata && metadata->key == cacheKey && metadata->builder == static_cast<uint32_t>(build);
+        }
+        catch (const char *)
+        {
+            return false;
+        }
+    }
+
+    void saveBvh(uint64_t cacheKey, BvhBuild build)
+    {
+        std::error_code error;
+        std::filesystem::create_directories(MeshCache::directory, error);
+        const auto path = MeshCache::pathOf(cacheKey, bvhExtension(build));
+        const auto temporary = path + ".tmp" + std::to_string(getpid());
+        bool saved;
+        {
+            std::ofstream out(temporary, std::ios::binary);
+            bvh::BvhSerializer<Bvh> serializer(bvh);
+            saved = serializer.save(out, {static_cast<uint32_t>(build), SahCost{}(bvh), cacheKey});
+        }
+        if (saved)
+            std::filesystem::rename(temporary, path, error);
+        if (!saved || error)
+            std::remove(temporary.c_str());
+    }
+
+    static std::string bvhExtension(BvhBuild build)
+    {
+        return build == BvhBuild::SpatialSplit ? ".spatial.bvh" : ".sweep.bvh";
+    }
+
+    Bvh bvh;
+    WideBvh wideBvh;
+    PackedTriangles packedTriangles;
+    bool bvhCached = false;
+    MaterialId material;
+    // Shared vertex attributes, and the vertex indices of the triangles in leaf order
+    std::vector<Point> normals;
+    std::vector<TriangleVertex::VertexTexture> uvs;
+    std::vector<uint32_t> indices;
+    std::vector<float> uvDensities;
+};
+
+// Placement of a mesh in the scene. This is the primitive type of the top-level
+// BVH: intersecting it moves the ray into object space and traverses the mesh BVH.
+// The ray direction is not renormalized, so distances are the same in both spaces.
+class Instance
+{
+public:
+    struct Intersection
+    {
+        BvhScalar t, u, v;
+        size_t primitive_index;
+
+        BvhScalar distance() const { return t; }
+    };
+
+    // Hits of a packet of rays, one per lane.
+    template <size_t N>
+    struct PacketIntersection
+    {
+        typename bvh::SimdTypes<BvhScalar, N>::Vector t, u, v;
+        typename bvh::SimdTypes<BvhScalar, N>::Mask primitive_index;
+    };
+
+    using ScalarType = BvhScalar;
+    using IntersectionType = Intersection;
+
+    Instance(const Mesh &_mesh, const Transform &_toWorld) : mesh(&_mesh), toWorld(_toWorld), toObject(_toWorld.inverse()), bbox(bvh::BoundingBox<BvhScalar>::empty())
+    {
+        // Average scale factor of the transformation, from the determinant of its linear part
+        const auto &m = toWorld.m;
+        const float determinant = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                                  m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                                  m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        scale = std::cbrt(std::abs(determinant));
+
+        const auto local = mesh->getBoundingBox();
+        for (int i = 0; i < 8; i++)
+        {
+            Point corner{local.min[0], local.min[1], local.min[2]};
+            if (i & 1)
+                corner.x = local.max[0];
+            if (i & 2)
+                corner.y = local.max[1];
+            if (i & 4)
+                corner.z = local.max[2];
+            bbox.extend(toWorld.applyToPoint(corner));
+        }
+    }
+
+    bvh::BoundingBox<BvhScalar> bounding_box() const
+    {
+        return bbox;
+    }
+
+    BvhVector3 center() const
+    {
+        return bbox.center();
+    }
+
+    std::optional<Intersection> intersect(const BvhRay &ray) const
+    {
+        if (auto hit = mesh->intersect(toObjectRay(ray)))
+            return std::make_optional(Intersection{hit->intersection.t, hit->intersection.u, hit->intersection.v, hit->primitive_index});
+        return std::nullopt;
+    }
+
+    // Same as above, adding the steps of the traversal of the mesh to the statistics.
+    std::optional<Intersection> intersect(const BvhRay &ray, Mesh::Statistics &statistics) const
+    {
+        if (auto hit = mesh->intersect(toObjectRay(ray), statistics))
+            return std::make_optional(Intersection{hit->intersection.t, hit->intersection.u, hit->intersection.v, hit->primitive_index});
+        return std::nullopt;
+    }
+
+    // Same as above for the active rays of a packet. Only the lanes of the rays that hit are written.
+    template <size_t N>
+    typename bvh::SimdTypes<BvhScalar, N>::Mask intersect(const bvh::RayPacket<BvhScalar, N> &packet, const typename bvh::SimdTypes<BvhScalar, N>::Mask &active, PacketIntersection<N> &intersection) const
+    {
+        bvh::RayPacket<BvhScalar, N> local;
+        for (int row = 0; row < 3; row++)
+        {
+            const float *m = toObject.m[row];
+            local.origin[row] = m[0] * packet.origin[0] + m[1] * packet.origin[1] + m[2] * packet.origin[2] + m[3];
+            local.direction[row] = m[0] * packet.direction[0] + m[1] * packet.direction[1] + m[2] * packet.direction[2];
+        }
+        local.tmin = packet.tmin;
+        local.tmax = packet.tmax;
+
+        const auto hit = mesh->intersect(local, active);
+        intersection.t = hit.hit ? hit.intersection.t : intersection.t;
+        intersection.u = hit.hit ? hit.intersection.u : intersection.u;
+        intersection.v = hit.hit ? hit.intersection.v : intersection.v;
+        intersection.primitive_index = hit.hit ? hit.primitive_index : intersection.primitive_index;
+        return hit.hit;
+    }
+
+    // Occlusion test, used by bvh::AnyPrimitiveIntersector: stops at the first hit.
+    std::optional<BvhScalar> intersect_any(const BvhRay &ray) const
+    {
+        return mesh->intersectAny(toObjectRay(ray));
+    }
+
+    // Shading inputs of a hit on this instance, in world space. The ray is the axis of a
+    // cone that widens by `spread` per unit of distance, which gives the footprint of the
+    // hit for texture filtering.
+    SurfaceHit getSurface(const Intersection &hit, const Ray &ray, float spread = 0) const
+    {
+        const Point normal = toObject.applyTransposedToVector(mesh->normalAt(hit.primitive_index, hit.u, hit.v));
+        const float cosine = std::abs(normal * ray.unitDir) / std::sqrt(normal * normal);
+        const float footprint = hit.t * spread / std::max(cosine, 0.1f);
+        return SurfaceHit{
+            ray.origin + ray.unitDir * hit.t,
+            normal,
+            mesh->textureAt(hit.primitive_index, hit.u, hit.v),
+            hit.t,
+            mesh->getMaterial(),
+            scale > 0 ? footprint * mesh->uvDensityAt(hit.primitive_index) / scale : 0};
+    }
+
+private:
+    // Same ray in object space. The direction is not normalized, so that distances along
+    // the ray are the same in both spaces.
+    BvhRay toObjectRay(const BvhRay &ray) const
+    {
+        const Point origin = toObject.applyToPoint({ray.origin[0], ray.origin[1], ray.origin[2]});
+        const Point direction = toObject.applyToVector({ray.direction[0], ray.direction[1], ray.direction[2]});
+        return BvhRay(origin, direction, ray.tmin, ray.tmax);
+    }
+
+    const Mesh *mesh;
+    Transform toWorld;
+    Transform toObject;
+    float scale;
+    bvh::BoundingBox<BvhScalar> bbox;
+};
+
+// BVH over primitives that move between frames. It is only built from scratch when
+// the primitive count changes or when the quality of the refitted hierarchy drops
+// too far; otherwise, frames pay a linear-time refit.
+template <typename Primitive>
+class RefittableBvh
+{
+public:
+    enum class Update
+    {
+        None,
+        Build,
+        Refit,
+        Optimize
+    };
+
+    // Thresholds on the SAH cost after a refit, relative to the cost of the
+    // hierarchy right after the last build (or the last optimization).
+    float optimizeThreshold = 1.15f;
+    float rebuildThreshold = 1.4f;
+    bool optimizeOnDegradation = true;
+
+    void update(const std::vector<Primitive> &primitives)
+    {
+        if (!bvh.nodes || primitives.size() != builtPrimitiveCount)
+        {
+            build(primitives);
+            return;
+        }
+
+        refitter->refit([&](Bvh::Node &leaf)
+                        {
+                            auto bbox = bvh::BoundingBox<BvhScalar>::empty();
+                            for (size_t i = leaf.first_child_or_primitive; i < leaf.first_child_or_primitive + leaf.primitive_count; i++)
+                                bbox.extend(primitives[bvh.primitive_indices[i]].bounding_box());
+                            leaf.bounding_box_proxy() = bbox;
+                        });
+        cost = sahCost(bvh);
+        lastUpdate = Update::Refit;
+
+        if (cost > builtCost * rebuildThreshold)
+            build(primitives);
+        else if (optimizeOnDegradation && cost > optimizedCost * optimizeThreshold)
+            optimize();
+    }
+
+    const Bvh &getBvh() const
+    {
+        return bvh;
+    }
+
+    Update getLastUpdate() const
+    {
+        return lastUpdate;
+    }
+
+    // SAH cost of the current hierarchy, and relative to the last full build.
+    float getSahCost() const
+    {
+        return cost;
+    }
+
+    float getRelativeSahCost() const
+    {
+        return cost / builtCost;
+    }
+
+private:
+    void build(const std::vector<Primitive> &primitives)
+    {
+        auto [bboxes, centers] = bvh::compute_bounding_boxes_and_centers(primitives.data(), primitives.size());
+        auto global_bbox = bvh::compute_bounding_boxes_union(bboxes.get(), primitives.size());
+
+        bvh::SweepSahBuilder<Bvh> builder(bvh);
+        builder.build(global_bbox, bboxes.get(), centers.get(), primitives.size());
+
+        refitter.emplace(bvh);
+        builtPrimitiveCount = primitives.size();
+        cost = builtCost = optimizedCost = sahCost(bvh);
+        lastUpdate = Update::Build;
+    }
+
+    void optimize()
+    {
+        bvh::ParallelReinsertionOptimizer<Bvh> optimizer(bvh);
+        optimizer.optimize();
+
+        // The optimizer changes the topology, so the parent indices need to be recomputed
+        refitter.emplace(bvh);
+        cost = optimizedCost = sahCost(bvh);
+        lastUpdate = Update::Optimize;
+    }
+
+    Bvh bvh;
+    std::optional<bvh::HierarchyRefitter<Bvh>> refitter;
+    size_t builtPrimitiveCount = 0;
+
+    SahCost sahCost;
+    float cost = 0;
+    float builtCost = 0;
+    float optimizedCost = 0;
+    Update lastUpdate = Update::None;
+};
+
+// Two-level scene: meshes are stored once in object space with their own BVH,
+// and a top-level BVH over the instances is updated every frame.
+class Scene
+{
+public:
+    using BvhUpdate = RefittableBvh<Instance>::Update;
+
+    Scene() = default;
+    Scene(const Scene &) = delete;
+    Scene &operator=(const Scene &) = delete;
+
+    // Scene with the same materials and lights, and the same meshes and textures, which
+    // are shared rather than copied, but without instances. Its instances and top-level
+    // BVH are updated independently, so that one frame can be set up while another one
+    // renders (see Animation).
+    Scene share() const
+    {
+        return Scene(*this, 0);
+    }
+
+    MaterialId addMaterial(const Material &material)
+    {
+        materials.push_back(material);
+        return materials.size() - 1;
+    }
+
+    const std::vector<Material> &getMaterials() const
+    {
+        return materials;
+    }
+
+    // Textures are owned by the scene, and referenced by the materials.
+    const Texture *addTexture(Texture texture)
+    {
+        textures.push_back(std::make_shared<Texture>(std::move(texture)));
+        return textures.back().get();
+    }
+
+    void addLight(const Light &light)
+    {
+        lights.push_back(light);
+    }
+
+    const std::vector<Light> &getLights() const
+    {
+        return lights;
+    }
+
+    // Fraction of their color that lit materials reflect where no light reaches them.
+    Rgb ambient{0.1f, 0.1f, 0.1f};
+
+    // Registers the geometry of an object, in object space. Returns the mesh index.
+    size_t addMesh(const Obj &obj, Mesh::BvhBuild build = Mesh::BvhBuild::SweepSah)
+    {
+        meshes.push_back(std::make_shared<Mesh>(obj.getMesh(), obj.getMaterial(), build, obj.getCacheKey()));
+        return meshes.size() - 1;
+    }
+
+    void clearInstances()
+    {
+        instances.clear();
+    }
+
+    void addInstance(size_t mesh, const Transform &toWorld)
+    {
+        instances.emplace_back(*meshes.at(mesh), toWorld);
+    }
+
+    void update()
+    {
+        topLevel.update(instances);
+    }
+
+    const std::vector<Instance> &getInstances() const
+    {
+        return instances;
+    }
+
+    const Bvh &getBvh() const
+    {
+        return topLevel.getBvh();
+    }
+
+    RefittableBvh<Instance> &getTopLevel()
+    {
+        return topLevel;
+    }
+
+    const RefittableBvh<Instance> &getTopLevel() const
+    {
+        return topLevel;
+    }
+
+private:
+    Scene(const Scene &other, int)
+        : ambient(other.ambient), materials(other.materials), lights(other.lights), textures(other.textures), meshes(other.meshes) {}
+
+    std::vector<Material> materials;
+    std::vector<Light> lights;
+    std::vector<std::shared_ptr<const Texture>> textures;
+    std::vector<std::shared_ptr<const Mesh>> meshes;
+    std::vector<Instance> instances;
+    RefittableBvh<Instance> topLevel;
+};
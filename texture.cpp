@@ -0,0 +1,294 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <png.h>
+
+#include "framebuffer.cpp"
+#include "bvh/ray_packet.hpp"
+
+// RGBA texture with a mip chain. Texels are 8-bit sRGB, stored by tiles of 4x4: a tile
+// is 64 bytes, one cache line, so the four texels of a bilinear lookup are in one or two
+// lines instead of two rows that are a whole image width apart. Filtering is done in
+// linear space, on the four channels at once.
+class Texture
+{
+public:
+    enum class Wrap
+    {
+        Repeat,
+        Clamp,
+        Mirror
+    };
+
+    enum class Filter
+    {
+        // Closest texel of the full-resolution image.
+        Nearest,
+        // Bilinear interpolation in the level closest to the footprint.
+        Bilinear,
+        // Bilinear in the two levels around the footprint, interpolated.
+        Trilinear
+    };
+
+    Wrap wrap = Wrap::Clamp;
+    Filter filter = Filter::Trilinear;
+
+    // Texels in rows, from the top of the image, 4 bytes per texel.
+    Texture(int width, int height, const uint8_t *rgba)
+    {
+        Level level(width, height);
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+                std::memcpy(level.texel(x, y), rgba + 4 * (static_cast<size_t>(y) * width + x), 4);
+        }
+        levels.push_back(std::move(level));
+
+        // Each level averages 2x2 texels of the previous one, in linear space
+        while (levels.back().width > 1 || levels.back().height > 1)
+        {
+            const Level &fine = levels.back();
+            Level coarse(std::max(fine.width / 2, 1), std::max(fine.height / 2, 1));
+            for (int y = 0; y < coarse.height; y++)
+            {
+                for (int x = 0; x < coarse.width; x++)
+                {
+                    Vector4 sum{};
+                    for (int dy = 0; dy < 2; dy++)
+                    {
+                        for (int dx = 0; dx < 2; dx++)
+                            sum += decode(fine.texel(std::min(2 * x + dx, fine.width - 1), std::min(2 * y + dy, fine.height - 1)));
+                    }
+                    encode(sum * 0.25f, coarse.texel(x, y));
+                }
+            }
+            levels.push_back(std::move(coarse));
+        }
+    }
+
+    // Reads a PNG file of any color type as RGBA.
+    static Texture load(const std::string &path)
+    {
+        FILE *file = std::fopen(path.c_str(), "rb");
+        if (!file)
+            throw "Could not open texture";
+
+        png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        png_infop info = png ? png_create_info_struct(png) : NULL;
+        if (!info || setjmp(png_jmpbuf(png)))
+        {
+            png_destroy_read_struct(&png, &info, NULL);
+            std::fclose(file);
+            throw "Invalid PNG file";
+        }
+
+        png_init_io(png, file);
+        png_read_info(png, info);
+        const int width = png_get_image_width(png, info);
+        const int height = png_get_image_height(png, info);
+        const png_byte colorType = png_get_color_type(png, info);
+
+        // Any color type to 8-bit RGBA (see http://www.libpng.org/pub/png/libpng-manual.txt)
+        if (png_get_bit_depth(png, info) == 16)
+            png_set_strip_16(png);
+        if (colorType == PNG_COLOR_TYPE_PALETTE)
+            png_set_palette_to_rgb(png);
+        if (colorType == PNG_COLOR_TYPE_GRAY && png_get_bit_depth(png, info) < 8)
+            png_set_expand_gray_1_2_4_to_8(png);
+        if (png_get_valid(png, info, PNG_INFO_tRNS))
+            png_set_tRNS_to_alpha(png);
+        if (colorType == PNG_COLOR_TYPE_RGB || colorType == PNG_COLOR_TYPE_GRAY || colorType == PNG_COLOR_TYPE_PALETTE)
+            png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+        if (colorType == PNG_COLOR_TYPE_GRAY || colorType == PNG_COLOR_TYPE_GRAY_ALPHA)
+            png_set_gray_to_rgb(png);
+        png_read_update_info(png, info);
+
+        // The buffers are created after the setjmp above, so errors from here on must
+        // not jump back past them
+        std::vector<uint8_t> rgba(4 * static_cast<size_t>(width) * height);
+        std::vector<png_bytep> rows(height);
+        for (int y = 0; y < height; y++)
+            rows[y] = &rgba[4 * static_cast<size_t>(y) * width];
+        const bool read = readImage(png, rows.data());
+
+        png_destroy_read_struct(&png, &info, NULL);
+        std::fclose(file);
+        if (!read)
+            throw "Invalid PNG file";
+        return Texture(width, height, rgba.data());
+    }
+
+    int getWidth() const
+    {
+        return levels[0].width;
+    }
+
+    int getHeight() const
+    {
+        return levels[0].height;
+    }
+
+    size_t levelCount() const
+    {
+        return levels.size();
+    }
+
+    // Linear color at (u, v), where v goes up from the bottom of the image, for a pixel
+    // footprint that is `footprint` wide in UV units (0 for the full resolution).
+    Rgb sample(float u, float v, float footprint) const
+    {
+        if (!std::isfinite(u) || !std::isfinite(v))
+            u = v = 0;
+        u = reduce(u);
+        v = reduce(v);
+
+        Vector4 color;
+        switch (filter)
+        {
+        case Filter::Nearest:
+        {
+            const auto &level = levels[0];
+            color = decode(level.texel(wrapCoordinate(floor(u * level.width), level.width),
+                                       wrapCoordinate(floor((1 - v) * level.height), level.height)));
+            break;
+        }
+        case Filter::Bilinear:
+            color = bilinear(levels[static_cast<size_t>(lod(footprint) + 0.5f)], u, v);
+            break;
+        default:
+        {
+            const float lod = this->lod(footprint);
+            const size_t fine = static_cast<size_t>(lod);
+            const float t = lod - fine;
+            color = bilinear(levels[fine], u, v);
+            if (t > 0 && fine + 1 < levels.size())
+                color = color * (1 - t) + bilinear(levels[fine + 1], u, v) * t;
+        }
+        }
+        return {color[0], color[1], color[2]};
+    }
+
+private:
+    using Vector4 = bvh::SimdTypes<float, 4>::Vector;
+
+    static constexpr int tileSize = 4;
+
+    // One mip level, padded to whole tiles.
+    struct Level
+    {
+        Level(int _width, int _height)
+            : width(_width), height(_height), tilesX((_width + tileSize - 1) / tileSize),
+              texels(4 * tileSize * tileSize * static_cast<size_t>(tilesX) * ((_height + tileSize - 1) / tileSize)) {}
+
+        uint8_t *texel(int x, int y)
+        {
+            return &texels[offset(x, y)];
+        }
+
+        const uint8_t *texel(int x, int y) const
+        {
+            return &texels[offset(x, y)];
+        }
+
+        size_t offset(int x, int y) const
+        {
+            const size_t tile = static_cast<size_t>(y / tileSize) * tilesX + x / tileSize;
+            return 4 * (tile * tileSize * tileSize + (y % tileSize) * tileSize + x % tileSize);
+        }
+
+        int width;
+        int height;
+        int tilesX;
+        std::vector<uint8_t> texels;
+    };
+
+    // Level whose texels are as wide as the footprint, in [0, levelCount() - 1].
+    float lod(float footprint) const
+    {
+        const float size = static_cast<float>(std::max(getWidth(), getHeight()));
+        return std::clamp(std::log2(std::max(footprint * size, 1.0f)), 0.0f, static_cast<float>(levels.size() - 1));
+    }
+
+    // Brings a coordinate far outside of the texture back to where its texel coordinate
+    // fits in an int, which floor() needs. Repeat and mirror both have a period of 2.
+    float reduce(float x) const
+    {
+        if (std::abs(x) < 1024)
+            return x;
+        return wrap == Wrap::Clamp ? std::clamp(x, -1.0f, 2.0f) : std::fmod(x, 2.0f);
+    }
+
+    // Decodes the pixels into the rows. libpng reports errors by longjmp, so this has its
+    // own setjmp, with no object that needs a destructor between the two.
+    static bool readImage(png_structp png, png_bytep *rows)
+    {
+        if (setjmp(png_jmpbuf(png)))
+            return false;
+        png_read_image(png, rows);
+        return true;
+    }
+
+    // std::floor is a library call without SSE4.1. The coordinate must fit in an int.
+    static int floor(float x)
+    {
+        const int i = static_cast<int>(x);
+        return x < i ? i - 1 : i;
+    }
+
+    static Vector4 decode(const uint8_t *texel)
+    {
+        const auto &table = Srgb::decodeTable();
+        return Vector4{table[texel[0]], table[texel[1]], table[texel[2]], texel[3] / 255.0f};
+    }
+
+    static void encode(const Vector4 &color, uint8_t *texel)
+    {
+        for (int c = 0; c < 3; c++)
+            texel[c] = Srgb::fromLinear(color[c]);
+        texel[3] = static_cast<uint8_t>(std::clamp(color[3], 0.0f, 1.0f) * 255 + 0.5f);
+    }
+
+    int wrapCoordinate(int x, int size) const
+    {
+        if (x >= 0 && x < size)
+            return x;
+        switch (wrap)
+        {
+        case Wrap::Clamp:
+            return std::clamp(x, 0, size - 1);
+        case Wrap::Mirror:
+        {
+            const int m = ((x % (2 * size)) + 2 * size) % (2 * size);
+            return m < size ? m : 2 * size - 1 - m;
+        }
+        default:
+            return ((x % size) + size) % size;
+        }
+    }
+
+    // Texel centers are at half-integer coordinates.
+    Vector4 bilinear(const Level &level, float u, float v) const
+    {
+        const float x = u * level.width - 0.5f;
+        const float y = (1 - v) * level.height - 0.5f;
+        const int x0 = floor(x);
+        const int y0 = floor(y);
+        const float fx = x - x0;
+        const float fy = y - y0;
+        const int left = wrapCoordinate(x0, level.width);
+        const int right = wrapCoordinate(x0 + 1, level.width);
+        const int top = wrapCoordinate(y0, level.height);
+        const int bottom = wrapCoordinate(y0 + 1, level.height);
+        return (decode(level.texel(left, top)) * (1 - fx) + decode(level.texel(right, top)) * fx) * (1 - fy) +
+               (decode(level.texel(left, bottom)) * (1 - fx) + decode(level.texel(right, bottom)) * fx) * fy;
+    }
+
+    std::vector<Level> levels;
+};
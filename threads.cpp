@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <thread>
+
+#include <tbb/global_control.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Rendering runs on TBB (tiles are scheduled by tbb::parallel_for), while BVH builds run
+// on OpenMP. The two runtimes keep separate pools, so to avoid oversubscribing
+// the cores they are never busy at the same time: scene updates are done between
+// renders. This limits both pools to the same number of threads while it is alive.
+//
+// After a parallel region, libgomp threads keep spinning for a short while before
+// going to sleep. Run with OMP_WAIT_POLICY=passive to remove that overlap entirely.
+class ThreadLimit
+{
+public:
+    ThreadLimit(size_t count) : control(tbb::global_control::max_allowed_parallelism, std::max<size_t>(count, 1))
+    {
+#ifdef _OPENMP
+        previousOmpThreads = omp_get_max_threads();
+        omp_set_num_threads(std::max<size_t>(count, 1));
+#endif
+    }
+
+    ~ThreadLimit()
+    {
+#ifdef _OPENMP
+        omp_set_num_threads(previousOmpThreads);
+#endif
+    }
+
+    ThreadLimit(const ThreadLimit &) = delete;
+    ThreadLimit &operator=(const ThreadLimit &) = delete;
+
+    static size_t hardwareThreads()
+    {
+        return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+
+private:
+    tbb::global_control control;
+#ifdef _OPENMP
+    int previousOmpThreads;
+#endif
+};
+
+// Work that runs on a TBB thread alongside a render (see Animation) would start a full
+// OpenMP team from that thread, on top of the TBB workers. This keeps the OpenMP regions
+// of the current thread on that thread while it is alive.
+class SerialOpenMp
+{
+public:
+    SerialOpenMp()
+    {
+#ifdef _OPENMP
+        previousThreads = omp_get_max_threads();
+        omp_set_num_threads(1);
+#endif
+    }
+
+    ~SerialOpenMp()
+    {
+#ifdef _OPENMP
+        omp_set_num_threads(previousThreads);
+#endif
+    }
+
+    SerialOpenMp(const SerialOpenMp &) = delete;
+    SerialOpenMp &operator=(const SerialOpenMp &) = delete;
+
+private:
+#ifdef _OPENMP
+    int previousThreads;
+#endif
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+// Per-pixel costs of tracing the primary rays of an image (see
+// RayTracer::renderStatistics()), to find the regions where the BVHs do poorly. Like
+// the Framebuffer, every pixel is written by the one thread that renders its tile, so
+// the counters need no atomics; totals and histograms are computed afterwards.
+class TraversalStatistics
+{
+public:
+    enum class Counter
+    {
+        // Nodes visited, in the top-level BVH and in the BVHs of the meshes.
+        TraversalSteps,
+        // Instances whose mesh was traversed.
+        InstanceTests,
+        // Triangles tested in the leaves of the meshes.
+        TriangleTests
+    };
+    static constexpr size_t counterCount = 3;
+
+    struct Summary
+    {
+        uint64_t total = 0;
+        double mean = 0;
+        uint32_t max = 0;
+        // Value that 99% of the pixels do not exceed.
+        uint32_t percentile99 = 0;
+        // Number of pixels by power of two: bucket 0 counts the pixels at 0, and bucket
+        // k the pixels in [2^(k-1), 2^k).
+        std::vector<size_t> histogram;
+    };
+
+    TraversalStatistics(int _width, int _height) : width(_width), height(_height)
+    {
+        for (auto &values : counters)
+            values.resize(static_cast<size_t>(width) * height);
+    }
+
+    int getWidth() const
+    {
+        return width;
+    }
+
+    int getHeight() const
+    {
+        return height;
+    }
+
+    void set(int x, int y, Counter counter, uint32_t value)
+    {
+        counters[static_cast<size_t>(counter)][static_cast<size_t>(y) * width + x] = value;
+    }
+
+    uint32_t get(int x, int y, Counter counter) const
+    {
+        return counters[static_cast<size_t>(counter)][static_cast<size_t>(y) * width + x];
+    }
+
+    Summary summary(Counter counter) const
+    {
+        const auto &values = counters[static_cast<size_t>(counter)];
+        Summary summary;
+        for (uint32_t value : values)
+        {
+            summary.total += value;
+            summary.max = std::max(summary.max, value);
+            const size_t bucket = std::bit_width(value);
+            if (bucket >= summary.histogram.size())
+                summary.histogram.resize(bucket + 1);
+            summary.histogram[bucket]++;
+        }
+        if (!values.empty())
+        {
+            summary.mean = static_cast<double>(summary.total) / values.size();
+            summary.percentile99 = percentile(values, 0.99);
+        }
+        return summary;
+    }
+
+    // False-color image of a counter, as interleaved 8-bit RGB: black for 0, then dark
+    // blue through red to white at `scale`, and above. A scale of 0 stands for the 99th
+    // percentile, so that a few outliers do not darken the whole image.
+    std::vector<uint8_t> heatmap(Counter counter, uint32_t scale = 0) const
+    {
+        const auto &values = counters[static_cast<size_t>(counter)];
+        if (scale == 0)
+            scale = std::max<uint32_t>(percentile(values, 0.99), 1);
+        std::vector<uint8_t> image(values.size() * 3);
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            const auto color = falseColor(std::min(static_cast<float>(values[i]) / scale, 1.0f));
+            std::copy(color.begin(), color.end(), &image[3 * i]);
+        }
+        return image;
+    }
+
+    // Linear interpolation between the stops of a black-body-like ramp.
+    static std::array<uint8_t, 3> falseColor(float t)
+    {
+        static constexpr float stops[][3] = {{0, 0, 0}, {30, 20, 140}, {180, 30, 120}, {245, 120, 20}, {255, 230, 90}, {255, 255, 255}};
+        constexpr size_t count = sizeof(stops) / sizeof(stops[0]);
+        const float position = std::clamp(t, 0.0f, 1.0f) * (count - 1);
+        const size_t index = std::min(static_cast<size_t>(position), count - 2);
+        const float f = position - index;
+        std::array<uint8_t, 3> color;
+        for (size_t c = 0; c < 3; c++)
+            color[c] = static_cast<uint8_t>(stops[index][c] * (1 - f) + stops[index + 1][c] * f + 0.5f);
+        return color;
+    }
+
+private:
+    static uint32_t percentile(std::vector<uint32_t> values, double fraction)
+    {
+        if (values.empty())
+            return 0;
+        const size_t rank = std::min(values.size() - 1, static_cast<size_t>(fraction * values.size()));
+        std::nth_element(values.begin(), values.begin() + rank, values.end());
+        return values[rank];
+    }
+
+    int width;
+    int height;
+    std::array<std::vector<uint32_t>, counterCount> counters;
+};
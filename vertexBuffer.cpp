@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include "common.hpp"
+#include "bvh/ray_packet.hpp"
+
+// Vertex attribute with one array per component. The arrays are padded to a multiple
+// of the widest SIMD vector, so that kernels never need a scalar tail loop.
+struct SoaVertices
+{
+    static constexpr size_t padding = 16;
+
+    SoaVertices() = default;
+
+    explicit SoaVertices(size_t _count) : count(_count), x(paddedSize()), y(paddedSize()), z(paddedSize()) {}
+
+    explicit SoaVertices(std::span<const Point> points) : SoaVertices(points.size())
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            x[i] = points[i].x;
+            y[i] = points[i].y;
+            z[i] = points[i].z;
+        }
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    size_t paddedSize() const
+    {
+        return (count + padding - 1) / padding * padding;
+    }
+
+    Point operator[](size_t i) const
+    {
+        return {x[i], y[i], z[i]};
+    }
+
+    size_t count = 0;
+    std::vector<float> x, y, z;
+};
+
+// Positions and normals of the vertices of a mesh after a transformation. Normals are
+// mapped by the inverse transpose and are not renormalized.
+struct TransformedVertices
+{
+    SoaVertices positions;
+    SoaVertices normals;
+};
+
+// Applies one 3x4 matrix to SoA vertices. As with the packet kernels of the ray tracer,
+// each SIMD width is compiled for the instruction set whose registers hold one vector,
+// the widest one the CPU supports is used, and large buffers are split between threads.
+struct TransformKernels
+{
+    // Transforms points (with the translation) or vectors (without it).
+    static void apply(const Transform &transform, const SoaVertices &in, SoaVertices &out, bool points)
+    {
+        static const auto kernel = pickKernel();
+        apply(kernel, transform, in, out, points);
+    }
+
+    using Kernel = void (*)(const Transform &, const SoaVertices &, SoaVertices &, float, size_t, size_t);
+
+    // Same as above with a given kernel, for comparisons.
+    static void apply(Kernel kernel, const Transform &transform, const SoaVertices &in, SoaVertices &out, bool points)
+    {
+        if (out.size() != in.size())
+            out = SoaVertices(in.size());
+
+        // Blocks are a multiple of every vector width, and large enough to amortize the threads
+        constexpr size_t block = 4096;
+        const size_t blocks = (in.paddedSize() + block - 1) / block;
+        const float w = points ? 1 : 0;
+#pragma omp parallel for if (blocks > 1)
+        for (size_t i = 0; i < blocks; i++)
+            kernel(transform, in, out, w, i * block, std::min((i + 1) * block, in.paddedSize()));
+    }
+
+    __attribute__((flatten)) static void transform4(const Transform &transform, const SoaVertices &in, SoaVertices &out, float w, size_t begin, size_t end)
+    {
+        transformRange<4>(transform, in, out, w, begin, end);
+    }
+
+    __attribute__((target("avx2,fma"), flatten)) static void transform8(const Transform &transform, const SoaVertices &in, SoaVertices &out, float w, size_t begin, size_t end)
+    {
+        transformRange<8>(transform, in, out, w, begin, end);
+    }
+
+    __attribute__((target("avx512f"), flatten)) static void transform16(const Transform &transform, const SoaVertices &in, SoaVertices &out, float w, size_t begin, size_t end)
+    {
+        transformRange<16>(transform, in, out, w, begin, end);
+    }
+
+    static Kernel pickKernel()
+    {
+        if (__builtin_cpu_supports("avx512f"))
+            return transform16;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return transform8;
+        return transform4;
+    }
+
+private:
+    template <size_t N>
+    static void transformRange(const Transform &transform, const SoaVertices &in, SoaVertices &out, float w, size_t begin, size_t end)
+    {
+        using Vector = typename bvh::SimdTypes<float, N>::Vector;
+        const auto &m = transform.m;
+        const float tx = m[0][3] * w, ty = m[1][3] * w, tz = m[2][3] * w;
+        for (size_t i = begin; i < end; i += N)
+        {
+            Vector x, y, z;
+            std::memcpy(&x, &in.x[i], sizeof(Vector));
+            std::memcpy(&y, &in.y[i], sizeof(Vector));
+            std::memcpy(&z, &in.z[i], sizeof(Vector));
+            const Vector rx = m[0][0] * x + m[0][1] * y + m[0][2] * z + tx;
+            const Vector ry = m[1][0] * x + m[1][1] * y + m[1][2] * z + ty;
+            const Vector rz = m[2][0] * x + m[2][1] * y + m[2][2] * z + tz;
+            std::memcpy(&out.x[i], &rx, sizeof(Vector));
+            std::memcpy(&out.y[i], &ry, sizeof(Vector));
+            std::memcpy(&out.z[i], &rz, sizeof(Vector));
+        }
+    }
+};